@@ -0,0 +1,397 @@
+import argparse
+import functools
+import json
+import os
+import runpy
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# problem sizes used by --quick, same as validation.py
+QUICK_ARGS = {
+    "binary_tree": "10",
+    "fannkuch": "7",
+    "fasta": "1000",
+    "mandelbrot": "200",
+    "spectralnorm": "100"
+}
+
+# hardware (and a few software) events recorded with `perf stat`
+PERF_EVENTS = [
+    "cycles",
+    "instructions",
+    "cache-references",
+    "cache-misses",
+    "branch-misses",
+    "page-faults",
+    "context-switches",
+    "cpu-migrations"
+]
+
+
+def exec_script(concurrency, chunksize, script, script_args):
+    """
+    Run a benchmark script in this process, with `concurrency` and `chunksize`
+    as the defaults of the map functions. Scripts which size their own worker
+    pools see `concurrency` as the CPU count.
+    """
+    script_dir = os.path.dirname(os.path.abspath(script))
+    os.chdir(script_dir)
+    sys.path.insert(0, script_dir)
+    sys.argv = [script] + script_args
+
+    def with_defaults(f):
+        @functools.wraps(f)
+        def wrapped(*args, **kwargs):
+            if concurrency > 0:
+                kwargs.setdefault("concurrency", concurrency)
+            if chunksize > 0:
+                kwargs.setdefault("chunksize", chunksize)
+            return f(*args, **kwargs)
+        return wrapped
+
+    if concurrency == 0 and chunksize == 0:
+        runpy.run_path(script, run_name="__main__")
+        return
+
+    if concurrency > 0:
+        import multiprocessing
+        os.cpu_count = lambda: concurrency
+        multiprocessing.cpu_count = lambda: concurrency
+
+    if os.path.exists(os.path.join(script_dir, "wrappers.py")):
+        # wrappers.starmap() calls wrappers.map() positionally, so change the
+        # defaults in place rather than wrapping them
+        import wrappers
+        for f in [wrappers.map, wrappers.starmap]:
+            names = f.__code__.co_varnames[:f.__code__.co_argcount]
+            defaults = list(f.__defaults__)
+            offset = len(names) - len(defaults)
+            for name, value in [("concurrency", concurrency),
+                                ("chunksize", chunksize)]:
+                if value > 0:
+                    defaults[names.index(name) - offset] = value
+            f.__defaults__ = tuple(defaults)
+    else:
+        try:
+            import snakefish
+        except ImportError:
+            snakefish = None
+        if snakefish is not None:
+            for name in ["map", "starmap", "parallel_for"]:
+                setattr(snakefish, name,
+                        with_defaults(getattr(snakefish, name)))
+
+    runpy.run_path(script, run_name="__main__")
+
+
+def parse_perf_output(path):
+    counters = {}
+    with open(path, "r") as f:
+        for line in f:
+            fields = line.strip().split(",")
+            if len(fields) < 3 or line.startswith("#"):
+                continue
+            value, event = fields[0], fields[2]
+            try:
+                counters[event] = float(value)
+            except ValueError:  # <not supported> or <not counted>
+                counters[event] = None
+    return counters
+
+
+def run_once(target, benchmark, concurrency, chunksize, args, use_perf):
+    script = os.path.join(BENCH_DIR, target, "%s.py" % benchmark)
+    cmd = [sys.executable, os.path.abspath(__file__), "--exec",
+           str(concurrency), str(chunksize), script] + args
+
+    perf_file = None
+    if use_perf:
+        fd, perf_file = tempfile.mkstemp(suffix=".perf")
+        os.close(fd)
+        cmd = ["perf", "stat", "-x", ",", "-e", ",".join(PERF_EVENTS),
+               "-o", perf_file, "--"] + cmd
+
+    # wait4() reports the resource usage of the script and of the worker
+    # processes it joined
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE)
+    stderr = proc.stderr.read()
+    _, status, rusage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    exit_code = os.waitstatus_to_exitcode(status)
+
+    run = {
+        "time": elapsed,
+        "max_rss_kb": rusage.ru_maxrss,
+        "voluntary_ctx_switches": rusage.ru_nvcsw,
+        "involuntary_ctx_switches": rusage.ru_nivcsw,
+        "minor_page_faults": rusage.ru_minflt,
+        "major_page_faults": rusage.ru_majflt,
+        "perf": None
+    }
+    if perf_file is not None:
+        run["perf"] = parse_perf_output(perf_file)
+        os.remove(perf_file)
+
+    if exit_code != 0:
+        print("%s-%s failed with exit code %d:" %
+              (target, benchmark, exit_code))
+        print(stderr.decode(errors="replace"))
+        return None
+    return run
+
+
+def mean_or_none(values):
+    values = [v for v in values if v is not None]
+    return statistics.mean(values) if values else None
+
+
+def measure(target, benchmark, concurrency, chunksize, args, opts):
+    runs = []
+    for _ in range(opts.runs):
+        run = run_once(target, benchmark, concurrency, chunksize, args,
+                       opts.perf)
+        if run is None:
+            return None
+        runs.append(run)
+
+    times = [run["time"] for run in runs]
+    result = {
+        "target": target,
+        "benchmark": benchmark,
+        "concurrency": concurrency,
+        "chunksize": chunksize,
+        "times": times,
+        "median": statistics.median(times),
+        "min": min(times),
+        "stdev": statistics.stdev(times) if len(times) > 1 else 0.0,
+        "max_rss_kb": max(run["max_rss_kb"] for run in runs)
+    }
+    for key in ["voluntary_ctx_switches", "involuntary_ctx_switches",
+                "minor_page_faults", "major_page_faults"]:
+        result[key] = mean_or_none([run[key] for run in runs])
+    if opts.perf:
+        result["perf"] = {
+            event: mean_or_none([run["perf"].get(event) for run in runs])
+            for event in PERF_EVENTS
+        }
+    return result
+
+
+def get_commit():
+    def git(*args):
+        return subprocess.run(["git"] + list(args), stdout=subprocess.PIPE,
+                              stderr=subprocess.DEVNULL, encoding="utf-8",
+                              cwd=BENCH_DIR).stdout.strip()
+
+    commit = git("rev-parse", "HEAD") or "unknown"
+    dirty = len(git("status", "--porcelain", "--untracked-files=no")) > 0
+    return commit, dirty
+
+
+def get_key(result):
+    return (result["target"], result["benchmark"], result["concurrency"],
+            result["chunksize"])
+
+
+def find_baseline(out_dir, commit, baseline):
+    """
+    Get the latest results of `baseline` (a commit, or a prefix of one), or
+    of any commit but `commit` if it's `None`.
+    """
+    latest = None
+    for file in os.listdir(out_dir):
+        if not file.endswith(".json"):
+            continue
+        with open(os.path.join(out_dir, file), "r") as f:
+            report = json.load(f)
+        if baseline is not None:
+            if not report["commit"].startswith(baseline):
+                continue
+        elif report["commit"] == commit:
+            continue
+        if latest is None or report["timestamp"] > latest["timestamp"]:
+            latest = report
+
+    if latest is None and baseline is not None:
+        print("no results for baseline %s in %s" % (baseline, out_dir))
+        sys.exit(1)
+    return latest
+
+
+def find_regressions(results, base_results, threshold):
+    base = {get_key(r): r for r in base_results}
+    regressions = []
+    for result in results:
+        old = base.get(get_key(result))
+        if old is None or result["target"] == "sequential":
+            continue
+
+        if result["median"] > old["median"] * (1 + threshold):
+            regressions.append({
+                "kind": "time",
+                "key": list(get_key(result)),
+                "old": old["median"],
+                "new": result["median"]
+            })
+        if (result.get("speedup") is not None and
+                old.get("speedup") is not None and
+                result["speedup"] < old["speedup"] * (1 - threshold)):
+            regressions.append({
+                "kind": "speedup",
+                "key": list(get_key(result)),
+                "old": old["speedup"],
+                "new": result["speedup"]
+            })
+    return regressions
+
+
+def parse_ints(s):
+    return [int(x) for x in s.split(",") if x != ""]
+
+
+def main():
+    cpus = os.cpu_count()
+    default_concurrency = sorted(
+        {1 << i for i in range(cpus.bit_length()) if (1 << i) <= cpus} |
+        {cpus})
+
+    parser = argparse.ArgumentParser(
+        description="Sweep concurrency and chunksize for each benchmark, "
+                    "save the results keyed by git commit, and flag "
+                    "regressions against a baseline.")
+    parser.add_argument("--benchmarks", default=None,
+                        help="benchmarks to run, separated by [,] "
+                             "(default: all in snakefish/)")
+    parser.add_argument("--targets", default="snakefish,multiprocessing",
+                        help="targets to sweep, separated by [,] "
+                             "(default: %(default)s)")
+    parser.add_argument("--concurrency", type=parse_ints,
+                        default=default_concurrency,
+                        help="levels of concurrency, separated by [,] "
+                             "(default: powers of 2 up to the CPU count)")
+    parser.add_argument("--chunksize", type=parse_ints, default=[0],
+                        help="chunk sizes, separated by [,], where 0 is the "
+                             "library default (default: 0)")
+    parser.add_argument("--runs", type=int, default=5,
+                        help="runs of each configuration (default: 5)")
+    parser.add_argument("--quick", action="store_true",
+                        help="use the small problem sizes of validation.py")
+    parser.add_argument("--no-perf", dest="perf", action="store_false",
+                        help="don't record perf hardware counters")
+    parser.add_argument("--threshold", type=float, default=0.1,
+                        help="relative slowdown flagged as a regression "
+                             "(default: 0.1)")
+    parser.add_argument("--baseline", default=None,
+                        help="commit to compare against (default: the latest "
+                             "results of another commit)")
+    parser.add_argument("--out-dir", default=os.path.join(BENCH_DIR,
+                                                          "results"),
+                        help="where results are stored (default: results/)")
+    opts = parser.parse_args()
+
+    if opts.perf and subprocess.run(["which", "perf"],
+                                    stdout=subprocess.DEVNULL).returncode:
+        print("perf not found, not recording hardware counters")
+        opts.perf = False
+
+    targets = opts.targets.split(",")
+    if opts.benchmarks is not None:
+        benchmarks = opts.benchmarks.split(",")
+    else:
+        benchmarks = sorted(f[:-3] for f in os.listdir(
+            os.path.join(BENCH_DIR, "snakefish")) if f.endswith(".py"))
+
+    # fail early if the baseline is missing
+    commit, dirty = get_commit()
+    os.makedirs(opts.out_dir, exist_ok=True)
+    base = find_baseline(opts.out_dir, commit, opts.baseline)
+
+    # run benchmarks, with the sequential version as the reference for
+    # speedups
+    results = []
+    for benchmark in benchmarks:
+        args = [QUICK_ARGS[benchmark]] if (opts.quick and
+                                           benchmark in QUICK_ARGS) else []
+
+        print("running sequential-%s" % benchmark)
+        reference = measure("sequential", benchmark, 0, 0, args, opts)
+        if reference is not None:
+            results.append(reference)
+
+        for target in targets:
+            for concurrency in opts.concurrency:
+                for chunksize in opts.chunksize:
+                    print("running %s-%s (concurrency=%d, chunksize=%d)" %
+                          (target, benchmark, concurrency, chunksize))
+                    result = measure(target, benchmark, concurrency,
+                                     chunksize, args, opts)
+                    if result is None:
+                        continue
+                    if reference is not None:
+                        result["speedup"] = (reference["median"] /
+                                             result["median"])
+                    results.append(result)
+
+    # compare snakefish with multiprocessing at each point of the sweep
+    by_key = {get_key(r): r for r in results}
+    for result in results:
+        if result["target"] != "snakefish":
+            continue
+        other = by_key.get(("multiprocessing",) + get_key(result)[1:])
+        if other is not None:
+            result["vs_multiprocessing"] = other["median"] / result["median"]
+
+    report = {
+        "commit": commit,
+        "dirty": dirty,
+        "timestamp": int(time.time()),
+        "cpu_count": cpus,
+        "python": sys.version,
+        "config": {
+            "targets": targets,
+            "benchmarks": benchmarks,
+            "concurrency": opts.concurrency,
+            "chunksize": opts.chunksize,
+            "runs": opts.runs,
+            "quick": opts.quick
+        },
+        "results": results,
+        "baseline": None,
+        "regressions": []
+    }
+
+    if base is not None:
+        report["baseline"] = base["commit"]
+        report["regressions"] = find_regressions(results, base["results"],
+                                                 opts.threshold)
+
+    # dump json
+    name = commit + ("-dirty" if dirty else "")
+    with open(os.path.join(opts.out_dir, "%s.json" % name), 'w') as f:
+        json.dump(report, f, indent=2)
+
+    if base is None:
+        print("no baseline to compare against")
+        return 0
+    for r in report["regressions"]:
+        print("REGRESSION (%s) %s: %.3f -> %.3f" %
+              (r["kind"], "-".join(str(k) for k in r["key"]), r["old"],
+               r["new"]))
+    print("%d regression(s) against %s" %
+          (len(report["regressions"]), base["commit"]))
+    return 1 if report["regressions"] else 0
+
+
+if __name__ == '__main__':
+    if len(sys.argv) >= 5 and sys.argv[1] == "--exec":
+        exec_script(int(sys.argv[2]), int(sys.argv[3]), sys.argv[4],
+                    sys.argv[5:])
+    else:
+        sys.exit(main())
@@ -1,4 +1,3 @@
-from itertools import repeat
 from math import sqrt
 from sys import argv
 import snakefish
@@ -23,25 +22,30 @@ def At_sum(u, i):
     return x
 
 
-def multiply_AtAv(u):
-    r = range(len(u))
+def multiply_AtAv(u, tmp, v):
+    # the vectors live in shared memory, so the workers only get index ranges
+    # and write their results in place
+    def A_part(start, end):
+        for i in range(start, end):
+            tmp[i] = A_sum(u, i)
 
-    tmp = snakefish.starmap(
-        A_sum,
-        zip(repeat(u), r)
-    )
-    return snakefish.starmap(
-        At_sum,
-        zip(repeat(tmp), r)
-    )
+    def At_part(start, end):
+        for i in range(start, end):
+            v[i] = At_sum(tmp, i)
+
+    snakefish.parallel_for(A_part, len(u))
+    snakefish.parallel_for(At_part, len(u))
 
 
 def main(n):
-    u = [1] * n
+    arrays = [snakefish.SharedArray(n) for _ in range(3)]
+    u, v, tmp = (memoryview(a) for a in arrays)
+    for i in range(n):
+        u[i] = 1.0
 
     for _ in range(10):
-        v = multiply_AtAv(u)
-        u = multiply_AtAv(v)
+        multiply_AtAv(u, tmp, v)
+        multiply_AtAv(v, tmp, u)
 
     vBv = vv = 0
 
@@ -52,6 +56,11 @@ def main(n):
     result = sqrt(vBv/vv)
     print("{0:.9f}".format(result))
 
+    for view in (u, v, tmp):
+        view.release()
+    for a in arrays:
+        a.dispose()
+
 
 if __name__ == '__main__':
     if len(argv) > 1:
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+#include "affinity.h"
+
+namespace snakefish {
+
+/**
+ * \brief The CPUs this process may run on, as read once from `/sys`.
+ */
+struct topology {
+  std::vector<int> spread;       // see `get_spread_cpus()`
+  std::map<int, int> node_of;    // NUMA node of each CPU
+  unsigned physical_cores = 1;
+};
+
+/**
+ * \brief Read an integer from a file in `/sys`, or return `fallback`.
+ */
+static int read_int(const std::string &path, const int fallback) {
+  std::ifstream in(path);
+  int value;
+  if (in >> value)
+    return value;
+  return fallback;
+}
+
+/**
+ * \brief Find the NUMA node of `cpu`, i.e. the `nodeN` link in its directory.
+ */
+static int read_cpu_node(const int cpu) {
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr)
+    return -1;
+
+  int node = -1;
+  while (struct dirent *entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.compare(0, 4, "node") == 0 && name.size() > 4 &&
+        name.find_first_not_of("0123456789", 4) == std::string::npos) {
+      node = std::stoi(name.substr(4));
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+/**
+ * \brief Get the CPUs this process may run on.
+ */
+static std::vector<int> get_allowed_cpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set))
+        cpus.push_back(cpu);
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    int n = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    for (int cpu = 0; cpu < n; cpu++)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+/**
+ * \brief Append the CPUs of `by_node` to `out`, alternating between nodes.
+ */
+static void interleave(const std::map<int, std::vector<int>> &by_node,
+                       std::vector<int> &out) {
+  for (size_t i = 0;; i++) {
+    bool any = false;
+    for (const auto &node : by_node) {
+      if (i < node.second.size()) {
+        out.push_back(node.second[i]);
+        any = true;
+      }
+    }
+    if (!any)
+      return;
+  }
+}
+
+static topology read_topology() {
+  topology t;
+  std::map<std::pair<int, int>, int> cores; // (package, core) -> first CPU
+  std::map<int, std::vector<int>> primaries, siblings; // by node
+
+  for (int cpu : get_allowed_cpus()) {
+    std::string dir =
+        "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+    int package = read_int(dir + "physical_package_id", 0);
+    int core = read_int(dir + "core_id", cpu);
+    int node = read_cpu_node(cpu);
+    t.node_of[cpu] = node;
+
+    if (cores.emplace(std::make_pair(package, core), cpu).second) {
+      primaries[node].push_back(cpu);
+    } else {
+      siblings[node].push_back(cpu);
+    }
+  }
+
+  interleave(primaries, t.spread);
+  interleave(siblings, t.spread);
+  t.physical_cores = std::max(static_cast<unsigned>(cores.size()), 1u);
+  return t;
+}
+
+static const topology &get_topology() {
+  static const topology t = read_topology();
+  return t;
+}
+
+unsigned get_physical_cores() { return get_topology().physical_cores; }
+
+std::vector<int> get_spread_cpus() { return get_topology().spread; }
+
+int get_cpu_node(const int cpu) {
+  const topology &t = get_topology();
+  auto it = t.node_of.find(cpu);
+  return (it != t.node_of.end()) ? it->second : read_cpu_node(cpu);
+}
+
+std::vector<int> get_node_cpus(const int node) {
+  std::vector<int> cpus;
+  for (int cpu : get_topology().spread) {
+    if (get_cpu_node(cpu) == node)
+      cpus.push_back(cpu);
+  }
+  if (cpus.empty()) {
+    throw std::runtime_error("no CPU of NUMA node " + std::to_string(node) +
+                             " is available");
+  }
+  return cpus;
+}
+
+placement resolve_placement(const std::vector<int> &cpus,
+                            const int numa_node) {
+  for (int cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+      throw std::runtime_error("invalid CPU " + std::to_string(cpu));
+  }
+
+  placement p;
+  p.cpus = (cpus.empty() && numa_node >= 0) ? get_node_cpus(numa_node) : cpus;
+  p.numa_node = numa_node;
+  if (numa_node < 0 && !cpus.empty()) {
+    int node = get_cpu_node(cpus[0]);
+    bool same = std::all_of(cpus.begin(), cpus.end(), [node](int cpu) {
+      return get_cpu_node(cpu) == node;
+    });
+    p.numa_node = same ? node : -1;
+  }
+  return p;
+}
+
+placement get_worker_placement(const unsigned i, const std::vector<int> &cpus,
+                               const int numa_node) {
+  std::vector<int> candidates;
+  if (!cpus.empty()) {
+    candidates = cpus;
+  } else if (numa_node >= 0) {
+    candidates = get_node_cpus(numa_node);
+  } else {
+    candidates = get_spread_cpus();
+  }
+
+  return resolve_placement({candidates[i % candidates.size()]}, numa_node);
+}
+
+void set_affinity(const std::vector<int> &cpus) {
+  if (cpus.empty())
+    return;
+
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set))
+    perror("sched_setaffinity() failed");
+#endif
+}
+
+void bind_to_node(void *p, const size_t len, const int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+  const size_t bits = 8 * sizeof(unsigned long);
+  unsigned long mask[1024 / bits] = {0};
+  if (node < 0 || static_cast<size_t>(node) >= 1024)
+    return;
+
+  // preferred rather than bound, so that a full node doesn't mean OOM
+  mask[node / bits] |= 1ul << (node % bits);
+  syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, 1024, MPOL_MF_MOVE);
+#else
+  (void)p;
+  (void)len;
+  (void)node;
+#endif
+}
+
+} // namespace snakefish
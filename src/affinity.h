@@ -0,0 +1,94 @@
+/**
+ * \file affinity.h
+ *
+ * \brief CPU affinity and NUMA placement of threads, generators and map
+ * workers.
+ */
+
+#ifndef SNAKEFISH_AFFINITY_H
+#define SNAKEFISH_AFFINITY_H
+
+#include <cstddef>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace snakefish {
+
+/**
+ * \brief Where a process should run.
+ */
+struct placement {
+  std::vector<int> cpus; // CPUs it may run on, or empty for any CPU
+  int numa_node = -1;    // NUMA node of its memory, or -1 for no preference
+};
+
+/**
+ * \brief Get the number of physical cores this process may run on (i.e. not
+ * counting SMT siblings). This is at least 1.
+ */
+unsigned get_physical_cores();
+
+/**
+ * \brief Get the CPUs this process may run on, in the order workers should be
+ * placed on them: one CPU per physical core first, alternating between NUMA
+ * nodes, and then their SMT siblings in the same order.
+ */
+std::vector<int> get_spread_cpus();
+
+/**
+ * \brief Get the NUMA node of `cpu`, or -1 if it's unknown.
+ */
+int get_cpu_node(int cpu);
+
+/**
+ * \brief Get the CPUs of NUMA node `node` this process may run on.
+ *
+ * \throws std::runtime_error If there's no such CPU.
+ */
+std::vector<int> get_node_cpus(int node);
+
+/**
+ * \brief Fill in a placement: the CPUs of `numa_node` if there are no CPUs,
+ * and the node of the CPUs if there's no node and they're all on the same
+ * node.
+ *
+ * \throws std::runtime_error See `get_node_cpus()`.
+ */
+placement resolve_placement(const std::vector<int> &cpus, int numa_node);
+
+/**
+ * \brief Get the placement of worker `i` out of many.
+ *
+ * Workers are placed on the CPUs in `cpus` (or on `get_spread_cpus()`,
+ * restricted to `numa_node` if it's not -1, if `cpus` is empty) in a
+ * round-robin fashion, one CPU each, with their memory on the node of that
+ * CPU.
+ *
+ * \throws std::runtime_error See `get_node_cpus()`.
+ */
+placement get_worker_placement(unsigned i, const std::vector<int> &cpus,
+                               int numa_node);
+
+/**
+ * \brief Restrict the calling process to `cpus`. This is a no-op if `cpus` is
+ * empty.
+ *
+ * This is meant to be called by a child right after it's forked, so failures
+ * are reported to `stderr` but otherwise ignored.
+ */
+void set_affinity(const std::vector<int> &cpus);
+
+/**
+ * \brief Ask for the pages of `len` bytes at `p` (page aligned) to be
+ * allocated on NUMA node `node`, moving the ones already allocated if
+ * possible. This is a no-op if `node` is -1.
+ *
+ * This is only an optimization, so failures (e.g. if the kernel doesn't
+ * support NUMA) are ignored.
+ */
+void bind_to_node(void *p, size_t len, int node);
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_AFFINITY_H
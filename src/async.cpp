@@ -0,0 +1,166 @@
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+#include "async.h"
+
+namespace snakefish {
+
+/**
+ * \brief How long (in seconds) to wait between attempts when there's no file
+ * descriptor to register with the event loop.
+ */
+static const double POLL_INTERVAL = 0.001;
+
+/**
+ * \brief An operation that can be retried until it completes.
+ */
+struct async_op {
+  /**
+   * \brief Try to complete the operation without blocking.
+   *
+   * \returns `true` if completed, with the result stored in `result`.
+   */
+  std::function<bool(py::object &result)> attempt;
+
+  /**
+   * \brief File descriptor that becomes readable when `attempt` may succeed,
+   * or -1 if there's none.
+   */
+  int fd;
+
+  /**
+   * \brief Called before the first attempt and after the last one, if set.
+   */
+  std::function<void()> begin, end;
+
+  /**
+   * \brief Called before every attempt, if set.
+   */
+  std::function<void()> clear;
+};
+
+/**
+ * \brief Run `op` on the running event loop.
+ *
+ * \returns An `asyncio.Future` resolving to the result of `op`.
+ */
+static py::object run_async(const async_op &op, const py::object &owner) {
+  py::object loop = py::module::import("asyncio").attr("get_running_loop")();
+  py::object future = loop.attr("create_future")();
+
+  // try once, and tell whether the future is done
+  auto attempt = [op, owner, future]() {
+    if (future.attr("done")().cast<bool>())
+      return true;
+    if (op.clear)
+      op.clear();
+
+    try {
+      py::object result;
+      if (!op.attempt(result))
+        return false;
+      future.attr("set_result")(result);
+    } catch (py::error_already_set &e) {
+      py::object value = e.value();
+      if (py::isinstance(value, PyExc_StopIteration)) {
+        value = py::module::import("builtins").attr("StopAsyncIteration")();
+      }
+      future.attr("set_exception")(value);
+    } catch (const std::exception &e) {
+      future.attr("set_exception")(
+          py::module::import("builtins").attr("RuntimeError")(e.what()));
+    }
+    return true;
+  };
+
+  // register before the first attempt, so that nothing goes unnoticed
+  if (op.begin)
+    op.begin();
+  if (attempt()) {
+    if (op.end)
+      op.end();
+    return future;
+  }
+
+  if (op.fd != -1) {
+    int fd = op.fd;
+    loop.attr("add_reader")(fd, py::cpp_function([attempt]() { attempt(); }));
+
+    // this also runs if the future is cancelled
+    std::function<void()> end = op.end;
+    future.attr("add_done_callback")(
+        py::cpp_function([loop, fd, end](const py::object &) {
+          loop.attr("remove_reader")(fd);
+          if (end)
+            end();
+        }));
+  } else {
+    // nothing to register, so retry on a timer
+    auto retry = std::make_shared<py::object>();
+    *retry = py::cpp_function([attempt, loop, retry]() {
+      if (!attempt())
+        loop.attr("call_later")(POLL_INTERVAL, *retry);
+      else
+        *retry = py::none(); // break the cycle
+    });
+    loop.attr("call_later")(POLL_INTERVAL, *retry);
+
+    std::function<void()> end = op.end;
+    if (end) {
+      future.attr("add_done_callback")(
+          py::cpp_function([end](const py::object &) { end(); }));
+    }
+  }
+
+  return future;
+}
+
+py::object receive_async(channel &c, const py::object &owner) {
+  channel *ch = &c;
+  async_op op;
+  op.attempt = [ch](py::object &result) {
+    try {
+      result = ch->receive_pyobj(false);
+      return true;
+    } catch (const std::out_of_range &e) {
+      return false;
+    }
+  };
+  op.fd = c.get_event_fd();
+  op.begin = [ch]() { ch->begin_wait(); };
+  op.end = [ch]() { ch->end_wait(); };
+  op.clear = [ch]() { ch->clear_event(); };
+  return run_async(op, owner);
+}
+
+py::object join_async(thread &t, const py::object &owner) {
+  thread *th = &t;
+  async_op op;
+  op.attempt = [th](py::object &result) {
+    result = py::none();
+    return th->try_join();
+  };
+  op.fd = t.get_event_fd();
+  return run_async(op, owner);
+}
+
+py::object next_async(generator &g, const py::object &owner) {
+  generator *gen = &g;
+  async_op op;
+  op.attempt = [gen](py::object &result) {
+    try {
+      result = gen->next(false);
+      return true;
+    } catch (const std::out_of_range &e) {
+      return false;
+    }
+  };
+  op.fd = g.get_event_fd();
+  op.begin = [gen]() { gen->begin_wait(); };
+  op.end = [gen]() { gen->end_wait(); };
+  op.clear = [gen]() { gen->clear_event(); };
+  return run_async(op, owner);
+}
+
+} // namespace snakefish
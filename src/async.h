@@ -0,0 +1,61 @@
+/**
+ * \file async.h
+ *
+ * \brief `asyncio` integration.
+ */
+
+#ifndef SNAKEFISH_ASYNC_H
+#define SNAKEFISH_ASYNC_H
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "channel.h"
+#include "generator.h"
+#include "thread.h"
+
+namespace snakefish {
+
+/**
+ * \brief Asynchronous version of `channel::receive_pyobj()`.
+ *
+ * This must be called from a coroutine running in an `asyncio` event loop.
+ * The channel's `eventfd` (see `channel::get_event_fd()`) is registered with
+ * the loop, so awaiting the result doesn't block the loop.
+ *
+ * \param c The channel.
+ * \param owner The Python object wrapping `c`, which is kept alive until the
+ * result is ready.
+ *
+ * \returns An `asyncio.Future` resolving to the received object.
+ *
+ * \throws std::runtime_error If some system call failed.
+ */
+py::object receive_async(channel &c, const py::object &owner);
+
+/**
+ * \brief Asynchronous version of `thread::join()`.
+ *
+ * See `receive_async()`. The thread's pidfd is registered with the loop.
+ *
+ * \returns An `asyncio.Future` resolving to `None` once the thread is joined.
+ *
+ * \throws std::runtime_error If the thread hasn't been started yet.
+ */
+py::object join_async(thread &t, const py::object &owner);
+
+/**
+ * \brief Asynchronous version of `generator::next()`.
+ *
+ * See `receive_async()`. When the generator is exhausted, the future raises
+ * `StopAsyncIteration` instead of `StopIteration`, which futures can't raise.
+ *
+ * \returns An `asyncio.Future` resolving to the next output.
+ *
+ * \throws std::runtime_error If the generator hasn't been started yet.
+ */
+py::object next_async(generator &g, const py::object &owner);
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_ASYNC_H
@@ -0,0 +1,43 @@
+#ifndef SNAKEFISH_BENCH_UTIL_H
+#define SNAKEFISH_BENCH_UTIL_H
+
+#include <cstdio>
+
+#include <pybind11/embed.h>
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+/**
+ * \brief Python functions used by the benchmarks.
+ */
+static const char *BENCH_FUNCS = R"(
+def bench_noop():
+    return None
+
+def bench_work(x):
+    return sum(range(1000)) + x
+
+def bench_gen():
+    while True:
+        yield 0
+)";
+
+static py::object get_bench_func(const char *name) {
+  static bool defined = false;
+  if (!defined) {
+    py::exec(BENCH_FUNCS);
+    defined = true;
+  }
+  return py::module::import("__main__").attr(name);
+}
+
+/**
+ * \brief Flush stdio buffers, so that forked children don't output them again
+ * when they exit.
+ */
+static void flush_before_fork() {
+  fflush(stdout);
+  fflush(stderr);
+}
+
+#endif // SNAKEFISH_BENCH_UTIL_H
@@ -0,0 +1,193 @@
+#ifndef SNAKEFISH_CHANNEL_BENCH_H
+#define SNAKEFISH_CHANNEL_BENCH_H
+
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include "bench_util.h"
+#include "channel.h"
+using namespace snakefish;
+
+/**
+ * \brief Get a channel capacity for messages of `size` bytes.
+ *
+ * With one message in flight at a time, messages never straddle the end of
+ * the buffer if the capacity is a multiple of the message size (including its
+ * length prefix). Otherwise, most laps end with a wrapped message.
+ */
+static size_t get_bench_capacity(const size_t size, const bool wrap) {
+  size_t msg_size = sizeof(size_t) + size;
+  return wrap ? 4 * msg_size + msg_size / 2 : 4 * msg_size;
+}
+
+/**
+ * \brief Send and receive in the same process, which measures the cost of the
+ * channel itself.
+ *
+ * Args: message size, SPSC mode, wraparound.
+ */
+static void BM_ChannelSendReceive(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  bool spsc = state.range(1);
+  bool wrap = state.range(2);
+  channel c(get_bench_capacity(size, wrap), spsc);
+  std::vector<char> bytes(size, 'x');
+
+  for (auto _ : state) {
+    c.send_bytes(bytes.data(), size);
+    buffer buf = c.receive_bytes(true);
+    benchmark::DoNotOptimize(buf.get_ptr());
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * size);
+  c.dispose();
+}
+BENCHMARK(BM_ChannelSendReceive)
+    ->ArgNames({"size", "spsc", "wrap"})
+    ->ArgsProduct({{8, 256, 4 << 10, 64 << 10, 1 << 20}, {0, 1}, {0, 1}});
+
+/**
+ * \brief `receive_view()` instead of `receive_bytes()`. Without wraparound,
+ * this is zero-copy in SPSC mode.
+ *
+ * Args: message size, SPSC mode, wraparound.
+ */
+static void BM_ChannelReceiveView(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  bool spsc = state.range(1);
+  bool wrap = state.range(2);
+  channel c(get_bench_capacity(size, wrap), spsc);
+  std::vector<char> bytes(size, 'x');
+
+  for (auto _ : state) {
+    c.send_bytes(bytes.data(), size);
+    message_view view = c.receive_view(true);
+    benchmark::DoNotOptimize(view.get_ptr());
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * size);
+  c.dispose();
+}
+BENCHMARK(BM_ChannelReceiveView)
+    ->ArgNames({"size", "spsc", "wrap"})
+    ->ArgsProduct({{8, 4 << 10, 1 << 20}, {0, 1}, {0, 1}});
+
+/**
+ * \brief Send and receive small messages in batches, one at a time (batch = 1)
+ * or with `send_bytes_many()` and `receive_bytes_many()`.
+ *
+ * Args: batch size, SPSC mode.
+ */
+static void BM_ChannelBatch(benchmark::State &state) {
+  const size_t size = 64;
+  auto batch = static_cast<size_t>(state.range(0));
+  bool spsc = state.range(1);
+  channel c(4 * batch * (sizeof(size_t) + size), spsc);
+  std::vector<char> bytes(size, 'x');
+  std::vector<message_t> messages(batch, message_t(bytes.data(), size));
+
+  for (auto _ : state) {
+    if (batch == 1) {
+      c.send_bytes(bytes.data(), size);
+      buffer buf = c.receive_bytes(true);
+      benchmark::DoNotOptimize(buf.get_ptr());
+    } else {
+      c.send_bytes_many(messages);
+      std::vector<buffer> bufs = c.receive_bytes_many(batch, true);
+      benchmark::DoNotOptimize(bufs.data());
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * batch);
+  state.SetBytesProcessed(state.iterations() * batch * size);
+  c.dispose();
+}
+BENCHMARK(BM_ChannelBatch)
+    ->ArgNames({"batch", "spsc"})
+    ->ArgsProduct({{1, 16, 256}, {0, 1}});
+
+/**
+ * \brief Round trip between two processes, i.e. twice the one-way latency.
+ *
+ * Args: message size, spin time (microseconds).
+ */
+static void BM_ChannelIpcRoundTrip(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  auto spin_time = static_cast<uint64_t>(state.range(1));
+  channel ping(DEFAULT_CHANNEL_SIZE, true);
+  channel pong(DEFAULT_CHANNEL_SIZE, true);
+  ping.set_spin_time(spin_time);
+  pong.set_spin_time(spin_time);
+  std::vector<char> bytes(size, 'x');
+
+  flush_before_fork();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // echo until an empty-ish message (1 byte) arrives
+    while (true) {
+      buffer buf = ping.receive_bytes(true);
+      pong.send_bytes(buf.get_ptr(), buf.get_len());
+      if (buf.get_len() == 1) {
+        _exit(0);
+      }
+    }
+  } else if (pid < 0) {
+    state.SkipWithError("fork() failed");
+    return;
+  }
+
+  for (auto _ : state) {
+    ping.send_bytes(bytes.data(), size);
+    buffer buf = pong.receive_bytes(true);
+    benchmark::DoNotOptimize(buf.get_ptr());
+  }
+
+  // stop the child
+  char stop = 0;
+  ping.send_bytes(&stop, 1);
+  pong.receive_bytes(true);
+  waitpid(pid, nullptr, 0);
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(2 * state.iterations() * size);
+  ping.dispose();
+  pong.dispose();
+}
+BENCHMARK(BM_ChannelIpcRoundTrip)
+    ->ArgNames({"size", "spin"})
+    ->ArgsProduct({{8, 4 << 10, 1 << 20}, {0, 50}})
+    ->UseRealTime();
+
+/**
+ * \brief `send_pyobj()` and `receive_pyobj()` of a `bytes` object, which adds
+ * pickling to `BM_ChannelSendReceive`.
+ *
+ * Args: object size, out-of-band transport.
+ */
+static void BM_ChannelPyobj(benchmark::State &state) {
+  auto size = static_cast<size_t>(state.range(0));
+  bool out_of_band = state.range(1);
+  channel c(DEFAULT_CHANNEL_SIZE, true, out_of_band);
+  py::object obj = py::module::import("builtins").attr("bytearray")(size);
+
+  for (auto _ : state) {
+    c.send_pyobj(obj);
+    py::object received = c.receive_pyobj(true);
+    benchmark::DoNotOptimize(received.ptr());
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * size);
+  c.dispose();
+}
+BENCHMARK(BM_ChannelPyobj)
+    ->ArgNames({"size", "oob"})
+    ->ArgsProduct({{8, 64 << 10, 4 << 20}, {0, 1}});
+
+#endif // SNAKEFISH_CHANNEL_BENCH_H
@@ -0,0 +1,36 @@
+#ifndef SNAKEFISH_GENERATOR_BENCH_H
+#define SNAKEFISH_GENERATOR_BENCH_H
+
+#include <benchmark/benchmark.h>
+
+#include "bench_util.h"
+#include "generator.h"
+using namespace snakefish;
+
+/**
+ * \brief `next()` on a generator that yields as fast as it can.
+ *
+ * Args: prefetch depth.
+ */
+static void BM_GeneratorNext(benchmark::State &state) {
+  py::function f = get_bench_func("bench_gen");
+  generator g(f, static_cast<uint>(state.range(0)));
+  flush_before_fork();
+  g.start();
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(g.next(true).ptr());
+  }
+
+  g.join();
+  g.dispose();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GeneratorNext)
+    ->ArgName("prefetch")
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(16)
+    ->UseRealTime();
+
+#endif // SNAKEFISH_GENERATOR_BENCH_H
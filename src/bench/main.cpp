@@ -0,0 +1,26 @@
+#include <benchmark/benchmark.h>
+
+#include <pybind11/embed.h>
+namespace py = pybind11;
+
+#include "channel_bench.h"
+#include "generator_bench.h"
+#include "misc_bench.h"
+#include "thread_bench.h"
+
+int main(int argc, char **argv) {
+  py::scoped_interpreter guard{};
+
+  // normally registered when the snakefish module is imported
+  py::class_<message_view>(py::module::import("__main__"), "MessageView",
+                           py::buffer_protocol())
+      .def_buffer(&message_view::get_buffer_info);
+
+  ::benchmark::Initialize(&argc, argv);
+  if (::benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  ::benchmark::RunSpecifiedBenchmarks();
+  ::benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef SNAKEFISH_MISC_BENCH_H
+#define SNAKEFISH_MISC_BENCH_H
+
+#include <algorithm>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "bench_util.h"
+#include "misc.h"
+using namespace snakefish;
+
+/**
+ * \brief `map()` over 1000 small jobs.
+ *
+ * Args: concurrency, dynamic scheduling.
+ */
+static void BM_Map(benchmark::State &state) {
+  py::function f = get_bench_func("bench_work");
+  py::object args = py::eval("range(1000)");
+  auto concurrency = static_cast<uint>(state.range(0));
+  bool dynamic = state.range(1);
+
+  for (auto _ : state) {
+    flush_before_fork();
+    std::vector<py::object> results = map(f, args, concurrency, 0, dynamic);
+    benchmark::DoNotOptimize(results.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * 1000);
+}
+BENCHMARK(BM_Map)
+    ->ArgNames({"concurrency", "dynamic"})
+    ->ArgsProduct({benchmark::CreateRange(
+                       1, std::max(std::thread::hardware_concurrency(), 1u), 2),
+                   {0, 1}})
+    ->UseRealTime();
+
+#endif // SNAKEFISH_MISC_BENCH_H
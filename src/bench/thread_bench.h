@@ -0,0 +1,30 @@
+#ifndef SNAKEFISH_THREAD_BENCH_H
+#define SNAKEFISH_THREAD_BENCH_H
+
+#include <benchmark/benchmark.h>
+
+#include "bench_util.h"
+#include "thread.h"
+using namespace snakefish;
+
+/**
+ * \brief The whole life cycle of a thread running a no-op function: creation,
+ * `start()`, `join()`, `get_result()`, and `dispose()`.
+ */
+static void BM_ThreadStartJoin(benchmark::State &state) {
+  py::function f = get_bench_func("bench_noop");
+
+  for (auto _ : state) {
+    thread t(f);
+    flush_before_fork();
+    t.start();
+    t.join();
+    benchmark::DoNotOptimize(t.get_result().ptr());
+    t.dispose();
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ThreadStartJoin)->UseRealTime();
+
+#endif // SNAKEFISH_THREAD_BENCH_H
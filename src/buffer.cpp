@@ -30,6 +30,10 @@ buffer::buffer(size_t len, buffer_type type) : len(len), type(type) {
 }
 
 buffer::~buffer() {
+  // moved-from
+  if (buf == nullptr)
+    return;
+
   switch (type) {
   case MALLOC:
     free(buf);
@@ -1,32 +1,107 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
+#include <iterator>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "affinity.h"
 #include "channel.h"
+#include "compact.h"
+#include "misc.h"
+#include "shm_pool.h"
 #include "util.h"
 
 namespace snakefish {
 
-channel::channel(const size_t size) : lock(1), n_unread(), capacity(size) {
+static_assert(sizeof(channel_control) <= CHANNEL_CONTROL_SIZE,
+              "channel_control doesn't fit in CHANNEL_CONTROL_SIZE");
+
+/**
+ * \brief What a named channel keeps in its control block, after the
+ * `channel_control`, so that unrelated processes can attach to it.
+ */
+struct named_channel_header {
+  std::atomic_uint64_t magic; // NAMED_CHANNEL_MAGIC once fully created
+  size_t capacity;
+  bool spsc;
+  bool out_of_band;
+  sem_t lock;
+  sem_t n_unread;
+  sem_t space_freed;
+};
+
+const uint64_t NAMED_CHANNEL_MAGIC = 0x31687369666b6e73; // "snkfish1"
+
+const size_t NAMED_HEADER_OFFSET = (sizeof(channel_control) + 63) / 64 * 64;
+
+static_assert(NAMED_HEADER_OFFSET + sizeof(named_channel_header) <=
+                  CHANNEL_CONTROL_SIZE,
+              "named_channel_header doesn't fit in CHANNEL_CONTROL_SIZE");
+
+static named_channel_header *get_named_header(void *mapping) {
+  return reinterpret_cast<named_channel_header *>(static_cast<char *>(mapping) +
+                                                  NAMED_HEADER_OFFSET);
+}
+
+static void check_transport(const bool spsc, const bool out_of_band) {
+  if (out_of_band) {
+#if PY_VERSION_HEX < 0x03080000
+    throw std::runtime_error("out-of-band transport requires Python 3.8+");
+#endif
+    if (!spsc)
+      throw std::runtime_error("out-of-band transport requires SPSC mode");
+  }
+}
+
+channel::channel(const size_t size, const bool spsc, const bool out_of_band,
+                 const bool huge_pages)
+    : named(false), lock(1), n_unread(), space_freed(), capacity(size),
+      spsc(spsc),
+      out_of_band(out_of_band), compact(false), spin_time(DEFAULT_SPIN_TIME),
+      counters(nullptr), event_fd(-1) {
+  check_transport(spsc, out_of_band);
+
   // imports pickle functions
   dumps = py::module::import("pickle").attr("dumps");
   loads = py::module::import("pickle").attr("loads");
+  pickler = py::module::import("pickle").attr("Pickler");
 
   // create shared memory and relevant metadata variables
-  shared_mem = util::get_shared_mem(size, false);
-  start = static_cast<std::atomic_size_t *>(
-      util::get_shared_mem(sizeof(std::atomic_size_t), true));
-  end = static_cast<std::atomic_size_t *>(
-      util::get_shared_mem(sizeof(std::atomic_size_t), true));
-  full = static_cast<std::atomic_bool *>(
-      util::get_shared_mem(sizeof(std::atomic_bool), true));
+  // the control block and the buffer share one recycled mapping, so
+  // creating a channel usually doesn't need any mmap() calls
+  mapping_len = CHANNEL_CONTROL_SIZE + size;
+  if (huge_pages) {
+    size_t page = get_huge_page_size();
+    mapping_len = (mapping_len + page - 1) / page * page;
+  }
+  mapping = get_shared_ring(mapping_len, huge_pages);
+  shared_mem = static_cast<char *>(mapping) + CHANNEL_CONTROL_SIZE;
 
   // initialize metadata
-  start->store(0);
-  end->store(0);
-  full->store(false);
+  // a recycled mapping isn't zero-filled, so the control block is reset
+  control = new (mapping) channel_control();
+  start = &control->start;
+  end = &control->end;
+  full = &control->full;
+  send_waiters = &control->send_waiters;
+  recv_waiters = &control->recv_waiters;
+  tracker = std::make_shared<read_tracker>(start, full, spsc, send_waiters,
+                                           space_freed);
 
   // ensure that shared atomic variables are lock free
   // note that end is of the same type as start
@@ -38,180 +113,1165 @@ channel::channel(const size_t size) : lock(1), n_unread(), capacity(size) {
     fprintf(stderr, "std::atomic_bool is not lock free!\n");
     abort();
   }
+  if (!send_waiters->is_lock_free()) {
+    fprintf(stderr, "std::atomic_uint is not lock free!\n");
+    abort();
+  }
+
+#ifdef __linux__
+  // the eventfd is inherited through fork(), like the shared memory
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd == -1) {
+    perror("eventfd() failed");
+    throw std::runtime_error("eventfd() failed");
+  }
+#endif
+}
+
+channel::channel(const channel_layout &layout, const int event_fd)
+    : mapping(layout.mapping), mapping_len(layout.mapping_len),
+      named(layout.named),
+      control(static_cast<channel_control *>(layout.mapping)),
+      shared_mem(static_cast<char *>(layout.mapping) + CHANNEL_CONTROL_SIZE),
+      lock(semaphore_t::attach(layout.lock)), start(&control->start),
+      end(&control->end), full(&control->full),
+      n_unread(semaphore_t::attach(layout.n_unread)),
+      send_waiters(&control->send_waiters),
+      space_freed(semaphore_t::attach(layout.space_freed)),
+      capacity(layout.capacity), spsc(layout.spsc),
+      out_of_band(layout.out_of_band), compact(layout.compact),
+      spin_time(layout.spin_time),
+      counters(layout.stats_enabled ? &control->stats : nullptr),
+      recv_waiters(&control->recv_waiters), event_fd(event_fd) {
+  dumps = py::module::import("pickle").attr("dumps");
+  loads = py::module::import("pickle").attr("loads");
+  pickler = py::module::import("pickle").attr("Pickler");
+  tracker = std::make_shared<read_tracker>(start, full, spsc, send_waiters,
+                                           space_freed);
+}
+
+channel_layout channel::get_layout() {
+  channel_layout layout;
+  layout.mapping = mapping;
+  layout.mapping_len = mapping_len;
+  layout.capacity = capacity;
+  layout.spsc = spsc;
+  layout.out_of_band = out_of_band;
+  layout.compact = compact;
+  layout.named = named;
+  layout.stats_enabled = counters != nullptr;
+  layout.spin_time = spin_time;
+  layout.lock = lock.get_handle();
+  layout.n_unread = n_unread.get_handle();
+  layout.space_freed = space_freed.get_handle();
+  return layout;
+}
+
+bool channel::is_premapped() {
+  return snakefish::is_premapped(mapping) &&
+         snakefish::is_premapped(lock.get_handle()) &&
+         snakefish::is_premapped(n_unread.get_handle()) &&
+         snakefish::is_premapped(space_freed.get_handle());
+}
+
+/**
+ * \brief Open the backing object of a named channel. See
+ * `channel::create_named()`.
+ */
+static int open_backing(const std::string &name, const int flags) {
+  if (name.empty())
+    throw std::runtime_error("invalid channel name");
+
+  int fd;
+  if (name.find('/') == std::string::npos) {
+    fd = shm_open(("/" + name).c_str(), flags, S_IRUSR | S_IWUSR);
+  } else {
+    fd = open(name.c_str(), flags | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  }
+  if (fd == -1) {
+    perror("open() failed");
+    throw std::runtime_error("cannot open channel " + name);
+  }
+  return fd;
+}
+
+static int remove_backing(const std::string &name) {
+  if (name.find('/') == std::string::npos)
+    return shm_unlink(("/" + name).c_str());
+  return unlink(name.c_str());
+}
+
+/**
+ * \brief Map `len` bytes of `fd` (resizing it first if `resize` is `true`),
+ * and close it.
+ */
+static void *map_backing(const int fd, const size_t len, const bool resize) {
+  if (resize && ftruncate(fd, static_cast<off_t>(len))) {
+    perror("ftruncate() failed");
+    close(fd);
+    throw std::runtime_error("ftruncate() failed");
+  }
+
+  void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap() failed");
+    close(fd);
+    throw std::runtime_error("mmap() failed");
+  }
+
+  if (close(fd)) {
+    perror("close() failed");
+    abort();
+  }
+  return p;
 }
 
-void channel::send_bytes(void *bytes, size_t len) {
+/**
+ * \brief Attach to the named channel mapped at `mapping`.
+ */
+static channel attach_named(void *mapping, const size_t mapping_len) {
+  named_channel_header *h = get_named_header(mapping);
+  channel_layout layout;
+  layout.mapping = mapping;
+  layout.mapping_len = mapping_len;
+  layout.capacity = h->capacity;
+  layout.spsc = h->spsc;
+  layout.out_of_band = h->out_of_band;
+  layout.compact = false;
+  layout.named = true;
+  // statistics are on for every end if the creator enabled them
+  layout.stats_enabled =
+      static_cast<channel_control *>(mapping)->stats.created_at != 0;
+  layout.spin_time = DEFAULT_SPIN_TIME;
+  layout.lock = &h->lock;
+  layout.n_unread = &h->n_unread;
+  layout.space_freed = &h->space_freed;
+  return channel(layout, -1);
+}
+
+channel channel::create_named(const std::string &name, const size_t size,
+                              const bool spsc, const bool out_of_band) {
+#ifdef __APPLE__
+  (void)name;
+  (void)size;
+  (void)spsc;
+  (void)out_of_band;
+  throw std::runtime_error("named channels are not supported on macOS");
+#else
+  check_transport(spsc, out_of_band);
+
+  size_t mapping_len = CHANNEL_CONTROL_SIZE + size;
+  int fd = open_backing(name, O_RDWR | O_CREAT | O_EXCL);
+  void *mapping = nullptr;
+  try {
+    mapping = map_backing(fd, mapping_len, true);
+
+    // the magic number is written last, so that open_named() never sees a
+    // half-initialized channel
+    new (mapping) channel_control();
+    named_channel_header *h = new (get_named_header(mapping))
+        named_channel_header();
+    h->capacity = size;
+    h->spsc = spsc;
+    h->out_of_band = out_of_band;
+    if (sem_init(&h->lock, 1, 1) || sem_init(&h->n_unread, 1, 0) ||
+        sem_init(&h->space_freed, 1, 0)) {
+      perror("sem_init() failed");
+      throw std::runtime_error("sem_init() failed");
+    }
+    h->magic.store(NAMED_CHANNEL_MAGIC, std::memory_order_release);
+  } catch (...) {
+    if (mapping != nullptr)
+      munmap(mapping, mapping_len);
+    remove_backing(name);
+    throw;
+  }
+
+  return attach_named(mapping, mapping_len);
+#endif
+}
+
+channel channel::open_named(const std::string &name) {
+#ifdef __APPLE__
+  (void)name;
+  throw std::runtime_error("named channels are not supported on macOS");
+#else
+  int fd = open_backing(name, O_RDWR);
+  struct stat st;
+  if (fstat(fd, &st)) {
+    perror("fstat() failed");
+    close(fd);
+    throw std::runtime_error("fstat() failed");
+  }
+
+  size_t mapping_len = static_cast<size_t>(st.st_size);
+  if (mapping_len <= CHANNEL_CONTROL_SIZE) {
+    close(fd);
+    throw std::runtime_error(name + " is not a channel");
+  }
+  void *mapping = map_backing(fd, mapping_len, false);
+
+  named_channel_header *h = get_named_header(mapping);
+  if (h->magic.load(std::memory_order_acquire) != NAMED_CHANNEL_MAGIC ||
+      CHANNEL_CONTROL_SIZE + h->capacity != mapping_len) {
+    munmap(mapping, mapping_len);
+    throw std::runtime_error(name +
+                             " is not a channel, or it's still being created");
+  }
+
+  return attach_named(mapping, mapping_len);
+#endif
+}
+
+void channel::unlink_named(const std::string &name) {
+  if (remove_backing(name)) {
+    perror("unlink() failed");
+    throw std::runtime_error("cannot unlink channel " + name);
+  }
+}
+
+/**
+ * \brief Raise `counter` to `val` if it's lower.
+ */
+static inline void record_max(std::atomic_uint64_t &counter,
+                              const uint64_t val) {
+  uint64_t old = counter.load(std::memory_order_relaxed);
+  while (old < val &&
+         !counter.compare_exchange_weak(old, val, std::memory_order_relaxed))
+    ;
+}
+
+/**
+ * \brief Get the time `timeout` seconds from now (now if it's negative). See
+ * `util::clamp_timeout()`.
+ */
+static std::chrono::steady_clock::time_point
+get_deadline(const double timeout) {
+  return std::chrono::steady_clock::now() +
+         std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+             std::chrono::duration<double>(util::clamp_timeout(timeout)));
+}
+
+void channel::send_bytes(void *bytes, size_t len, const bool block,
+                         const double timeout) {
   // no-op
   if (len == 0)
     return;
 
-  acquire_lock();
+  message_t msg(bytes, len);
+  send_messages(&msg, 1, block, timeout);
+}
 
-  // ensure that buffer is large enough
-  size_t size_t_size = sizeof(size_t);
-  size_t n = size_t_size + len;
-  size_t head = start->load();
-  size_t tail = end->load();
-  size_t available_space = 0;
-  if (head < tail)
-    available_space = capacity - (tail - head);
-  else if (head > tail)
-    available_space = head - tail;
-  else if (!(full->load()))
-    available_space = capacity;
-  if (n > available_space) {
-    release_lock();
-    throw std::overflow_error("channel buffer is full");
+void channel::send_messages(const message_t *messages, const size_t count,
+                            const bool block, const double timeout) {
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++)
+    n += sizeof(size_t) + messages[i].second;
+  std::chrono::steady_clock::time_point deadline = get_deadline(timeout);
+
+  if (!spsc)
+    acquire_lock();
+  size_t tail = 0;
+  size_t available_space = wait_for_space(n, tail, block, timeout, deadline);
+
+  // copy the lengths and the bytes into shared buffer
+  size_t new_end = tail;
+  for (size_t i = 0; i < count; i++) {
+    size_t len = messages[i].second;
+    new_end = copy_to_shm(new_end, &len, sizeof(size_t));
+    new_end = copy_to_shm(new_end, messages[i].first, len);
   }
 
-  // copy the length into shared buffer
-  void *len_bytes = &len;
-  size_t new_end = (tail + size_t_size) % capacity;
-  if (new_end > tail) {
-    // no wrapping
-    memcpy(static_cast<char *>(shared_mem) + tail, len_bytes, size_t_size);
-  } else {
-    // wrapping occurred
-    size_t first_half_len = capacity - tail;
-    size_t second_half_len = size_t_size - first_half_len;
-    memcpy(static_cast<char *>(shared_mem) + tail, len_bytes, first_half_len);
-    memcpy(shared_mem, static_cast<char *>(len_bytes) + first_half_len,
-           second_half_len);
+  publish(new_end, n, count, available_space);
+}
+
+size_t
+channel::wait_for_space(const size_t n, size_t &tail, const bool block,
+                        const double timeout,
+                        const std::chrono::steady_clock::time_point deadline) {
+  // ensure that buffer is large enough
+  // in SPSC mode, the receiver may free up space concurrently, which is fine
+  // in SPSC mode, the sender's copy of start can only be behind, so it's
+  // safe to use unless it says there isn't enough space
+  size_t usable = spsc ? capacity - 1 : capacity;
+  size_t head = spsc ? control->cached_start
+                     : start->load(std::memory_order_acquire);
+  tail = end->load(std::memory_order_relaxed);
+  size_t available_space = get_available_space(head, tail);
+  if (spsc && n > available_space) {
+    head = start->load(std::memory_order_acquire);
+    available_space = get_available_space(head, tail);
   }
+  while (n > available_space) {
+    // a request larger than the whole buffer would wait forever
+    bool gave_up = !block || n > usable;
 
-  // copy the bytes into shared buffer
-  tail = new_end;
-  new_end = (new_end + len) % capacity;
-  if (new_end > tail) {
-    // no wrapping
-    memcpy(static_cast<char *>(shared_mem) + tail, bytes, n);
-  } else {
-    // wrapping occurred
-    size_t first_half_len = capacity - tail;
-    size_t second_half_len = len - first_half_len;
-    memcpy(static_cast<char *>(shared_mem) + tail, bytes, first_half_len);
-    memcpy(shared_mem, static_cast<const char *>(bytes) + first_half_len,
-           second_half_len);
+    if (!gave_up) {
+      // register as a waiter before checking again, so that the receiver
+      // can't free up space unnoticed in between
+      send_waiters->fetch_add(1);
+      head = start->load();
+      available_space = get_available_space(head, tail);
+      if (n <= available_space) {
+        send_waiters->fetch_sub(1);
+        break;
+      }
+
+      // wait for the receiver to free up some space
+      if (!spsc)
+        release_lock();
+      bool woken = true;
+      try {
+        util::gil_release nogil;
+        if (timeout < 0) {
+          space_freed.wait();
+        } else {
+          std::chrono::duration<double> remaining =
+              deadline - std::chrono::steady_clock::now();
+          woken = remaining.count() > 0 &&
+                  space_freed.timedwait(remaining.count());
+        }
+      } catch (const std::runtime_error &e) {
+        send_waiters->fetch_sub(1);
+        throw e;
+      }
+      send_waiters->fetch_sub(1);
+      if (!spsc)
+        acquire_lock();
+
+      // the tail may have moved too if there are other senders
+      head = start->load(std::memory_order_acquire);
+      tail = end->load(std::memory_order_relaxed);
+      available_space = get_available_space(head, tail);
+      gave_up = !woken && n > available_space;
+    }
+
+    if (gave_up) {
+      if (counters != nullptr)
+        counters->overflows.fetch_add(1, std::memory_order_relaxed);
+      if (!spsc)
+        release_lock();
+      throw std::overflow_error("channel buffer is full");
+    }
   }
 
+  if (spsc)
+    control->cached_start = head;
+  return available_space;
+}
+
+void channel::publish(const size_t new_end, const size_t n, const size_t count,
+                      const size_t available_space) {
   // update metadata
-  if (n == available_space)
+  // the release store publishes the messages to the receiver in SPSC mode
+  if (!spsc && n == available_space)
     full->store(true);
-  end->store(new_end);
+  end->store(new_end, std::memory_order_release);
+
+  if (counters != nullptr) {
+    counters->messages_sent.fetch_add(count, std::memory_order_relaxed);
+    counters->bytes_sent.fetch_add(n - count * sizeof(size_t),
+                                   std::memory_order_relaxed);
+    size_t usable = spsc ? capacity - 1 : capacity;
+    record_max(counters->peak_occupancy, usable - (available_space - n));
+  }
 
   try {
-    n_unread.post();
+    for (size_t i = 0; i < count; i++)
+      n_unread.post();
   } catch (const std::runtime_error &e) {
-    release_lock();
+    if (!spsc)
+      release_lock();
     throw e;
   }
 
-  release_lock();
+  if (!spsc)
+    release_lock();
+  notify_waiters();
+}
+
+void channel::reserve(const size_t n, const bool block, const double timeout) {
+  if (pending.active)
+    throw std::runtime_error("a message is already being written");
+
+  std::chrono::steady_clock::time_point deadline = get_deadline(timeout);
+  if (!spsc)
+    acquire_lock();
+  size_t tail = 0;
+  pending.space =
+      wait_for_space(sizeof(size_t) + n, tail, block, timeout, deadline);
+
+  pending.active = true;
+  pending.tail = tail;
+  pending.len = 0;
+  pending.block = block;
+  pending.timeout = timeout;
+  pending.deadline = deadline;
+  pending.spilled = false;
 }
 
-void channel::send_pyobj(const py::object &obj) {
+void channel::write_reserved(const void *bytes, const size_t len) {
+  if (!pending.active)
+    throw std::runtime_error("no message is being written");
+
+  size_t offset = (pending.tail + sizeof(size_t) + pending.len) % capacity;
+  if (!pending.spilled && sizeof(size_t) + pending.len + len > pending.space) {
+    // grow in place if the receiver has freed enough space since
+    size_t head = start->load(std::memory_order_acquire);
+    pending.space = get_available_space(head, pending.tail);
+    if (spsc)
+      control->cached_start = head;
+
+    if (sizeof(size_t) + pending.len + len > pending.space) {
+      // waiting for space here would keep the lock from the receivers, so
+      // the message moves to the heap and the buffer is left alone
+      pending.spill.resize(pending.len);
+      copy_from_shm((pending.tail + sizeof(size_t)) % capacity,
+                    &pending.spill[0], pending.len);
+      pending.spilled = true;
+      if (!spsc)
+        release_lock();
+    }
+  }
+
+  if (pending.spilled)
+    pending.spill.append(static_cast<const char *>(bytes), len);
+  else
+    copy_to_shm(offset, bytes, len);
+  pending.len += len;
+}
+
+void channel::commit() {
+  if (!pending.active)
+    throw std::runtime_error("no message is being written");
+  pending.active = false;
+
+  if (pending.spilled) {
+    // whatever time reserve() didn't use is left for the send
+    std::string bytes;
+    bytes.swap(pending.spill);
+    double timeout = pending.timeout;
+    if (timeout >= 0) {
+      std::chrono::duration<double> remaining =
+          pending.deadline - std::chrono::steady_clock::now();
+      timeout = std::max(remaining.count(), 0.0);
+    }
+    message_t msg(bytes.data(), bytes.size());
+    send_messages(&msg, 1, pending.block, timeout);
+    return;
+  }
+
+  size_t len = pending.len;
+  copy_to_shm(pending.tail, &len, sizeof(size_t));
+  size_t n = sizeof(size_t) + len;
+  publish((pending.tail + n) % capacity, n, 1, pending.space);
+}
+
+void channel::cancel_reserved() {
+  if (!pending.active)
+    return;
+  pending.active = false;
+
+  if (pending.spilled)
+    std::string().swap(pending.spill);
+  else if (!spsc)
+    release_lock();
+}
+
+void channel::send_bytes_many(const std::vector<message_t> &messages,
+                              const bool block, const double timeout) {
+  // skip empty messages
+  if (std::none_of(messages.begin(), messages.end(),
+                   [](const message_t &msg) { return msg.second == 0; })) {
+    send_messages(messages.data(), messages.size(), block, timeout);
+    return;
+  }
+
+  std::vector<message_t> non_empty;
+  std::copy_if(messages.begin(), messages.end(), std::back_inserter(non_empty),
+               [](const message_t &msg) { return msg.second > 0; });
+  send_messages(non_empty.data(), non_empty.size(), block, timeout);
+}
+
+void channel::send_pyobj(const py::object &obj, const bool block,
+                         const double timeout, const bool stream) {
+  if (out_of_band) {
+    send_pyobj_out_of_band(&obj, 1, block, timeout);
+    return;
+  }
+
+  encode_buf.clear();
+  if (encode_compact(obj)) {
+    send_bytes(&encode_buf[0], encode_buf.size(), block, timeout);
+    return;
+  }
+
+  if (stream) {
+    // the pickler only needs a write() method
+    channel_writer writer(*this, 0, block, timeout);
+    py::cpp_function write(
+        [&writer](const py::buffer &b) { return writer.write(b); });
+    py::object file = py::module::import("types").attr("SimpleNamespace")(
+        py::arg("write") = write);
+    pickler(file, PICKLE_PROTOCOL).attr("dump")(obj);
+    writer.commit();
+    return;
+  }
+
   // serialize obj to binary and get output
-  py::object bytes = dumps(obj, PICKLE_PROTOCOL);
-  PyObject *mem_view = PyMemoryView_GetContiguous(bytes.ptr(), PyBUF_READ, 'C');
-  Py_buffer *buf = PyMemoryView_GET_BUFFER(mem_view);
+  py::bytes bytes = dumps(obj, PICKLE_PROTOCOL);
+
+  // send
+  send_bytes(PyBytes_AS_STRING(bytes.ptr()), PyBytes_GET_SIZE(bytes.ptr()),
+             block, timeout);
+}
+
+/**
+ * \brief Buffers exported by the objects being pickled.
+ *
+ * The buffers are released when this goes out of scope.
+ */
+struct exported_buffers {
+  ~exported_buffers() {
+    for (Py_buffer &view : views)
+      PyBuffer_Release(&view);
+  }
+
+  std::vector<Py_buffer> views;
+};
+
+void channel::send_pyobj_many(const std::vector<py::object> &objs,
+                              const bool block, const double timeout) {
+  if (out_of_band) {
+    send_pyobj_out_of_band(objs.data(), objs.size(), block, timeout);
+    return;
+  }
+
+  // serialize objs to binary
+  // encode_buf may move while it grows, so compact messages are taken from it
+  // afterwards, and object i is compact iff its range in encode_buf isn't empty
+  size_t count = objs.size();
+  std::vector<py::bytes> pickles(count);
+  std::vector<size_t> offsets(count + 1);
+  encode_buf.clear();
+  for (size_t i = 0; i < count; i++) {
+    if (!encode_compact(objs[i]))
+      pickles[i] = dumps(objs[i], PICKLE_PROTOCOL);
+    offsets[i + 1] = encode_buf.size();
+  }
+
+  std::vector<message_t> messages;
+  messages.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    if (offsets[i + 1] > offsets[i]) {
+      messages.emplace_back(encode_buf.data() + offsets[i],
+                            offsets[i + 1] - offsets[i]);
+    } else {
+      messages.emplace_back(PyBytes_AS_STRING(pickles[i].ptr()),
+                            PyBytes_GET_SIZE(pickles[i].ptr()));
+    }
+  }
+
+  // send
+  send_bytes_many(messages, block, timeout);
+}
+
+void channel::send_pyobj_out_of_band(const py::object *objs,
+                                     const size_t count, const bool block,
+                                     const double timeout) {
+  // serialize objs to binary, collecting large buffers along the way
+  exported_buffers buffers;
+  py::cpp_function buffer_callback([&buffers](py::handle pickle_buffer) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(pickle_buffer.ptr(), &view, PyBUF_ANY_CONTIGUOUS))
+      throw py::error_already_set();
+
+    // small buffers are cheaper to copy than to send separately
+    if (view.len < static_cast<Py_ssize_t>(OUT_OF_BAND_THRESHOLD)) {
+      PyBuffer_Release(&view);
+      return true;
+    }
+
+    buffers.views.push_back(view);
+    return false;
+  });
+  // as in send_pyobj_many(), compact streams are taken from encode_buf once
+  // it has stopped growing, and they have no buffers
+  std::vector<py::bytes> pickles(count);
+  std::vector<size_t> n_buffers(count);
+  std::vector<size_t> offsets(count + 1);
+  encode_buf.clear();
+  for (size_t i = 0; i < count; i++) {
+    size_t n_views = buffers.views.size();
+    if (!encode_compact(objs[i])) {
+      pickles[i] = dumps(objs[i], PICKLE_PROTOCOL_OUT_OF_BAND,
+                         py::arg("buffer_callback") = buffer_callback);
+    }
+    n_buffers[i] = buffers.views.size() - n_views;
+    offsets[i + 1] = encode_buf.size();
+  }
+
+  // for each object, the number of buffers, the pickle stream, and then the
+  // buffers themselves are sent together, so they're received together
+  std::vector<message_t> messages;
+  messages.reserve(2 * count + buffers.views.size());
+  Py_buffer *view = buffers.views.data();
+  for (size_t i = 0; i < count; i++) {
+    messages.emplace_back(&n_buffers[i], sizeof(size_t));
+    if (offsets[i + 1] > offsets[i]) {
+      messages.emplace_back(encode_buf.data() + offsets[i],
+                            offsets[i + 1] - offsets[i]);
+    } else {
+      messages.emplace_back(PyBytes_AS_STRING(pickles[i].ptr()),
+                            PyBytes_GET_SIZE(pickles[i].ptr()));
+    }
+    for (size_t j = 0; j < n_buffers[i]; j++, view++)
+      messages.emplace_back(view->buf, view->len);
+  }
 
   // send
-  send_bytes(buf->buf, buf->len);
+  send_messages(messages.data(), messages.size(), block, timeout);
+}
+
+buffer channel::receive_bytes(const bool block, const double timeout) {
+  wait_for_message(block, timeout);
+  if (!spsc)
+    acquire_lock();
+
+  // get length of bytes
+  size_t len = 0;
+  size_t head = tracker->get_head();
+  acquire_tail(head);
+  head = copy_from_shm(head, &len, sizeof(size_t));
+
+  // get bytes
+  try {
+    buffer buf = buffer(len, buffer_type::MALLOC);
+    head = copy_from_shm(head, buf.get_ptr(), len);
+
+    // update metadata
+    tracker->add(head, true);
+    if (!spsc)
+      release_lock();
+
+    if (counters != nullptr) {
+      counters->messages_received.fetch_add(1, std::memory_order_relaxed);
+      counters->bytes_received.fetch_add(len, std::memory_order_relaxed);
+    }
+    return buf;
+  } catch (const std::bad_alloc &e) {
+    if (!spsc)
+      release_lock();
+    throw e;
+  }
+}
+
+std::vector<buffer> channel::receive_bytes_many(const size_t max_count,
+                                                const bool block,
+                                                const double timeout) {
+  std::vector<buffer> bufs;
+  if (max_count == 0)
+    return bufs;
+
+  // claim the first message, then whatever else is already there
+  wait_for_message(block, timeout);
+  size_t count = 1;
+  while (count < max_count && n_unread.trywait())
+    count++;
+
+  if (!spsc)
+    acquire_lock();
+
+  // the acquire load pairs with the sender's release store in SPSC mode
+  // several messages are read, so the copy of end can't be trusted
+  size_t head = tracker->get_head();
+  control->cached_end = end->load(std::memory_order_acquire);
+  bufs.reserve(count);
+
+  try {
+    for (size_t i = 0; i < count; i++) {
+      size_t len = 0;
+      size_t new_head = copy_from_shm(head, &len, sizeof(size_t));
+      buffer buf = buffer(len, buffer_type::MALLOC);
+      head = copy_from_shm(new_head, buf.get_ptr(), len);
+      bufs.push_back(std::move(buf));
+    }
+  } catch (const std::bad_alloc &e) {
+    if (bufs.empty()) {
+      // give the claims back
+      for (size_t i = 0; i < count; i++)
+        n_unread.post();
+      if (!spsc)
+        release_lock();
+      throw e;
+    }
+
+    // keep what has been received, and give the rest of the claims back
+    for (size_t i = bufs.size(); i < count; i++)
+      n_unread.post();
+  }
+
+  // update metadata
+  tracker->add(head, true);
+  if (!spsc)
+    release_lock();
+
+  if (counters != nullptr) {
+    size_t n = 0;
+    for (buffer &buf : bufs)
+      n += buf.get_len();
+    counters->messages_received.fetch_add(bufs.size(),
+                                          std::memory_order_relaxed);
+    counters->bytes_received.fetch_add(n, std::memory_order_relaxed);
+  }
+  return bufs;
+}
+
+std::vector<py::object> channel::receive_pyobj_many(const size_t max_count,
+                                                    const bool block,
+                                                    const double timeout) {
+  std::vector<py::object> objs;
+  if (max_count == 0)
+    return objs;
+
+  if (out_of_band) {
+    // objects are made of several messages, so take them one by one
+    objs.push_back(receive_pyobj_out_of_band(block, timeout));
+    while (objs.size() < max_count) {
+      try {
+        objs.push_back(receive_pyobj_out_of_band(false, NO_TIMEOUT));
+      } catch (const std::out_of_range &e) {
+        break;
+      }
+    }
+    return objs;
+  }
+
+  // receive & deserialize
+  std::vector<buffer> bufs = receive_bytes_many(max_count, block, timeout);
+  objs.reserve(bufs.size());
+  for (buffer &buf : bufs)
+    objs.push_back(deserialize(buf.get_ptr(), buf.get_len()));
+  return objs;
+}
+
+py::object channel::receive_pyobj(const bool block, const double timeout) {
+  if (out_of_band)
+    return receive_pyobj_out_of_band(block, timeout);
+
+  // receive & deserialize
+  if (spsc) {
+    // unpickle straight from the shared buffer whenever possible
+    message_view view = receive_view(block, timeout);
+    return deserialize(view.get_ptr(), view.get_len());
+  } else {
+    buffer bytes_buf = receive_bytes(block, timeout);
+    return deserialize(bytes_buf.get_ptr(), bytes_buf.get_len());
+  }
+}
+
+bool channel::encode_compact(const py::object &obj) {
+  if (!compact)
+    return false;
+
+  size_t len = encode_buf.size();
+  if (compact_encode(obj, encode_buf))
+    return true;
+  encode_buf.resize(len);
+  return false;
+}
+
+py::object channel::deserialize(void *bytes, const size_t len) {
+  if (snakefish::is_compact(bytes, len))
+    return compact_decode(bytes, len);
+
+  py::object mem_view = py::reinterpret_steal<py::object>(
+      PyMemoryView_FromMemory(static_cast<char *>(bytes), len, PyBUF_READ));
+  return loads(mem_view);
 }
 
-buffer channel::receive_bytes(const bool block) {
-  if (block) {
-    n_unread.wait();
+py::object channel::receive_pyobj_out_of_band(const bool block,
+                                              const double timeout) {
+  // receive the number of buffers
+  size_t n_buffers = 0;
+  {
+    message_view view = receive_view(block, timeout);
+    memcpy(&n_buffers, view.get_ptr(), sizeof(size_t));
+  }
+
+  // the rest has been sent together, so it's already there
+  message_view header = receive_view(true);
+  py::list buffers;
+  for (size_t i = 0; i < n_buffers; i++) {
+    // the views are kept alive by whatever object is built on top of them
+    py::object view =
+        py::cast(new message_view(receive_view(true)),
+                 py::return_value_policy::take_ownership);
+    buffers.append(py::memoryview(view));
+  }
+
+  // deserialize
+  if (n_buffers == 0)
+    return deserialize(header.get_ptr(), header.get_len());
+  py::object mem_view = py::reinterpret_steal<py::object>(
+      PyMemoryView_FromMemory(static_cast<char *>(header.get_ptr()),
+                              header.get_len(), PyBUF_READ));
+  return loads(mem_view, py::arg("buffers") = buffers);
+}
+
+message_view channel::receive_view(const bool block, const double timeout) {
+  if (!spsc) {
+    // with multiple receivers, freeing space out of order isn't possible
+    return message_view(receive_bytes(block, timeout));
+  }
+
+  wait_for_message(block, timeout);
+
+  // get length of bytes
+  size_t len = 0;
+  size_t head = tracker->get_head();
+  acquire_tail(head);
+  head = copy_from_shm(head, &len, sizeof(size_t));
+  if (counters != nullptr) {
+    counters->messages_received.fetch_add(1, std::memory_order_relaxed);
+    counters->bytes_received.fetch_add(len, std::memory_order_relaxed);
+  }
+
+  if (head + len <= capacity) {
+    // no wrapping, hand out a view of the shared buffer
+    void *bytes = static_cast<char *>(shared_mem) + head;
+    uint64_t id = tracker->add((head + len) % capacity, false);
+    return message_view(tracker, id, bytes, len);
   } else {
+    // wrapping occurred, so a copy is needed
+    buffer buf = buffer(len, buffer_type::MALLOC);
+    head = copy_from_shm(head, buf.get_ptr(), len);
+    tracker->add(head, true);
+    return message_view(std::move(buf));
+  }
+}
+
+void channel::acquire_lock() {
+  if (counters == nullptr) {
+    if (!lock.trywait()) {
+      util::gil_release nogil;
+      lock.wait(spin_time);
+    }
+    return;
+  }
+
+  counters->lock_acquisitions.fetch_add(1, std::memory_order_relaxed);
+  if (!lock.trywait()) {
+    uint64_t t0 = get_timestamp();
+    {
+      util::gil_release nogil;
+      lock.wait(spin_time);
+    }
+    counters->lock_contentions.fetch_add(1, std::memory_order_relaxed);
+    counters->lock_wait_time.fetch_add(get_timestamp() - t0,
+                                       std::memory_order_relaxed);
+  }
+}
+
+void channel::wait_for_message(const bool block, const double timeout) {
+  if (!block) {
     if (!n_unread.trywait()) {
       throw std::out_of_range("out-of-bounds read detected");
     }
+    return;
   }
-  acquire_lock();
 
-  // get length of bytes
-  size_t size_t_size = sizeof(size_t);
-  buffer len_buf = buffer(size_t_size, buffer_type::MALLOC);
-  void *len_bytes = len_buf.get_ptr();
-
-  size_t head = start->load();
-  size_t new_start = (head + size_t_size) % capacity;
-  if (new_start > head) {
-    // no wrapping
-    memcpy(len_bytes, static_cast<char *>(shared_mem) + head, size_t_size);
-  } else {
+  if (!n_unread.trywait()) {
+    uint64_t t0 = (counters != nullptr) ? get_timestamp() : 0;
+    bool received = true;
+    {
+      util::gil_release nogil;
+      if (timeout < 0)
+        n_unread.wait(spin_time);
+      else
+        received = n_unread.timedwait(timeout);
+    }
+
+    if (counters != nullptr) {
+      counters->blocked_receives.fetch_add(1, std::memory_order_relaxed);
+      counters->blocked_receive_time.fetch_add(get_timestamp() - t0,
+                                               std::memory_order_relaxed);
+    }
+    if (!received) {
+      throw std::out_of_range("receive timed out");
+    }
+  }
+}
+
+size_t channel::get_available_space(const size_t head, const size_t tail) {
+  if (spsc) {
+    // one byte is always kept unused, so head == tail means empty
+    return capacity - 1 - (tail + capacity - head) % capacity;
+  }
+
+  if (head < tail)
+    return capacity - (tail - head);
+  else if (head > tail)
+    return head - tail;
+  else if (!(full->load()))
+    return capacity;
+  else
+    return 0;
+}
+
+size_t channel::copy_to_shm(const size_t offset, const void *bytes,
+                            const size_t len) {
+  std::unique_ptr<util::gil_release> nogil;
+  if (len >= GIL_RELEASE_THRESHOLD)
+    nogil.reset(new util::gil_release());
+
+  size_t first_half_len = std::min(len, capacity - offset);
+  size_t second_half_len = len - first_half_len;
+  memcpy(static_cast<char *>(shared_mem) + offset, bytes, first_half_len);
+  if (second_half_len > 0) {
     // wrapping occurred
-    size_t first_half_len = capacity - head;
-    size_t second_half_len = size_t_size - first_half_len;
-    memcpy(len_bytes, static_cast<char *>(shared_mem) + head, first_half_len);
-    memcpy(static_cast<char *>(len_bytes) + first_half_len, shared_mem,
+    memcpy(shared_mem, static_cast<const char *>(bytes) + first_half_len,
            second_half_len);
   }
 
-  // get bytes
-  size_t len = *static_cast<size_t *>(len_bytes);
-  buffer buf = buffer(len, buffer_type::MALLOC);
-  char *bytes = static_cast<char *>(buf.get_ptr());
-
-  head = new_start;
-  new_start = (new_start + len) % capacity;
-  if (new_start > head) {
-    // no wrapping
-    memcpy(bytes, static_cast<char *>(shared_mem) + head, len);
-  } else {
+  return (offset + len) % capacity;
+}
+
+size_t channel::copy_from_shm(const size_t offset, void *bytes,
+                              const size_t len) {
+  std::unique_ptr<util::gil_release> nogil;
+  if (len >= GIL_RELEASE_THRESHOLD)
+    nogil.reset(new util::gil_release());
+
+  size_t first_half_len = std::min(len, capacity - offset);
+  size_t second_half_len = len - first_half_len;
+  memcpy(bytes, static_cast<char *>(shared_mem) + offset, first_half_len);
+  if (second_half_len > 0) {
     // wrapping occurred
-    size_t first_half_len = capacity - head;
-    size_t second_half_len = len - first_half_len;
-    memcpy(bytes, static_cast<char *>(shared_mem) + head, first_half_len);
-    memcpy(bytes + first_half_len, shared_mem, second_half_len);
+    memcpy(static_cast<char *>(bytes) + first_half_len, shared_mem,
+           second_half_len);
   }
 
-  // update metadata
-  full->store(false);
-  start->store(new_start);
-  release_lock();
+  return (offset + len) % capacity;
+}
 
-  return buf;
+void channel::enable_stats() {
+  if (counters != nullptr)
+    return;
+
+  counters = new (&control->stats) channel_stats();
+  counters->created_at = get_timestamp();
 }
 
-py::object channel::receive_pyobj(const bool block) {
-  // receive & deserialize
-  buffer bytes_buf = receive_bytes(block);
-  py::handle mem_view = py::handle(
-      PyMemoryView_FromMemory(static_cast<char *>(bytes_buf.get_ptr()),
-                              bytes_buf.get_len(), PyBUF_READ));
-  py::object obj = loads(mem_view);
+py::dict channel::stats() {
+  if (counters == nullptr)
+    throw std::runtime_error("stats are not enabled");
 
-  return obj;
+  size_t head = start->load(std::memory_order_relaxed);
+  size_t tail = end->load(std::memory_order_relaxed);
+  size_t usable = spsc ? capacity - 1 : capacity;
+
+  py::dict d;
+  d["timestamp"] = get_timestamp();
+  d["created_at"] = counters->created_at;
+  d["occupancy"] = usable - get_available_space(head, tail);
+  d["messages_sent"] = counters->messages_sent.load();
+  d["bytes_sent"] = counters->bytes_sent.load();
+  d["peak_occupancy"] = counters->peak_occupancy.load();
+  d["overflows"] = counters->overflows.load();
+  d["messages_received"] = counters->messages_received.load();
+  d["bytes_received"] = counters->bytes_received.load();
+  d["blocked_receives"] = counters->blocked_receives.load();
+  d["blocked_receive_time"] = counters->blocked_receive_time.load();
+  d["lock_acquisitions"] = counters->lock_acquisitions.load();
+  d["lock_contentions"] = counters->lock_contentions.load();
+  d["lock_wait_time"] = counters->lock_wait_time.load();
+  return d;
+}
+
+void channel::notify_waiters() {
+  if (event_fd == -1)
+    return;
+
+  // pairs with wait(), which registers before checking n_unread
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (recv_waiters->load(std::memory_order_relaxed) == 0)
+    return;
+
+  uint64_t one = 1;
+  // EAGAIN means the counter is saturated, so it's readable anyway
+  if (write(event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    perror("write() failed");
+    throw std::runtime_error("write() failed");
+  }
+}
+
+void channel::acquire_tail(const size_t head) {
+  if (spsc && head != control->cached_end)
+    return;
+
+  size_t tail = end->load(std::memory_order_acquire);
+  if (spsc)
+    control->cached_end = tail;
+}
+
+void channel::clear_event() {
+  if (event_fd == -1)
+    return;
+
+  uint64_t val;
+  if (read(event_fd, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+    perror("read() failed");
+    throw std::runtime_error("read() failed");
+  }
+}
+
+void channel::set_numa_node(const int node) {
+  bind_to_node(mapping, mapping_len, node);
 }
 
 void channel::dispose() {
-  if (munmap(shared_mem, capacity)) {
-    perror("munmap() failed");
+  tracker->detach();
+  if (named) {
+    // the semaphores are in the mapping, and other processes may use them
+    if (munmap(mapping, mapping_len)) {
+      perror("munmap() failed");
+      abort();
+    }
+    return;
+  }
+
+  try {
+    free_shared_ring(mapping, mapping_len);
+  } catch (...) {
     abort();
   }
-  if (munmap(start, sizeof(std::atomic_size_t))) {
-    perror("munmap() failed");
+  if (event_fd != -1 && close(event_fd)) {
+    perror("close() failed");
     abort();
   }
-  if (munmap(end, sizeof(std::atomic_size_t))) {
-    perror("munmap() failed");
+  try {
+    lock.destroy();
+  } catch (...) {
     abort();
   }
-  if (munmap(full, sizeof(std::atomic_bool))) {
-    perror("munmap() failed");
+  try {
+    n_unread.destroy();
+  } catch (...) {
     abort();
   }
   try {
-    lock.destroy();
+    space_freed.destroy();
   } catch (...) {
     abort();
   }
+}
+
+size_t read_tracker::get_head() {
+  if (pending.empty())
+    return start->load(std::memory_order_relaxed);
+  else
+    return head;
+}
+
+uint64_t read_tracker::add(const size_t new_head, const bool released) {
+  pending.emplace_back(new_head, released);
+  head = new_head;
+  uint64_t id = first_id + pending.size() - 1;
+
+  if (released)
+    reclaim();
+  return id;
+}
+
+void read_tracker::release(const uint64_t id) {
+  if (id < first_id || id - first_id >= pending.size()) {
+    fprintf(stderr, "unknown message id: %llu!\n",
+            static_cast<unsigned long long>(id));
+    abort();
+  }
+
+  pending[id - first_id].second = true;
+  reclaim();
+}
+
+void read_tracker::reclaim() {
+  bool freed = false;
+  size_t new_start = 0;
+  while (!pending.empty() && pending.front().second) {
+    new_start = pending.front().first;
+    pending.pop_front();
+    first_id++;
+    freed = true;
+  }
+
+  // in non-SPSC mode, the caller holds the channel's lock
+  if (freed && !detached) {
+    if (!spsc)
+      full->store(false);
+    start->store(new_start, std::memory_order_release);
+
+    // pairs with the sender registering as a waiter and then checking start
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (send_waiters->load(std::memory_order_relaxed) > 0)
+      space_freed.post();
+  }
+}
+
+void message_view::release() {
+  if (tracker != nullptr) {
+    tracker->release(id);
+    tracker.reset();
+  }
+  copy.reset();
+  ptr = nullptr;
+  len = 0;
+}
+
+channel_writer::channel_writer(channel &c, const size_t size_hint,
+                               const bool block, const double timeout)
+    : c(c), closed(false) {
+  c.reserve(size_hint, block, timeout);
+}
+
+channel_writer::~channel_writer() {
   try {
-    n_unread.destroy();
+    cancel();
   } catch (...) {
     abort();
   }
 }
 
+size_t channel_writer::write(const py::buffer &b) {
+  if (closed)
+    throw std::runtime_error("this writer has been closed");
+
+  Py_buffer view;
+  if (PyObject_GetBuffer(b.ptr(), &view, PyBUF_SIMPLE))
+    throw py::error_already_set();
+  size_t len = static_cast<size_t>(view.len);
+  try {
+    c.write_reserved(view.buf, len);
+  } catch (...) {
+    PyBuffer_Release(&view);
+    throw;
+  }
+  PyBuffer_Release(&view);
+  return len;
+}
+
+void channel_writer::commit() {
+  if (closed)
+    throw std::runtime_error("this writer has been closed");
+  closed = true;
+  c.commit();
+}
+
+void channel_writer::cancel() {
+  if (closed)
+    return;
+  closed = true;
+  c.cancel_reserved();
+}
+
 } // namespace snakefish
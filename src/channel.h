@@ -6,7 +6,13 @@
 #define SNAKEFISH_CHANNEL_H
 
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
 #include <set>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <semaphore.h>
 
@@ -24,6 +30,28 @@ namespace snakefish {
  */
 const unsigned PICKLE_PROTOCOL = 4;
 
+/**
+ * \brief The [pickle protocol]
+ * (https://docs.python.org/3.8/library/pickle.html#data-stream-format) used by
+ * channels with out-of-band transport.
+ *
+ * Protocol 5 supports [out-of-band buffers]
+ * (https://docs.python.org/3.8/library/pickle.html#out-of-band-buffers).
+ */
+const unsigned PICKLE_PROTOCOL_OUT_OF_BAND = 5;
+
+/**
+ * \brief Buffers smaller than this (in bytes) are pickled in-band, even if the
+ * channel uses out-of-band transport.
+ */
+const size_t OUT_OF_BAND_THRESHOLD = 16 * 1024;
+
+/**
+ * \brief A message to send, as a pointer to the start of the bytes and the
+ * number of bytes.
+ */
+typedef std::pair<const void *, size_t> message_t;
+
 /**
  * \brief The default `channel` buffer size.
  *
@@ -33,6 +61,299 @@ const unsigned PICKLE_PROTOCOL = 4;
  */
 const size_t DEFAULT_CHANNEL_SIZE = 2l * 1024l * 1024l * 1024l; // 2 GiB
 
+/**
+ * \brief The default spin time (in microseconds) of a `channel`.
+ *
+ * By default, blocking functions go to sleep right away.
+ */
+const uint64_t DEFAULT_SPIN_TIME = 0;
+
+/**
+ * \brief A timeout (in seconds) meaning "wait for as long as it takes".
+ */
+const double NO_TIMEOUT = -1;
+
+/**
+ * \brief Copies of at least this many bytes are done without holding the GIL.
+ */
+const size_t GIL_RELEASE_THRESHOLD = 64 * 1024;
+
+/**
+ * \brief Counters kept by a `channel` with statistics enabled.
+ *
+ * The counters live in shared memory, so both ends of a channel update and see
+ * the same ones. Times are in `get_timestamp()` ticks. Counters written by the
+ * sender and by the receiver are kept on separate cache lines.
+ */
+struct channel_stats {
+  uint64_t created_at; // when statistics were enabled
+
+  // updated by the sender
+  alignas(64) std::atomic_uint64_t messages_sent;
+  std::atomic_uint64_t bytes_sent;
+  std::atomic_uint64_t peak_occupancy; // max # of bytes in the buffer
+  std::atomic_uint64_t overflows;      // # of sends rejected for lack of space
+
+  // updated by the receiver
+  alignas(64) std::atomic_uint64_t messages_received;
+  std::atomic_uint64_t bytes_received;
+  std::atomic_uint64_t blocked_receives; // # of receives that had to wait
+  std::atomic_uint64_t blocked_receive_time;
+
+  // updated by both (never in SPSC mode)
+  alignas(64) std::atomic_uint64_t lock_acquisitions;
+  std::atomic_uint64_t lock_contentions; // # of acquisitions that had to wait
+  std::atomic_uint64_t lock_wait_time;
+};
+
+/**
+ * \brief The shared control block of a `channel`.
+ *
+ * Each group of fields is kept on its own cache line, so that the sender and
+ * the receiver only pull over each other's line when they have to. In SPSC
+ * mode, each side also keeps a copy of the other side's index, which is only
+ * refreshed when the copy says the buffer is full (for the sender) or empty
+ * (for the receiver).
+ */
+struct channel_control {
+  // written by the sender
+  alignas(64) std::atomic_size_t end; // index of first unused byte
+  size_t cached_start;               // sender's copy of start (SPSC mode)
+
+  // written by the receiver
+  alignas(64) std::atomic_size_t start; // index of first used byte
+  size_t cached_end;                   // receiver's copy of end (SPSC mode)
+
+  // written by both (never in SPSC mode)
+  alignas(64) std::atomic_bool full;
+
+  // written by waiting senders and receivers
+  alignas(64) std::atomic_uint send_waiters;
+  alignas(64) std::atomic_uint recv_waiters;
+
+  channel_stats stats;
+};
+
+/**
+ * \brief The space reserved for the `channel_control` at the start of a
+ * channel's mapping. The buffer itself starts right after, page-aligned.
+ */
+const size_t CHANNEL_CONTROL_SIZE = 4096;
+
+/**
+ * \brief Everything another process needs to attach to a `channel` whose
+ * shared memory it already has at the same address (e.g. a process spawned by
+ * the forkserver). See `channel::get_layout()`.
+ */
+struct channel_layout {
+  void *mapping;
+  size_t mapping_len;
+  size_t capacity;
+  bool spsc;
+  bool out_of_band;
+  bool compact;
+  bool named;
+  bool stats_enabled;
+  uint64_t spin_time;
+  sem_t *lock;
+  sem_t *n_unread;
+  sem_t *space_freed;
+};
+
+/**
+ * \brief Sender-side state of a message being written in place. See
+ * `channel::reserve()`.
+ *
+ * **NOTE**: This state is local to the sending process.
+ */
+struct pending_write {
+  bool active = false;
+  size_t tail = 0;  // where the message (i.e. its length) starts
+  size_t len = 0;   // # of bytes written so far
+  size_t space = 0; // # of bytes known to be free from tail on
+  bool block = false;
+  double timeout = 0;
+  std::chrono::steady_clock::time_point deadline;
+
+  // once the message has outgrown the free space, it's kept here instead
+  bool spilled = false;
+  std::string spill;
+};
+
+/**
+ * \brief Receiver-side bookkeeping of the messages a `channel` has handed out.
+ *
+ * A zero-copy `message_view` points straight into the channel's buffer, so the
+ * bytes it covers must not be overwritten until it is released. Since the
+ * buffer is a ring, space is freed in order: `start` only moves past a message
+ * once that message and all messages before it have been released. Until then,
+ * the receiver keeps track of where the next unread message begins.
+ *
+ * **NOTE**: This state is local to the receiving process.
+ */
+class read_tracker {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  read_tracker() = delete;
+
+  /**
+   * \brief Create a tracker for a channel.
+   *
+   * \param start The channel's `start`.
+   * \param full The channel's `full`.
+   * \param spsc Is the channel in SPSC mode?
+   * \param send_waiters The channel's `send_waiters`.
+   * \param space_freed The channel's `space_freed`.
+   */
+  read_tracker(std::atomic_size_t *start, std::atomic_bool *full, bool spsc,
+               std::atomic_uint *send_waiters, semaphore_t space_freed)
+      : start(start), full(full), spsc(spsc), send_waiters(send_waiters),
+        space_freed(space_freed), head(0), first_id(0), detached(false) {}
+
+  /**
+   * \brief Get the index of the first unread byte.
+   */
+  size_t get_head();
+
+  /**
+   * \brief Record that a message has been read.
+   *
+   * \param new_head Index of the first byte after the message.
+   * \param released Can the message's space be freed right away?
+   *
+   * \returns An ID which can be passed to `release()`.
+   */
+  uint64_t add(size_t new_head, bool released);
+
+  /**
+   * \brief Release the message with ID `id`, and free as much space as
+   * possible.
+   */
+  void release(uint64_t id);
+
+  /**
+   * \brief Stop touching the channel's metadata. This is called when the
+   * channel is disposed.
+   */
+  void detach() { detached = true; }
+
+private:
+  /**
+   * \brief Advance `start` past all leading released messages, and wake up
+   * the senders waiting for space, if any.
+   */
+  void reclaim();
+
+  std::atomic_size_t *start;
+  std::atomic_bool *full;
+  bool spsc;
+  std::atomic_uint *send_waiters;
+  semaphore_t space_freed;
+  size_t head;      // index of first unread byte, valid if pending isn't empty
+  uint64_t first_id; // ID of pending.front()
+  std::deque<std::pair<size_t, bool>> pending; // (new_head, released)
+  bool detached;
+};
+
+/**
+ * \brief A read-only view of a received message.
+ *
+ * If the message is contiguous in the channel's buffer, the view points
+ * straight into the buffer (zero-copy), and the space is only freed once the
+ * view is released or destroyed. Otherwise, the view owns a copy of the
+ * message.
+ */
+class message_view {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  message_view() = delete;
+
+  /**
+   * \brief No copy constructor.
+   */
+  message_view(const message_view &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  message_view &operator=(const message_view &t) = delete;
+
+  /**
+   * \brief Move constructor. The moved-from view will be empty.
+   */
+  message_view(message_view &&t) noexcept
+      : tracker(std::move(t.tracker)), id(t.id), ptr(t.ptr), len(t.len),
+        copy(std::move(t.copy)) {
+    t.ptr = nullptr;
+    t.len = 0;
+  }
+
+  /**
+   * \brief No move assignment operator.
+   */
+  message_view &operator=(message_view &&t) = delete;
+
+  /**
+   * \brief Create a zero-copy view.
+   */
+  message_view(std::shared_ptr<read_tracker> tracker, uint64_t id, void *ptr,
+               size_t len)
+      : tracker(std::move(tracker)), id(id), ptr(ptr), len(len), copy() {}
+
+  /**
+   * \brief Create a view that owns a copy of the message.
+   */
+  explicit message_view(buffer &&bytes)
+      : tracker(), id(0), ptr(bytes.get_ptr()), len(bytes.get_len()),
+        copy(new buffer(std::move(bytes))) {}
+
+  /**
+   * \brief Destructor. This releases the view.
+   */
+  ~message_view() { release(); }
+
+  /**
+   * \brief Get a pointer to the start of the message.
+   */
+  void *get_ptr() { return ptr; }
+
+  /**
+   * \brief Get the length (in bytes) of the message.
+   */
+  size_t get_len() { return len; }
+
+  /**
+   * \brief Does this view point straight into the channel's buffer?
+   */
+  bool is_zero_copy() { return tracker != nullptr; }
+
+  /**
+   * \brief Release this view. After this, the view is empty and the memory
+   * it pointed to must not be accessed.
+   */
+  void release();
+
+  /**
+   * \brief Describe this view for Python's buffer protocol. The view is
+   * exposed as a read-only, 1-dimensional array of bytes.
+   */
+  py::buffer_info get_buffer_info() {
+    return py::buffer_info(ptr, 1, py::format_descriptor<uint8_t>::format(), 1,
+                           {len}, {1}, true);
+  }
+
+private:
+  std::shared_ptr<read_tracker> tracker;
+  uint64_t id;
+  void *ptr;
+  size_t len;
+  std::unique_ptr<buffer> copy;
+};
+
 /**
  * \brief An IPC channel with built-in synchronization support.
  *
@@ -45,18 +366,51 @@ const size_t DEFAULT_CHANNEL_SIZE = 2l * 1024l * 1024l * 1024l; // 2 GiB
  * longer needed to release resources.
  *
  * Characteristics of the functions:
- * - `send_bytes()`: won't block; can throw
- * - `send_pyobj()`: won't block; can throw
+ * - `send_bytes()`: may or may not block^^; can throw
+ * - `send_pyobj()`: may or may not block^^; can throw
  * - `receive_bytes()`: may or may not block^; can throw
  * - `receive_pyobj()`: may or may not block^; can throw
+ * - `receive_view()`: may or may not block^; can throw
+ * - `send_bytes_many()`: may or may not block^^; can throw
+ * - `send_pyobj_many()`: may or may not block^^; can throw
+ * - `receive_bytes_many()`: may or may not block^; can throw
+ * - `receive_pyobj_many()`: may or may not block^; can throw
  *
  * ^: the client must specify whether the function should block when there's no
- * incoming messages to receive
+ * incoming messages to receive, optionally with a timeout
+ *
+ * ^^: by default, sending to a full channel throws right away. The client can
+ * ask the function to block instead until the receiver frees enough space
+ * (backpressure), optionally with a timeout
  *
  * **NOTE**: When doing shared memory IO, a lock must be acquired for
  * synchronization purposes. As such, all functions mentioned above
  * can technically block on the said lock. The characteristics described
  * apply when there's no contention.
+ *
+ * **SPSC mode**: If a channel will only ever have one sender and one receiver,
+ * it can be created in single-producer/single-consumer mode. In this mode,
+ * `lock` is never used. Instead, `start` is only written by the receiver and
+ * `end` is only written by the sender, with acquire/release ordering. To tell
+ * an empty buffer from a full one without `full`, one byte of the buffer is
+ * always kept unused, so `full` stays `false`.
+ *
+ * **Out-of-band transport**: A channel in SPSC mode can also send Python
+ * objects using pickle protocol 5 with [out-of-band buffers]
+ * (https://docs.python.org/3.8/library/pickle.html#out-of-band-buffers).
+ * Large buffers exported by the objects (e.g. `bytearray`s and numpy arrays)
+ * are then copied straight into the shared buffer, next to a small pickle
+ * stream, and the receiver builds the objects on top of read-only zero-copy
+ * views of them. As with `receive_view()`, the space of such buffers is only
+ * freed when the objects built on top of them are garbage collected.
+ *
+ * **Statistics**: `enable_stats()` makes a channel keep `channel_stats`. When
+ * statistics are disabled, the only overhead is a null check per operation.
+ *
+ * **Waiting**: On Linux, each channel also owns an `eventfd`, which senders
+ * signal while some process is inside `wait()` on the channel. This lets
+ * `wait()` sleep on many channels at once. Only one process should wait on a
+ * given channel at a time.
  */
 class channel {
 public:
@@ -95,68 +449,451 @@ public:
    *
    * \param size The size of the underlying shared memory buffer.
    */
-  explicit channel(size_t size);
+  explicit channel(size_t size) : channel(size, false) {}
+
+  /**
+   * \brief Create a channel with buffer size `size`.
+   *
+   * \param size The size of the underlying shared memory buffer.
+   * \param spsc Should this channel run in SPSC mode? See `channel` for
+   * details.
+   */
+  channel(size_t size, bool spsc) : channel(size, spsc, false) {}
+
+  /**
+   * \brief Create a channel with buffer size `size`.
+   *
+   * \param size The size of the underlying shared memory buffer.
+   * \param spsc Should this channel run in SPSC mode? See `channel` for
+   * details.
+   * \param out_of_band Should this channel use out-of-band transport? See
+   * `channel` for details.
+   *
+   * \throws std::runtime_error If `out_of_band` is `true` but `spsc` isn't,
+   * or if pickle protocol 5 is not available.
+   */
+  channel(size_t size, bool spsc, bool out_of_band)
+      : channel(size, spsc, out_of_band, false) {}
+
+  /**
+   * \brief Create a channel with buffer size `size`.
+   *
+   * \param size The size of the underlying shared memory buffer.
+   * \param spsc Should this channel run in SPSC mode? See `channel` for
+   * details.
+   * \param out_of_band Should this channel use out-of-band transport? See
+   * `channel` for details.
+   * \param huge_pages Should the buffer be backed by huge pages? See
+   * `get_shared_ring()`. Since huge pages are reserved up front, `size`
+   * should be much smaller than `DEFAULT_CHANNEL_SIZE` in this case.
+   *
+   * \throws std::runtime_error If `out_of_band` is `true` but `spsc` isn't,
+   * or if pickle protocol 5 is not available.
+   */
+  channel(size_t size, bool spsc, bool out_of_band, bool huge_pages);
+
+  /**
+   * \brief Attach to the channel described by `layout`, whose shared memory
+   * this process already has at the same address.
+   *
+   * \param layout See `get_layout()`.
+   * \param event_fd This process' copy of the channel's `eventfd`, or -1.
+   */
+  channel(const channel_layout &layout, int event_fd);
+
+  /**
+   * \brief Create a channel backed by a named file or shared memory segment,
+   * which unrelated processes can attach to with `open_named()`.
+   *
+   * A `name` without any `/` (e.g. `"jobs"`) refers to a POSIX shared memory
+   * segment (see `shm_open()`). Anything else is the path of a file, which
+   * lets the page cache manage the buffer. This is convenient for very large
+   * buffers.
+   *
+   * The control block and the semaphores live in the backing object too, so
+   * it outlives the channel until `unlink_named()` is called. Named channels
+   * have no `eventfd`.
+   *
+   * \param name The name of the backing object. It must not already exist.
+   * \param size See `channel(size_t, bool, bool)`.
+   * \param spsc See `channel(size_t, bool, bool)`.
+   * \param out_of_band See `channel(size_t, bool, bool)`.
+   *
+   * \throws std::runtime_error If the backing object couldn't be created
+   * (e.g. if it already exists), or see `channel(size_t, bool, bool)`.
+   * \throws std::runtime_error If named channels aren't supported (macOS).
+   */
+  static channel create_named(const std::string &name, size_t size, bool spsc,
+                              bool out_of_band);
+
+  /**
+   * \brief Attach to a channel made by `create_named()`.
+   *
+   * \param name See `create_named()`.
+   *
+   * \throws std::runtime_error If the backing object couldn't be opened, or
+   * if it isn't a channel (or hasn't been fully created yet).
+   */
+  static channel open_named(const std::string &name);
+
+  /**
+   * \brief Remove the backing object of a named channel.
+   *
+   * Processes attached to it can keep using it until they dispose of it.
+   *
+   * \throws std::runtime_error If it couldn't be removed.
+   */
+  static void unlink_named(const std::string &name);
 
   /**
    * \brief Send some bytes.
    *
    * \param bytes Pointer to the start of the bytes.
    * \param len Number of bytes to send.
+   * \param block Should this function wait for space if the buffer is full?
+   * \param timeout If `block` is `true`, the maximum number of seconds to wait.
+   * `NO_TIMEOUT` means no limit.
    *
    * \throws std::overflow_error If the underlying buffer does not have enough
-   * space to accommodate the request.
+   * space to accommodate the request (or if it can never have enough, even
+   * when `block` is `true`), or if `timeout` expired.
    * \throws std::runtime_error If some semaphore error occurred.
    */
-  void send_bytes(void *bytes, size_t len);
+  void send_bytes(void *bytes, size_t len, bool block = false,
+                  double timeout = NO_TIMEOUT);
 
   /**
    * \brief Send a Python object.
    *
-   * This function will serialize `obj` using `pickle` and send the binary
+   * This function will serialize `obj` using `pickle` (or `compact_encode()`,
+   * if compact encoding is enabled and `obj` is supported) and send the binary
    * output.
    *
-   * \throws std::overflow_error If the underlying buffer does not have enough
-   * space to accommodate the request.
+   * \param obj The object.
+   * \param block See `send_bytes()`.
+   * \param timeout See `send_bytes()`.
+   * \param stream Should `obj` be pickled straight into the buffer? This
+   * saves an allocation and a copy of the whole pickle, which pays off for
+   * large objects. See `reserve()`. This is ignored with out-of-band
+   * transport.
+   *
+   * \throws std::overflow_error See `send_bytes()`.
    * \throws std::runtime_error If some semaphore error occurred.
    */
-  void send_pyobj(const py::object &obj);
+  void send_pyobj(const py::object &obj, bool block = false,
+                  double timeout = NO_TIMEOUT, bool stream = false);
+
+  /**
+   * \brief Start writing a message in place.
+   *
+   * This waits (as `send_bytes()` does) for room for a message of at least `n`
+   * bytes, which is then written with `write_reserved()` and sent with
+   * `commit()`. Receivers don't see anything until then.
+   *
+   * The message may grow past `n` bytes. It's written in place as long as the
+   * space after it is free, and it's moved to the heap otherwise, in which
+   * case `commit()` sends it like `send_bytes()`.
+   *
+   * If this channel isn't in SPSC mode, the lock is held from here until the
+   * message is committed, cancelled or moved to the heap, so other senders and
+   * receivers wait in the meantime.
+   *
+   * \param n The expected size of the message.
+   * \param block See `send_bytes()`. This also applies to `commit()`.
+   * \param timeout See `send_bytes()`. This also applies to `commit()`.
+   *
+   * \throws std::overflow_error See `send_bytes()`.
+   * \throws std::runtime_error If a message is already being written, or if
+   * some semaphore error occurred.
+   */
+  void reserve(size_t n, bool block = false, double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Append `len` bytes to the message started by `reserve()`.
+   *
+   * \throws std::runtime_error If no message is being written.
+   * \throws std::bad_alloc If the message had to be moved to the heap and
+   * memory ran out.
+   */
+  void write_reserved(const void *bytes, size_t len);
+
+  /**
+   * \brief Send the message started by `reserve()`.
+   *
+   * \throws std::overflow_error If the message has been moved to the heap and
+   * it couldn't be sent. See `send_bytes()`.
+   * \throws std::runtime_error If no message is being written, or if some
+   * semaphore error occurred.
+   */
+  void commit();
+
+  /**
+   * \brief Drop the message started by `reserve()`, if any.
+   *
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void cancel_reserved();
 
   /**
    * \brief Receive some bytes.
    *
    * \param block Should this function block?
+   * \param timeout If `block` is `true`, the maximum number of seconds to wait.
+   * `NO_TIMEOUT` means no limit.
    *
    * \returns The received bytes wrapped in a `buffer`.
    *
    * \throws std::out_of_range If the underlying buffer does not have enough
    * content to accommodate the request (this only applies when `block` is
-   * `false`).
+   * `false`), or if `timeout` expired.
    * \throws std::runtime_error If some semaphore error occurred.
    * \throws std::bad_alloc If `malloc()` failed.
    */
-  buffer receive_bytes(bool block);
+  buffer receive_bytes(bool block, double timeout = NO_TIMEOUT);
 
   /**
    * \brief Receive a Python object.
    *
-   * This function will receive some bytes and deserialize them using `pickle`.
+   * This function will receive some bytes and deserialize them using `pickle`
+   * or `compact_decode()`, whichever the sender used.
    *
    * \param block Should this function block?
+   * \param timeout See `receive_bytes()`.
    *
    * \throws std::out_of_range If the underlying buffer does not have enough
    * content to accommodate the request (this only applies when `block` is
-   * `false`).
+   * `false`), or if `timeout` expired.
    * \throws std::runtime_error If some semaphore error occurred.
    * \throws std::bad_alloc If `malloc()` failed.
    */
-  py::object receive_pyobj(bool block);
+  py::object receive_pyobj(bool block, double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Receive some bytes without copying them, if possible.
+   *
+   * In SPSC mode, if the message doesn't wrap around the end of the buffer,
+   * the returned view points straight into the buffer, and the message's space
+   * won't be freed until the view is released. Messages received later can be
+   * released in any order, but space is only freed in order, so holding on to
+   * a view for too long can make the buffer run out of space. Otherwise, the
+   * message is copied.
+   *
+   * All views must be released before `dispose()` is called.
+   *
+   * \param block Should this function block?
+   * \param timeout See `receive_bytes()`.
+   *
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`), or if `timeout` expired.
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  message_view receive_view(bool block, double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Send some messages at once.
+   *
+   * The lock is only acquired once for the whole batch, and either all
+   * messages are sent or none of them are. As with `send_bytes()`, empty
+   * messages are skipped.
+   *
+   * \param messages The messages.
+   * \param block See `send_bytes()`.
+   * \param timeout See `send_bytes()`.
+   *
+   * \throws std::overflow_error See `send_bytes()`. This applies to the whole
+   * batch.
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_bytes_many(const std::vector<message_t> &messages,
+                       bool block = false, double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Send some Python objects at once.
+   *
+   * This function will serialize each object using `pickle` and send the
+   * outputs with `send_bytes_many()`.
+   *
+   * \param objs The objects.
+   * \param block See `send_bytes()`.
+   * \param timeout See `send_bytes()`.
+   *
+   * \throws std::overflow_error See `send_bytes()`. This applies to the whole
+   * batch.
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_pyobj_many(const std::vector<py::object> &objs, bool block = false,
+                       double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Receive up to `max_count` messages at once.
+   *
+   * This function waits for the first message (if `block` is `true`), and
+   * then takes whatever other messages are already there, up to `max_count`
+   * in total, acquiring the lock only once.
+   *
+   * \param max_count The maximum number of messages to receive.
+   * \param block Should this function block?
+   * \param timeout See `receive_bytes()`. This only applies to the first
+   * message.
+   *
+   * \returns The received messages, each wrapped in a `buffer`. This is
+   * empty only if `max_count` is 0.
+   *
+   * \throws std::out_of_range If there are no messages (this only applies
+   * when `block` is `false`), or if `timeout` expired.
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  std::vector<buffer> receive_bytes_many(size_t max_count, bool block,
+                                         double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Receive up to `max_count` Python objects at once.
+   *
+   * See `receive_bytes_many()`.
+   *
+   * \throws std::out_of_range If there are no messages (this only applies
+   * when `block` is `false`), or if `timeout` expired.
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  std::vector<py::object> receive_pyobj_many(size_t max_count, bool block,
+                                             double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Set the spin time of this channel.
+   *
+   * Before going to sleep, blocking receives (and lock acquisitions) will spin
+   * for up to `spin_time` microseconds, trading CPU time for lower latency.
+   * This setting is local to the calling process.
+   *
+   * \param spin_time The spin time in microseconds. 0 disables spinning.
+   */
+  void set_spin_time(uint64_t spin_time) { this->spin_time = spin_time; }
+
+  /**
+   * \brief Get the spin time (in microseconds) of this channel.
+   */
+  uint64_t get_spin_time() { return spin_time; }
+
+  /**
+   * \brief Enable or disable compact encoding of the objects sent by this
+   * process. See `compact_encode()`.
+   *
+   * Objects that aren't supported are pickled as usual. Receivers tell the two
+   * apart by themselves, so this setting is local to the calling process.
+   */
+  void set_compact(bool compact) { this->compact = compact; }
+
+  /**
+   * \brief Is compact encoding enabled?
+   */
+  bool is_compact() { return compact; }
+
+  /**
+   * \brief Start keeping statistics. See `channel_stats`.
+   *
+   * The statistics are kept in shared memory, so this must be called before
+   * forking for both ends to update them. Calling this more than once has no
+   * effect.
+   *
+   * \throws std::bad_alloc If `mmap()` failed.
+   */
+  void enable_stats();
+
+  /**
+   * \brief Ask for the buffer of this channel to live on NUMA node `node`.
+   * See `bind_to_node()`.
+   *
+   * This is best called before forking the process that writes to it.
+   */
+  void set_numa_node(int node);
+
+  /**
+   * \brief Get the statistics of this channel.
+   *
+   * \returns A snapshot of `channel_stats` as a `dict`, along with the number
+   * of bytes currently in the buffer (`occupancy`) and the time of the
+   * snapshot (`timestamp`).
+   *
+   * \throws std::runtime_error If statistics are not enabled.
+   */
+  py::dict stats();
+
+  /**
+   * \brief Check whether there's an unread message, without receiving it.
+   *
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  bool is_ready() { return n_unread.peek(); }
+
+  /**
+   * \brief Get the `eventfd` signalled by senders while some process is
+   * waiting on this channel, or -1 if this isn't supported.
+   */
+  int get_event_fd() { return event_fd; }
+
+  /**
+   * \brief Describe this channel for `channel(const channel_layout &, int)`.
+   */
+  channel_layout get_layout();
+
+  /**
+   * \brief Check whether all shared memory of this channel is visible to
+   * processes forked after `reserve_ring_arena()`.
+   */
+  bool is_premapped();
+
+  /**
+   * \brief Register the caller as waiting on this channel. Until `end_wait()`
+   * is called, every send signals `get_event_fd()`.
+   */
+  void begin_wait() { recv_waiters->fetch_add(1); }
+
+  /**
+   * \brief Unregister the caller as waiting on this channel.
+   */
+  void end_wait() { recv_waiters->fetch_sub(1); }
+
+  /**
+   * \brief Reset `get_event_fd()` so that it's only readable again after
+   * the next send.
+   */
+  void clear_event();
 
   /**
    * \brief Release resources held by this channel.
+   *
+   * A named channel is only unmapped, since other processes may still be
+   * attached to it. See `unlink_named()`.
    */
   void dispose();
 
 protected:
+  /**
+   * \brief The mapping holding `control`, followed by `shared_mem`.
+   */
+  void *mapping;
+
+  /**
+   * \brief Size of `mapping`.
+   */
+  size_t mapping_len;
+
+  /**
+   * \brief Is `mapping` backed by a named object? The semaphores live in it
+   * then, and they outlive this channel. See `create_named()`.
+   */
+  bool named;
+
+  /**
+   * \brief The shared control block. `start`, `end`, `full`, `send_waiters`
+   * and `recv_waiters` point into it.
+   */
+  channel_control *control;
+
   /**
    * \brief The buffer used to hold messages.
    */
@@ -187,22 +924,200 @@ protected:
    */
   semaphore_t n_unread;
 
+  /**
+   * \brief Number of senders waiting for space.
+   */
+  std::atomic_uint *send_waiters;
+
+  /**
+   * \brief A semaphore posted by the receiver when it frees space while some
+   * sender is waiting for it.
+   */
+  semaphore_t space_freed;
+
   /**
    * \brief Number of bytes this buffer can hold.
    */
   size_t capacity;
 
+  /**
+   * \brief Is this channel in SPSC mode?
+   */
+  bool spsc;
+
+  /**
+   * \brief Does this channel use out-of-band transport?
+   */
+  bool out_of_band;
+
+  /**
+   * \brief Is compact encoding enabled?
+   */
+  bool compact;
+
+  /**
+   * \brief Where objects are compactly encoded before being sent. It's kept
+   * around so that its memory is reused.
+   */
+  std::string encode_buf;
+
+  /**
+   * \brief How long (in microseconds) to spin before blocking.
+   */
+  uint64_t spin_time;
+
+  /**
+   * \brief Messages received but not yet freed.
+   */
+  std::shared_ptr<read_tracker> tracker;
+
+  /**
+   * \brief Statistics, or `nullptr` if they are disabled.
+   */
+  channel_stats *counters;
+
+  /**
+   * \brief Number of processes waiting on `event_fd`.
+   */
+  std::atomic_uint *recv_waiters;
+
+  /**
+   * \brief An `eventfd` signalled after a send if `recv_waiters` isn't 0, or
+   * -1 if `eventfd` isn't available.
+   */
+  int event_fd;
+
 private:
   /**
    * \brief Acquire `lock`.
    */
-  void acquire_lock() { lock.wait(); }
+  void acquire_lock();
 
   /**
    * \brief Release `lock`.
    */
   void release_lock() { lock.post(); }
 
+  /**
+   * \brief Make sure the message at `head` is visible to this receiver.
+   *
+   * The acquire load of `end` pairs with the sender's release store in SPSC
+   * mode. Messages before `cached_end` have been acquired already, so `end`
+   * is only loaded when the receiver catches up with its copy.
+   */
+  void acquire_tail(size_t head);
+
+  /**
+   * \brief Signal `event_fd` if some process is waiting on this channel.
+   */
+  void notify_waiters();
+
+  /**
+   * \brief Get the number of bytes that can still be written.
+   *
+   * \param head Index of first used byte.
+   * \param tail Index of first unused byte.
+   */
+  size_t get_available_space(size_t head, size_t tail);
+
+  /**
+   * \brief Copy `len` bytes into `shared_mem`, starting at index `offset`.
+   * This handles wrapping.
+   *
+   * \returns The index following the last byte written.
+   */
+  size_t copy_to_shm(size_t offset, const void *bytes, size_t len);
+
+  /**
+   * \brief Copy `len` bytes out of `shared_mem`, starting at index `offset`.
+   * This handles wrapping.
+   *
+   * \returns The index following the last byte read.
+   */
+  size_t copy_from_shm(size_t offset, void *bytes, size_t len);
+
+  /**
+   * \brief The message being written in place, if any.
+   */
+  pending_write pending;
+
+  /**
+   * \brief Wait for `n` bytes of free space, as `send_messages()` does. The
+   * lock must be held if this channel isn't in SPSC mode, and it's released if
+   * an exception is thrown.
+   *
+   * \param tail Set to where the free space starts.
+   *
+   * \returns The number of free bytes from `tail` on (at least `n`).
+   *
+   * \throws std::overflow_error See `send_bytes()`.
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  size_t wait_for_space(size_t n, size_t &tail, bool block, double timeout,
+                        std::chrono::steady_clock::time_point deadline);
+
+  /**
+   * \brief Make `count` messages taking `n` bytes (lengths included) visible
+   * to receivers, with the buffer ending at `new_end`, and release the lock.
+   *
+   * \param available_space What `wait_for_space()` returned.
+   *
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void publish(size_t new_end, size_t n, size_t count, size_t available_space);
+
+  /**
+   * \brief Send some messages atomically.
+   *
+   * Either all messages are sent or none of them are, and the messages will
+   * be next to each other in the buffer. Unlike `send_bytes()`, empty messages
+   * are sent too.
+   *
+   * \param block See `send_bytes()`.
+   * \param timeout See `send_bytes()`.
+   *
+   * \throws std::overflow_error See `send_bytes()`.
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_messages(const message_t *messages, size_t count, bool block,
+                     double timeout);
+
+  /**
+   * \brief `send_pyobj()` with out-of-band transport. All `count` objects are
+   * sent atomically.
+   */
+  void send_pyobj_out_of_band(const py::object *objs, size_t count, bool block,
+                              double timeout);
+
+  /**
+   * \brief `receive_pyobj()` with out-of-band transport.
+   */
+  py::object receive_pyobj_out_of_band(bool block, double timeout);
+
+  /**
+   * \brief Append `obj` to `encode_buf` with `compact_encode()` if compact
+   * encoding is enabled.
+   *
+   * \returns `false` (leaving `encode_buf` as it was) if `obj` must be
+   * pickled instead.
+   */
+  bool encode_compact(const py::object &obj);
+
+  /**
+   * \brief Deserialize a message made by `send_pyobj()`, without out-of-band
+   * buffers.
+   */
+  py::object deserialize(void *bytes, size_t len);
+
+  /**
+   * \brief Wait for an unread message.
+   *
+   * \throws std::out_of_range If there's no unread message (this only
+   * applies when `block` is `false`), or if `timeout` expired.
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void wait_for_message(bool block, double timeout);
+
   /**
    * \brief `pickle.dumps()`
    */
@@ -212,6 +1127,74 @@ private:
    * \brief `pickle.loads()`
    */
   py::object loads;
+
+  /**
+   * \brief `pickle.Pickler`
+   */
+  py::object pickler;
+};
+
+/**
+ * \brief A file-like object writing one message in place, so that e.g. a
+ * `pickle.Pickler` can stream straight into a `channel`. See
+ * `channel::reserve()`.
+ *
+ * If neither `commit()` nor `cancel()` is called, the message is cancelled
+ * when this is destroyed.
+ */
+class channel_writer {
+public:
+  /**
+   * \brief Start a message on `c` with `c.reserve(size_hint, block,
+   * timeout)`. `c` must outlive this writer.
+   */
+  channel_writer(channel &c, size_t size_hint, bool block, double timeout);
+
+  /**
+   * \brief Destructor. This cancels the message if it's still open.
+   */
+  ~channel_writer();
+
+  /**
+   * \brief No copy constructor.
+   */
+  channel_writer(const channel_writer &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  channel_writer &operator=(const channel_writer &t) = delete;
+
+  /**
+   * \brief Append the bytes of the (contiguous) buffer `b` to the message.
+   *
+   * \returns The number of bytes written.
+   *
+   * \throws std::runtime_error If the message has been closed. See also
+   * `channel::write_reserved()`.
+   */
+  size_t write(const py::buffer &b);
+
+  /**
+   * \brief Send the message. See `channel::commit()`.
+   *
+   * \throws std::runtime_error If the message has been closed.
+   */
+  void commit();
+
+  /**
+   * \brief Drop the message. This has no effect if it has been closed.
+   */
+  void cancel();
+
+  /**
+   * \brief Has the message been committed or cancelled?
+   */
+  bool is_closed() { return closed; }
+
+private:
+  channel &c;
+  bool closed;
 };
 
 } // namespace snakefish
@@ -0,0 +1,183 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "compact.h"
+
+namespace snakefish {
+
+/**
+ * \brief The type of each encoded value, followed by its payload.
+ */
+enum compact_type : char {
+  COMPACT_NONE = 'N',
+  COMPACT_TRUE = 'T',
+  COMPACT_FALSE = 'F',
+  COMPACT_INT = 'i',   // int64_t
+  COMPACT_FLOAT = 'd', // double
+  COMPACT_STR = 's',   // uint32_t length, UTF-8 bytes
+  COMPACT_BYTES = 'b', // uint32_t length, bytes
+  COMPACT_TUPLE = 't', // uint32_t count, values
+};
+
+template <class T> static void append(std::string &out, const T &value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+/**
+ * \brief Append a length-prefixed string of bytes.
+ */
+static bool append_bytes(std::string &out, const compact_type type,
+                         const char *bytes, const size_t len) {
+  if (out.size() + 1 + sizeof(uint32_t) + len > COMPACT_MAX_SIZE)
+    return false;
+  out.push_back(type);
+  append(out, static_cast<uint32_t>(len));
+  out.append(bytes, len);
+  return true;
+}
+
+static bool encode(PyObject *obj, std::string &out, const int depth) {
+  if (out.size() + 1 + sizeof(int64_t) > COMPACT_MAX_SIZE)
+    return false;
+
+  if (obj == Py_None) {
+    out.push_back(COMPACT_NONE);
+  } else if (obj == Py_True) {
+    out.push_back(COMPACT_TRUE);
+  } else if (obj == Py_False) {
+    out.push_back(COMPACT_FALSE);
+  } else if (PyLong_CheckExact(obj)) {
+    int overflow = 0;
+    long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    if (overflow != 0)
+      return false;
+    out.push_back(COMPACT_INT);
+    append(out, static_cast<int64_t>(value));
+  } else if (PyFloat_CheckExact(obj)) {
+    out.push_back(COMPACT_FLOAT);
+    append(out, PyFloat_AS_DOUBLE(obj));
+  } else if (PyUnicode_CheckExact(obj)) {
+    Py_ssize_t len = 0;
+    const char *utf8 = PyUnicode_AsUTF8AndSize(obj, &len);
+    if (utf8 == nullptr) {
+      PyErr_Clear(); // e.g. lone surrogates, which pickle can handle
+      return false;
+    }
+    return append_bytes(out, COMPACT_STR, utf8, len);
+  } else if (PyBytes_CheckExact(obj)) {
+    return append_bytes(out, COMPACT_BYTES, PyBytes_AS_STRING(obj),
+                        PyBytes_GET_SIZE(obj));
+  } else if (PyTuple_CheckExact(obj)) {
+    if (depth >= COMPACT_MAX_DEPTH)
+      return false;
+    Py_ssize_t n = PyTuple_GET_SIZE(obj);
+    out.push_back(COMPACT_TUPLE);
+    append(out, static_cast<uint32_t>(n));
+    for (Py_ssize_t i = 0; i < n; i++) {
+      if (!encode(PyTuple_GET_ITEM(obj, i), out, depth + 1))
+        return false;
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool compact_encode(const py::handle &obj, std::string &out) {
+  out.push_back(static_cast<char>(COMPACT_TAG));
+  return encode(obj.ptr(), out, 0);
+}
+
+/**
+ * \brief A cursor over a message being decoded.
+ */
+struct compact_reader {
+  const char *pos;
+  const char *end;
+
+  void read(void *dst, const size_t len) {
+    if (static_cast<size_t>(end - pos) < len)
+      throw std::runtime_error("malformed compact message");
+    memcpy(dst, pos, len);
+    pos += len;
+  }
+
+  const char *skip(const size_t len) {
+    if (static_cast<size_t>(end - pos) < len)
+      throw std::runtime_error("malformed compact message");
+    const char *start = pos;
+    pos += len;
+    return start;
+  }
+};
+
+static py::object decode(compact_reader &r, const int depth) {
+  char type;
+  r.read(&type, sizeof(type));
+
+  PyObject *obj = nullptr;
+  switch (type) {
+  case COMPACT_NONE:
+    return py::none();
+  case COMPACT_TRUE:
+    return py::bool_(true);
+  case COMPACT_FALSE:
+    return py::bool_(false);
+  case COMPACT_INT: {
+    int64_t value;
+    r.read(&value, sizeof(value));
+    obj = PyLong_FromLongLong(value);
+    break;
+  }
+  case COMPACT_FLOAT: {
+    double value;
+    r.read(&value, sizeof(value));
+    obj = PyFloat_FromDouble(value);
+    break;
+  }
+  case COMPACT_STR:
+  case COMPACT_BYTES: {
+    uint32_t len;
+    r.read(&len, sizeof(len));
+    const char *bytes = r.skip(len);
+    obj = (type == COMPACT_STR) ? PyUnicode_DecodeUTF8(bytes, len, nullptr)
+                                : PyBytes_FromStringAndSize(bytes, len);
+    break;
+  }
+  case COMPACT_TUPLE: {
+    uint32_t n;
+    r.read(&n, sizeof(n));
+    if (depth >= COMPACT_MAX_DEPTH || n > static_cast<size_t>(r.end - r.pos))
+      throw std::runtime_error("malformed compact message");
+    py::tuple t(n);
+    for (uint32_t i = 0; i < n; i++) {
+      // PyTuple_SET_ITEM steals the reference
+      PyTuple_SET_ITEM(t.ptr(), i, decode(r, depth + 1).release().ptr());
+    }
+    return t;
+  }
+  default:
+    throw std::runtime_error("malformed compact message");
+  }
+
+  if (obj == nullptr)
+    throw py::error_already_set();
+  return py::reinterpret_steal<py::object>(obj);
+}
+
+py::object compact_decode(const void *bytes, const size_t len) {
+  if (!is_compact(bytes, len))
+    throw std::runtime_error("malformed compact message");
+
+  compact_reader r = {static_cast<const char *>(bytes) + 1,
+                      static_cast<const char *>(bytes) + len};
+  py::object obj = decode(r, 0);
+  if (r.pos != r.end)
+    throw std::runtime_error("malformed compact message");
+  return obj;
+}
+
+} // namespace snakefish
@@ -0,0 +1,72 @@
+/**
+ * \file compact.h
+ *
+ * \brief A compact binary encoding for small, primitive Python objects.
+ */
+
+#ifndef SNAKEFISH_COMPACT_H
+#define SNAKEFISH_COMPACT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+namespace snakefish {
+
+/**
+ * \brief The first byte of every compact message.
+ *
+ * Pickles of protocol 2 and later always start with the `PROTO` opcode
+ * (0x80), so a receiver can tell the two apart without being told.
+ */
+const uint8_t COMPACT_TAG = 0xfe;
+
+/**
+ * \brief The maximum size (in bytes) of a compact message. Larger objects are
+ * pickled.
+ */
+const size_t COMPACT_MAX_SIZE = 64 * 1024;
+
+/**
+ * \brief The maximum nesting depth of tuples in a compact message.
+ */
+const int COMPACT_MAX_DEPTH = 16;
+
+/**
+ * \brief Encode `obj` without `pickle`.
+ *
+ * Only `None`, `bool`, `int` (if it fits in 64 bits), `float`, `str`, `bytes`
+ * and `tuple`s of those are supported (subclasses aren't). These are
+ * immutable, so the decoded object is equal to one unpickled from
+ * `pickle.dumps(obj)`.
+ *
+ * \param obj The object to encode.
+ * \param out Where to append the message. It's left in an unspecified state
+ * if `false` is returned.
+ *
+ * \returns `false` if `obj` isn't supported or the message would be larger
+ * than `COMPACT_MAX_SIZE`.
+ */
+bool compact_encode(const py::handle &obj, std::string &out);
+
+/**
+ * \brief Check whether the message at `bytes` was made by `compact_encode()`.
+ */
+inline bool is_compact(const void *bytes, const size_t len) {
+  return len > 0 && *static_cast<const uint8_t *>(bytes) == COMPACT_TAG;
+}
+
+/**
+ * \brief Decode a message made by `compact_encode()`.
+ *
+ * \throws std::runtime_error If the message is malformed.
+ * \throws py::error_already_set If some object couldn't be created.
+ */
+py::object compact_decode(const void *bytes, size_t len);
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_COMPACT_H
@@ -0,0 +1,328 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "forkserver.h"
+#include "pool.h"
+#include "shm_pool.h"
+#include "thread.h"
+#include "util.h"
+
+namespace snakefish {
+
+/**
+ * \brief The fixed-size part of a request, followed by the header and the
+ * payload.
+ */
+struct spawn_request {
+  spawn_kind kind;
+  uint32_t header_len;
+  uint32_t payload_len;
+};
+
+/**
+ * \brief The forkserver of this process.
+ */
+struct forkserver {
+  std::mutex mutex; // serializes requests
+  pid_t owner = 0;  // the process that started the forkserver
+  pid_t pid = 0;    // the forkserver itself
+  int sock = -1;    // owner's end of the socket pair
+};
+
+static forkserver server;
+
+/**
+ * \brief Receive a request, with the file descriptors passed along.
+ *
+ * \returns The size of the request, or 0 if the owner is gone.
+ */
+static ssize_t receive_request(const int sock, char *buf, const size_t len,
+                               std::vector<int> &fds) {
+  char control[CMSG_SPACE(MAX_SPAWN_FDS * sizeof(int))];
+  struct iovec iov = {buf, len};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return 0;
+
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr;
+       c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int *received = reinterpret_cast<const int *>(CMSG_DATA(c));
+      fds.assign(received, received + count);
+    }
+  }
+  return n;
+}
+
+/**
+ * \brief Run the spawn function of `kind`. This never returns.
+ */
+[[noreturn]] static void run_spawned(const spawn_kind kind, const char *header,
+                                     const py::object &payload,
+                                     const std::vector<int> &fds) {
+  switch (kind) {
+  case spawn_kind::THREAD:
+    thread::run_spawned(header, payload, fds);
+  case spawn_kind::POOL_WORKER:
+    pool::run_spawned(header, payload, fds);
+  }
+  fprintf(stderr, "unknown spawn kind %u!\n", static_cast<unsigned>(kind));
+  abort();
+}
+
+/**
+ * \brief Fork a process that runs the spawn function of `kind`, by way of an
+ * intermediate process, so that the new process is reparented to the owner.
+ *
+ * \returns The pid of the new process, or 0 on failure.
+ */
+static pid_t spawn(const int sock, const spawn_kind kind, const char *header,
+                   const py::object &payload, const std::vector<int> &fds) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds)) {
+    perror("pipe() failed");
+    return 0;
+  }
+
+  pid_t mid = fork();
+  if (mid == 0) {
+    close(pipe_fds[0]);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(pipe_fds[1]);
+      close(sock);
+      run_spawned(kind, header, payload, fds);
+    }
+    if (write(pipe_fds[1], &pid, sizeof(pid)) != sizeof(pid))
+      _exit(1);
+    _exit(0);
+  }
+
+  close(pipe_fds[1]);
+  pid_t pid = 0;
+  if (mid > 0) {
+    if (read(pipe_fds[0], &pid, sizeof(pid)) != sizeof(pid))
+      pid = 0;
+    // once the intermediate process is gone, the new one is the owner's
+    while (waitpid(mid, nullptr, 0) == -1 && errno == EINTR)
+      ;
+  } else {
+    perror("fork() failed");
+  }
+  close(pipe_fds[0]);
+  return (pid > 0) ? pid : 0;
+}
+
+/**
+ * \brief The main loop of the forkserver. This never returns.
+ */
+[[noreturn]] static void serve(const int sock, const bool gc_freeze) {
+  if (gc_freeze) {
+    py::module gc = py::module::import("gc");
+    if (py::hasattr(gc, "freeze"))
+      gc.attr("freeze")();
+  }
+
+  py::object loads = py::module::import("pickle").attr("loads");
+  std::vector<char> buf(sizeof(spawn_request) + MAX_SPAWN_REQUEST);
+  while (true) {
+    std::vector<int> fds;
+    ssize_t n = receive_request(sock, buf.data(), buf.size(), fds);
+    if (n == 0)
+      _exit(0); // the owner has stopped the forkserver or exited
+
+    spawn_request req;
+    memcpy(&req, buf.data(), sizeof(req));
+    const char *header = buf.data() + sizeof(req);
+    pid_t pid = 0;
+    if (static_cast<size_t>(n) ==
+        sizeof(req) + req.header_len + req.payload_len) {
+      // a payload that can't be unpickled here is refused, so that the owner
+      // can fork the process itself
+      py::object payload = py::none();
+      bool ok = true;
+      if (req.payload_len > 0) {
+        try {
+          payload = loads(py::reinterpret_steal<py::object>(
+              PyMemoryView_FromMemory(const_cast<char *>(header) +
+                                          req.header_len,
+                                      req.payload_len, PyBUF_READ)));
+        } catch (py::error_already_set &) {
+          ok = false;
+        }
+      }
+      if (ok)
+        pid = spawn(sock, req.kind, header, payload, fds);
+    }
+
+    for (int fd : fds)
+      close(fd);
+    if (send(sock, &pid, sizeof(pid), MSG_NOSIGNAL) != sizeof(pid))
+      _exit(0);
+  }
+}
+
+#ifdef __linux__
+void start_forkserver(const bool gc_freeze) {
+  if (is_forkserver_running())
+    return;
+
+  // everything the spawned processes share with this one must be mapped
+  // before the forkserver is forked
+  reserve_ring_arena(FORKSERVER_ARENA_SIZE);
+
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1)) {
+    perror("prctl() failed");
+    throw std::runtime_error("prctl() failed");
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+    perror("socketpair() failed");
+    throw std::runtime_error("socketpair() failed");
+  }
+
+  // buffered output would otherwise be written again by every spawned process
+  py::module sys = py::module::import("sys");
+  for (const char *name : {"stdout", "stderr"}) {
+    py::object stream = sys.attr(name);
+    if (!stream.is_none())
+      stream.attr("flush")();
+  }
+  fflush(nullptr);
+
+  // the forkserver never touches the buffers of this process
+  pid_t pid = fork_helper();
+  if (pid == 0) {
+    close(fds[0]);
+    serve(fds[1], gc_freeze);
+  } else if (pid < 0) {
+    perror("fork() failed");
+    close(fds[0]);
+    close(fds[1]);
+    throw std::runtime_error("fork() failed");
+  }
+
+  close(fds[1]);
+  server.owner = getpid();
+  server.pid = pid;
+  server.sock = fds[0];
+}
+#else
+void start_forkserver(const bool gc_freeze) {
+  (void)gc_freeze;
+  throw std::runtime_error("the forkserver is only supported on Linux");
+}
+#endif
+
+void stop_forkserver() {
+  if (!is_forkserver_running())
+    return;
+
+  // children forked since have copies of the socket, so it's shut down
+  // rather than just closed
+  shutdown(server.sock, SHUT_RDWR);
+  close(server.sock);
+  server.owner = 0;
+  server.sock = -1;
+
+  int result;
+  {
+    util::gil_release nogil;
+    do {
+      result = waitpid(server.pid, nullptr, 0);
+    } while (result == -1 && errno == EINTR);
+  }
+  if (result == -1) {
+    perror("waitpid() failed");
+    throw std::runtime_error("waitpid() failed");
+  }
+
+#ifdef __linux__
+  prctl(PR_SET_CHILD_SUBREAPER, 0);
+#endif
+}
+
+bool is_forkserver_running() { return server.owner == getpid(); }
+
+pid_t forkserver_spawn(const spawn_kind kind, const void *header,
+                       const size_t header_len, const py::bytes &payload,
+                       const std::vector<int> &fds) {
+  if (!is_forkserver_running())
+    return 0;
+  auto payload_len = static_cast<size_t>(PyBytes_GET_SIZE(payload.ptr()));
+  if (header_len + payload_len > MAX_SPAWN_REQUEST ||
+      fds.size() > MAX_SPAWN_FDS)
+    return 0;
+
+  spawn_request req = {kind, static_cast<uint32_t>(header_len),
+                       static_cast<uint32_t>(payload_len)};
+  std::vector<char> buf(sizeof(req) + header_len + payload_len);
+  memcpy(buf.data(), &req, sizeof(req));
+  memcpy(buf.data() + sizeof(req), header, header_len);
+  memcpy(buf.data() + sizeof(req) + header_len,
+         PyBytes_AS_STRING(payload.ptr()), payload_len);
+
+  char control[CMSG_SPACE(MAX_SPAWN_FDS * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {buf.data(), buf.size()};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    memcpy(CMSG_DATA(c), fds.data(), fds.size() * sizeof(int));
+  }
+
+  // the lock is taken without the GIL, so that a thread waiting for it
+  // doesn't keep the current holder from getting the GIL back
+  util::gil_release nogil;
+  std::lock_guard<std::mutex> guard(server.mutex);
+  ssize_t n;
+  do {
+    n = sendmsg(server.sock, &msg, MSG_NOSIGNAL);
+  } while (n == -1 && errno == EINTR);
+  if (n != static_cast<ssize_t>(buf.size()))
+    return 0; // the forkserver is gone
+
+  pid_t pid = 0;
+  do {
+    n = recv(server.sock, &pid, sizeof(pid), 0);
+  } while (n == -1 && errno == EINTR);
+  if (n != sizeof(pid) || pid <= 0)
+    return 0;
+  note_spawned();
+  return pid;
+}
+
+} // namespace snakefish
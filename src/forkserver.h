@@ -0,0 +1,116 @@
+/**
+ * \file forkserver.h
+ *
+ * \brief A lean process that spawns threads and pool workers on request.
+ */
+
+#ifndef SNAKEFISH_FORKSERVER_H
+#define SNAKEFISH_FORKSERVER_H
+
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+namespace snakefish {
+
+/**
+ * \brief The size of the ring arena reserved by `start_forkserver()`.
+ *
+ * Note that the arena will be allocated using `mmap()` with flag
+ * `MAP_NORESERVE`, so only the channel buffers in use consume memory.
+ */
+const size_t FORKSERVER_ARENA_SIZE = 1024l * 1024l * 1024l * 1024l; // 1 TiB
+
+/**
+ * \brief The maximum size (in bytes) of a request to the forkserver.
+ */
+const size_t MAX_SPAWN_REQUEST = 64 * 1024;
+
+/**
+ * \brief The maximum number of file descriptors passed with a request to the
+ * forkserver.
+ */
+const size_t MAX_SPAWN_FDS = 16;
+
+/**
+ * \brief What a process spawned by the forkserver runs.
+ */
+enum class spawn_kind : uint32_t {
+  THREAD,     // see `thread::run_spawned()`
+  POOL_WORKER // see `pool::run_spawned()`
+};
+
+/**
+ * \brief Start the forkserver.
+ *
+ * `fork()` has to copy the page tables of the parent, and the child then
+ * takes copy-on-write faults for every object whose reference count it
+ * touches, so starting a thread from a parent with a large heap is slow. The
+ * forkserver is a process forked right away, while the parent is still lean.
+ * Afterwards, threads and pool workers are forked from it instead of from the
+ * parent, whenever possible.
+ *
+ * Processes spawned by the forkserver only see the parent's Python state as
+ * of this call, so functions are sent to them with `pickle` (i.e. by
+ * reference), and must be importable there. A thread whose functions can't
+ * be sent, or whose shared memory the forkserver can't see, is forked from
+ * the parent as usual. So are generators, since generator objects can't be
+ * pickled.
+ *
+ * This process becomes a child subreaper (`PR_SET_CHILD_SUBREAPER`), so that
+ * spawned processes are reparented to it and can be joined as usual. This
+ * only works on Linux.
+ *
+ * \param gc_freeze If `true`, the forkserver calls `gc.freeze()` (Python
+ * 3.7+) before spawning anything, so that garbage collections in spawned
+ * processes don't touch (and copy) the objects they inherited.
+ *
+ * \throws std::runtime_error If the forkserver isn't supported, or if
+ * `prctl()`, `socketpair()` or `fork()` failed.
+ * \throws std::bad_alloc If `mmap()` failed.
+ */
+void start_forkserver(bool gc_freeze = false);
+
+/**
+ * \brief Stop the forkserver started by this process, if any. Processes it
+ * spawned keep running.
+ *
+ * \throws std::runtime_error If `waitpid()` failed.
+ */
+void stop_forkserver();
+
+/**
+ * \brief Check whether this process has started a forkserver.
+ */
+bool is_forkserver_running();
+
+/**
+ * \brief Ask the forkserver to spawn a process.
+ *
+ * The forkserver unpickles `payload`, and then forks the new process, which
+ * runs the spawn function of `kind` on `header`, the unpickled payload, and
+ * its copies of `fds`.
+ *
+ * \param kind What the new process should run.
+ * \param header Plain data describing the new process' shared state, which
+ * must be visible to the forkserver (see `is_premapped()`).
+ * \param header_len Size of `header`.
+ * \param payload Pickled Python objects, or empty.
+ * \param fds File descriptors to pass to the new process.
+ *
+ * \returns The pid of the new process, which is a child of this process, or
+ * 0 if no forkserver was started by this process, if the request is too
+ * large, or if the forkserver couldn't spawn the process (e.g. because it
+ * couldn't unpickle `payload`). In the latter cases, the caller should fork
+ * the process itself.
+ */
+pid_t forkserver_spawn(spawn_kind kind, const void *header, size_t header_len,
+                       const py::bytes &payload, const std::vector<int> &fds);
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_FORKSERVER_H
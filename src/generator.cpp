@@ -1,11 +1,24 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #include "generator.h"
+#include "shm_pool.h"
+#include "util.h"
 
 namespace snakefish {
 
-generator::generator(const py::function &f)
+generator::generator(const py::function &f, const uint prefetch)
     : is_parent(false), child_pid(0), started(false), joined(false),
-      child_status(0), extract_func(), merge_func(), _channel(),
-      cmd_channel(1024), next_sent(false), stop_sent(false), merging(false) {
+      child_status(0), extract_func(), merge_func(),
+      _channel(DEFAULT_CHANNEL_SIZE, true), produced(0), next_sent(false),
+      stop_sent(false), merging(false), prefetch(prefetch) {
 
   py::object is_gen_func =
       py::module::import("inspect").attr("isgeneratorfunction");
@@ -16,14 +29,25 @@ generator::generator(const py::function &f)
     throw std::runtime_error("f is not a generator function");
 
   _next = py::getattr(gen, "__next__");
+
+  // yielded values are mostly small
+  _channel.set_compact(true);
+
+  // the child may run ahead by prefetch outputs from the start
+  control = static_cast<generator_control *>(
+      get_shared_slot(sizeof(generator_control)));
+  control->requested.store(prefetch);
+  control->sleeping.store(0);
+  control->stop.store(false);
 }
 
 generator::generator(const py::function &f, py::function extract,
-                     py::function merge)
+                     py::function merge, const uint prefetch)
     : is_parent(false), child_pid(0), started(false), joined(false),
       child_status(0), extract_func(std::move(extract)),
-      merge_func(std::move(merge)), _channel(), cmd_channel(1024),
-      next_sent(false), stop_sent(false), merging(true) {
+      merge_func(std::move(merge)), _channel(DEFAULT_CHANNEL_SIZE, true),
+      produced(0), next_sent(false), stop_sent(false), merging(true),
+      prefetch(prefetch) {
 
   py::object is_gen_func =
       py::module::import("inspect").attr("isgeneratorfunction");
@@ -34,14 +58,34 @@ generator::generator(const py::function &f, py::function extract,
     throw std::runtime_error("f is not a generator function");
 
   _next = py::getattr(gen, "__next__");
+
+  // yielded values are mostly small
+  _channel.set_compact(true);
+
+  // the child may run ahead by prefetch outputs from the start
+  control = static_cast<generator_control *>(
+      get_shared_slot(sizeof(generator_control)));
+  control->requested.store(prefetch);
+  control->sleeping.store(0);
+  control->stop.store(false);
+}
+
+void generator::set_placement(const placement &p) {
+  if (started) {
+    throw std::runtime_error("this generator has already been started");
+  }
+  place = p;
 }
 
 void generator::start() {
   if (started) {
     throw std::runtime_error("this generator has already been started");
   }
+  if (place.numa_node >= 0) {
+    _channel.set_numa_node(place.numa_node);
+  }
 
-  pid_t pid = fork();
+  pid_t pid = fork_child();
   if (pid > 0) {
     is_parent = true;
     child_pid = pid;
@@ -50,6 +94,7 @@ void generator::start() {
     is_parent = false;
     child_pid = 0;
     started = true;
+    set_affinity(place.cpus);
     run();
   } else {
     perror("fork() failed");
@@ -57,14 +102,17 @@ void generator::start() {
   }
 }
 
-py::object generator::next(bool block) {
-  if (!next_sent) {
-    send_cmd(generator_cmd::NEXT);
+py::object generator::next(bool block, const double timeout) {
+  if (prefetch == 0 && !next_sent) {
+    request(1);
     next_sent = true;
   }
 
-  py::object val = _channel.receive_pyobj(block);
+  py::object val = _channel.receive_pyobj(block, timeout);
   next_sent = false;
+  if (prefetch > 0) {
+    request(1); // let the child produce another output
+  }
 
   if (py::isinstance(val, PyExc_Exception)) {
     // handle exceptions
@@ -91,11 +139,15 @@ void generator::join() {
   }
 
   if (!stop_sent) {
-    send_cmd(generator_cmd::STOP);
+    request_stop();
     stop_sent = true;
   }
 
-  int result = waitpid(child_pid, &child_status, 0);
+  int result;
+  {
+    util::gil_release nogil;
+    result = waitpid(child_pid, &child_status, 0);
+  }
   if (result == -1) {
     perror("waitpid() failed");
     throw std::runtime_error("waitpid() failed");
@@ -104,9 +156,9 @@ void generator::join() {
     abort();
   } else {
     joined = true;
+    note_reaped();
     if (merging) {
-      globals = _channel.receive_pyobj(true);
-      merge_func(py::globals(), globals);
+      receive_globals();
     }
   }
 }
@@ -121,7 +173,7 @@ bool generator::try_join() {
   }
 
   if (!stop_sent) {
-    send_cmd(generator_cmd::STOP);
+    request_stop();
     stop_sent = true;
   }
 
@@ -136,14 +188,34 @@ bool generator::try_join() {
     abort();
   } else {
     joined = true;
+    note_reaped();
     if (merging) {
-      globals = _channel.receive_pyobj(true);
-      merge_func(py::globals(), globals);
+      receive_globals();
     }
     return true;
   }
 }
 
+bool generator::join(const double timeout) {
+  if (!started) {
+    throw std::runtime_error("this generator has not been started yet");
+  }
+  if (!is_parent) {
+    fprintf(stderr, "join() called from child!\n");
+    abort();
+  }
+
+  if (!stop_sent) {
+    request_stop();
+    stop_sent = true;
+  }
+
+  if (!util::wait_for_exit(child_pid, timeout)) {
+    return false;
+  }
+  return try_join();
+}
+
 int generator::get_exit_status() {
   if (!started || !joined) {
     throw std::runtime_error("exit status is not yet available");
@@ -157,9 +229,32 @@ int generator::get_exit_status() {
   }
 }
 
+bool generator::is_ready() {
+  if (!started) {
+    throw std::runtime_error("this generator has not been started yet");
+  }
+  if (joined) {
+    return true;
+  }
+
+  if (prefetch == 0 && !next_sent && !stop_sent) {
+    request(1);
+    next_sent = true;
+  }
+  return _channel.is_ready();
+}
+
+void generator::set_spin_time(const uint64_t spin_time) {
+  _channel.set_spin_time(spin_time);
+}
+
 void generator::dispose() {
   _channel.dispose();
-  cmd_channel.dispose();
+  try {
+    free_shared_slot(control, sizeof(generator_control));
+  } catch (...) {
+    abort();
+  }
 }
 
 void generator::run() {
@@ -172,34 +267,10 @@ void generator::run() {
     abort();
   }
 
-  while (true) {
-    generator_cmd cmd = receive_cmd();
-
-    if (cmd == generator_cmd::STOP) {
-      break;
-    } else if (cmd == generator_cmd::NEXT) {
-      try {
-        _channel.send_pyobj(_next());
-      } catch (py::error_already_set &e) {
-        // send exceptions to parent
-        _channel.send_pyobj(e.value());
-        _channel.send_pyobj(e.type());
-
-        // send traceback
-        if (e.trace()) {
-          _channel.send_pyobj(
-              py::module::import("traceback")
-                  .attr("format_exception")(e.type(), e.value(), e.trace()));
-        } else {
-          _channel.send_pyobj(
-              py::module::import("traceback")
-                  .attr("format_exception_only")(e.type(), e.value()));
-        }
-      }
-    } else {
-      fprintf(stderr, "unknown command: %d!\n", cmd);
-      abort();
-    }
+  // run ahead as long as there are credits, checking for STOP in between
+  while (wait_for_request()) {
+    produce();
+    produced++;
   }
 
   if (merging) {
@@ -209,23 +280,141 @@ void generator::run() {
   std::exit(0);
 }
 
-void generator::send_cmd(generator_cmd cmd) {
+void generator::produce() {
+  try {
+    _channel.send_pyobj(_next());
+  } catch (py::error_already_set &e) {
+    // send exceptions to parent
+    _channel.send_pyobj(e.value());
+    _channel.send_pyobj(e.type());
+
+    // send traceback
+    if (e.trace()) {
+      _channel.send_pyobj(
+          py::module::import("traceback")
+              .attr("format_exception")(e.type(), e.value(), e.trace()));
+    } else {
+      _channel.send_pyobj(
+          py::module::import("traceback")
+              .attr("format_exception_only")(e.type(), e.value()));
+    }
+  }
+}
+
+void generator::receive_globals() {
+  // the globals come last, after any outputs that were never consumed
+  py::object last = _channel.receive_pyobj(true);
+  while (true) {
+    try {
+      last = _channel.receive_pyobj(false);
+    } catch (const std::out_of_range &e) {
+      break;
+    }
+  }
+
+  globals = last;
+  merge_func(py::globals(), globals);
+}
+
+static_assert(sizeof(std::atomic_uint32_t) == sizeof(uint32_t),
+              "std::atomic_uint32_t can't be used as a futex");
+
+/**
+ * \brief Sleep until `word` is woken up by `futex_wake()`, unless it's no
+ * longer `expected`. This may also return spuriously.
+ */
+static void futex_wait(std::atomic_uint32_t *word, const uint32_t expected) {
+#ifdef __linux__
+  // the word is shared between processes, so it's not FUTEX_PRIVATE
+  if (syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT,
+              expected, nullptr, nullptr, 0) == -1 &&
+      errno != EAGAIN && errno != EINTR) {
+    perror("futex() failed");
+    throw std::runtime_error("futex() failed");
+  }
+#else
+  // no futexes, so poll instead
+  (void)word;
+  (void)expected;
+  std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+}
+
+/**
+ * \brief Wake up the process sleeping on `word`, if any.
+ */
+static void futex_wake(std::atomic_uint32_t *word) {
+#ifdef __linux__
+  if (syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, 1,
+              nullptr, nullptr, 0) == -1) {
+    perror("futex() failed");
+    throw std::runtime_error("futex() failed");
+  }
+#else
+  (void)word;
+#endif
+}
+
+void generator::request(const uint32_t n) {
   if (!is_parent) {
-    fprintf(stderr, "send_cmd() called by child!\n");
+    fprintf(stderr, "request() called by child!\n");
     abort();
   }
 
-  cmd_channel.send_bytes(&cmd, sizeof(generator_cmd));
+  // pairs with wait_for_request(), which sets sleeping before checking
+  // requested, so either the child sees the credit or it gets woken up
+  control->requested.fetch_add(n);
+  if (control->sleeping.load() != 0)
+    futex_wake(&control->requested);
 }
 
-generator_cmd generator::receive_cmd() {
+void generator::request_stop() {
+  control->stop.store(true);
+  // requested changes too, so that a child about to sleep on it can't miss
+  // the wakeup
+  request(1);
+}
+
+bool generator::wait_for_request() {
   if (is_parent) {
-    fprintf(stderr, "receive_cmd() called by parent!\n");
+    fprintf(stderr, "wait_for_request() called by parent!\n");
     abort();
   }
 
-  buffer bytes = cmd_channel.receive_bytes(true);
-  return *static_cast<generator_cmd *>(bytes.get_ptr());
+  auto ready = [this](const uint32_t requested) {
+    // requested is ahead of produced by the number of credits left
+    return control->stop.load(std::memory_order_acquire) ||
+           static_cast<int32_t>(requested - produced) > 0;
+  };
+  if (ready(control->requested.load(std::memory_order_acquire)))
+    return !control->stop.load(std::memory_order_acquire);
+
+  uint64_t spin_time = _channel.get_spin_time();
+  if (spin_time > 0) {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(spin_time);
+    // only check the clock once in a while to keep the loop tight
+    const unsigned spins_per_check = 64;
+    do {
+      for (unsigned i = 0; i < spins_per_check; i++) {
+        if (ready(control->requested.load(std::memory_order_acquire)))
+          return !control->stop.load(std::memory_order_acquire);
+        util::cpu_relax();
+      }
+    } while (std::chrono::steady_clock::now() < deadline);
+  }
+
+  while (true) {
+    control->sleeping.store(1);
+    uint32_t requested = control->requested.load();
+    if (ready(requested))
+      break;
+
+    util::gil_release nogil;
+    futex_wait(&control->requested, requested);
+  }
+  control->sleeping.store(0, std::memory_order_relaxed);
+  return !control->stop.load(std::memory_order_acquire);
 }
 
 } // namespace snakefish
@@ -5,20 +5,33 @@
 #ifndef SNAKEFISH_GENERATOR_H
 #define SNAKEFISH_GENERATOR_H
 
+#include <atomic>
+#include <cstdint>
+
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <pybind11/pybind11.h>
 namespace py = pybind11;
 
+#include "affinity.h"
 #include "channel.h"
 
 namespace snakefish {
 
 /**
- * \brief An enum type used to make generator IPC cleaner.
+ * \brief The shared state through which a parent drives its generator.
+ *
+ * The parent grants the child credits by bumping `requested`, and the child
+ * produces one output per credit. `requested` doubles as a futex word, so the
+ * child only sleeps (and the parent only has to wake it up) once it has run
+ * out of credits.
  */
-enum generator_cmd { NEXT, STOP };
+struct generator_control {
+  std::atomic_uint32_t requested; // # of outputs granted so far (wraps around)
+  std::atomic_uint32_t sleeping;  // is the child waiting on `requested`?
+  std::atomic_bool stop;          // should the child exit?
+};
 
 /**
  * \brief A class for executing Python generators with true parallelism.
@@ -66,7 +79,22 @@ public:
    *
    * \throws std::runtime_error If `f` is not a generator function.
    */
-  explicit generator(const py::function &f);
+  explicit generator(const py::function &f) : generator(f, 0) {}
+
+  /**
+   * \brief Create a new snakefish generator with no global variable merging.
+   *
+   * \param f The Python function this generator will execute. It must be a
+   * [generator function](https://wiki.python.org/moin/Generators).
+   *
+   * \param prefetch How many outputs the generator may produce ahead of
+   * `next()`. If 0, the generator only produces an output when `next()` asks
+   * for it. Otherwise, it keeps running until `prefetch` outputs are waiting
+   * to be consumed, so that it can run at the same time as the consumer.
+   *
+   * \throws std::runtime_error If `f` is not a generator function.
+   */
+  generator(const py::function &f, uint prefetch);
 
   /**
    * \brief Create a new snakefish generator with global variable merging.
@@ -92,7 +120,25 @@ public:
    *
    * \throws std::runtime_error If `f` is not a generator function.
    */
-  generator(const py::function &f, py::function extract, py::function merge);
+  generator(const py::function &f, py::function extract, py::function merge)
+      : generator(f, std::move(extract), std::move(merge), 0) {}
+
+  /**
+   * \brief Create a new snakefish generator with global variable merging.
+   *
+   * See `generator(f, extract, merge)` and `generator(f, prefetch)`.
+   *
+   * \throws std::runtime_error If `f` is not a generator function.
+   */
+  generator(const py::function &f, py::function extract, py::function merge,
+            uint prefetch);
+
+  /**
+   * \brief Choose where this generator runs. See `thread::set_placement()`.
+   *
+   * \throws std::runtime_error If this generator has already been started.
+   */
+  void set_placement(const placement &p);
 
   /**
    * \brief Start executing this generator.
@@ -106,12 +152,14 @@ public:
    * \brief Get the next output of the generator.
    *
    * \param block Should this function block?
+   * \param timeout If `block` is `true`, the maximum number of seconds to wait.
+   * Negative means no timeout.
    *
    * \throws std::out_of_range If the next output isn't ready yet (only applies
-   * when `block` is `false`).
+   * when `block` is `false`), or if `timeout` expired.
    * \throws e `next()` will rethrow any exception thrown by the generator.
    */
-  py::object next(bool block);
+  py::object next(bool block, double timeout = NO_TIMEOUT);
 
   /**
    * \brief Join this generator.
@@ -135,6 +183,16 @@ public:
    */
   bool try_join();
 
+  /**
+   * \brief Join this generator, waiting for at most `timeout` seconds.
+   *
+   * \returns `true` if joined. `false` if `timeout` expired.
+   *
+   * \throws std::runtime_error If this generator hasn't been started yet OR if
+   * `waitpid()` failed.
+   */
+  bool join(double timeout);
+
   /**
    * \brief Get the exit status of the generator.
    *
@@ -149,6 +207,64 @@ public:
    */
   int get_exit_status();
 
+  /**
+   * \brief Set the spin time of the channels used by this generator.
+   *
+   * See `channel::set_spin_time()`. If this is called before `start()`, the
+   * setting also applies to the child, which waits for the parent to ask for
+   * outputs.
+   *
+   * \param spin_time The spin time in microseconds. 0 disables spinning.
+   */
+  void set_spin_time(uint64_t spin_time);
+
+  /**
+   * \brief Start keeping statistics of the channel used by this generator to
+   * send its outputs. See `channel::enable_stats()`.
+   *
+   * This must be called before `start()`.
+   */
+  void enable_stats() { _channel.enable_stats(); }
+
+  /**
+   * \brief Get the statistics of the channel used by this generator to send
+   * its outputs. See `channel::stats()`.
+   *
+   * \throws std::runtime_error If statistics are not enabled.
+   */
+  py::dict stats() { return _channel.stats(); }
+
+  /**
+   * \brief Check whether `next()` would return without blocking.
+   *
+   * If the generator doesn't prefetch, this asks it for its next output
+   * first, as `next()` would.
+   *
+   * \throws std::runtime_error If this generator hasn't been started yet.
+   */
+  bool is_ready();
+
+  /**
+   * \brief See `channel::get_event_fd()`. This applies to the channel used by
+   * this generator to send its outputs.
+   */
+  int get_event_fd() { return _channel.get_event_fd(); }
+
+  /**
+   * \brief See `channel::begin_wait()`.
+   */
+  void begin_wait() { _channel.begin_wait(); }
+
+  /**
+   * \brief See `channel::end_wait()`.
+   */
+  void end_wait() { _channel.end_wait(); }
+
+  /**
+   * \brief See `channel::clear_event()`.
+   */
+  void clear_event() { _channel.clear_event(); }
+
   /**
    * \brief Release resources held by this generator.
    */
@@ -161,14 +277,33 @@ private:
   void run();
 
   /**
-   * \brief Send a command to the child.
+   * \brief Run the generator once and send the output (or the exception) to
+   * the parent.
    */
-  void send_cmd(generator_cmd cmd);
+  void produce();
 
   /**
-   * \brief Receive a command from the parent.
+   * \brief Receive the globals sent by the child after it has exited, and
+   * merge them.
+   */
+  void receive_globals();
+
+  /**
+   * \brief Let the child produce `n` more outputs.
+   */
+  void request(uint32_t n);
+
+  /**
+   * \brief Ask the child to exit.
+   */
+  void request_stop();
+
+  /**
+   * \brief Wait until the child may produce another output.
+   *
+   * \returns `false` if it should exit instead.
    */
-  generator_cmd receive_cmd();
+  bool wait_for_request();
 
   bool is_parent;
   pid_t child_pid;
@@ -180,11 +315,14 @@ private:
   py::function extract_func;
   py::function merge_func;
   py::object globals;
-  channel _channel;    // channel used to send data
-  channel cmd_channel; // channel used to send commands
-  bool next_sent;      // has command NEXT been sent?
-  bool stop_sent;      // has command STOP been sent?
-  bool merging;        // should globals be merged?
+  channel _channel;            // channel used to send data
+  generator_control *control; // shared with the child
+  uint32_t produced;          // # of outputs produced (child only)
+  bool next_sent;             // has an output been requested? (no prefetch)
+  bool stop_sent;             // has the child been asked to exit?
+  bool merging;               // should globals be merged?
+  uint prefetch;              // how many outputs the child may produce ahead
+  placement place;            // where the child runs
 };
 
 } // namespace snakefish
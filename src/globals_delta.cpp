@@ -0,0 +1,184 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstring>
+#include <memory>
+
+#include "channel.h"
+#include "globals_delta.h"
+#include "util.h"
+
+namespace snakefish {
+
+/**
+ * \brief The initial value of a digest.
+ */
+static const uint64_t DIGEST_SEED = 0xcbf29ce484222325;
+
+/**
+ * \brief Mix `len` bytes at `bytes` into `digest`, 8 bytes at a time.
+ *
+ * This isn't a cryptographic hash. It only has to tell whether a value
+ * changed, and to be fast enough for large arrays.
+ */
+static uint64_t hash_bytes(const void *bytes, const size_t len,
+                           uint64_t digest) {
+  const uint64_t m = 0x9e3779b97f4a7c15;
+  const char *p = static_cast<const char *>(bytes);
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t w;
+    memcpy(&w, p + i, sizeof(w));
+    digest = (digest ^ w) * m;
+    digest ^= digest >> 29;
+  }
+
+  // the tail, and the length, so that trailing zeros make a difference
+  uint64_t w = 0;
+  memcpy(&w, p + i, len - i);
+  digest = (digest ^ w ^ len) * m;
+  return digest ^ (digest >> 32);
+}
+
+/**
+ * \brief Is `value` compared by identity rather than by its pickle?
+ *
+ * These are immutable (or pickled by reference anyway), so a change means
+ * that the global was rebound.
+ */
+static bool is_compared_by_identity(const py::handle &value) {
+  PyObject *o = value.ptr();
+  return o == Py_None || PyBool_Check(o) || PyLong_CheckExact(o) ||
+         PyFloat_CheckExact(o) || PyComplex_CheckExact(o) ||
+         PyUnicode_CheckExact(o) || PyBytes_CheckExact(o) ||
+         PyFunction_Check(o) || PyType_Check(o);
+}
+
+globals_delta::globals_delta(const py::object &names)
+    : restricted(!names.is_none()) {
+  // imports pickle functions
+  dumps = py::module::import("pickle").attr("dumps");
+
+  if (py::isinstance<py::str>(names)) {
+    this->names.insert(names.cast<std::string>());
+  } else if (restricted) {
+    for (auto name : names)
+      this->names.insert(name.cast<std::string>());
+  }
+
+  snapshot(py::globals());
+}
+
+bool globals_delta::is_tracked(const std::string &name,
+                               const py::handle &value) {
+  if (name.compare(0, 2, "__") == 0 || PyModule_Check(value.ptr()))
+    return false;
+  return !restricted || names.count(name) > 0;
+}
+
+bool globals_delta::get_fingerprint(const py::handle &value,
+                                    fingerprint &fp) {
+  if (is_compared_by_identity(value)) {
+    // holding a reference keeps the address from being reused
+    fp.identity = py::reinterpret_borrow<py::object>(value);
+    fp.digest = 0;
+    return true;
+  }
+
+  uint64_t digest = DIGEST_SEED;
+  py::bytes pickle;
+  try {
+#if PY_VERSION_HEX >= 0x03080000
+    // large buffers (e.g. numpy arrays) are hashed in place, not copied
+    py::cpp_function buffer_callback([&digest](py::handle pickle_buffer) {
+      Py_buffer view;
+      if (PyObject_GetBuffer(pickle_buffer.ptr(), &view,
+                             PyBUF_ANY_CONTIGUOUS)) {
+        PyErr_Clear();
+        return true; // pickled in-band, and hashed with the rest
+      }
+      {
+        std::unique_ptr<util::gil_release> nogil;
+        if (view.len >= static_cast<Py_ssize_t>(GIL_RELEASE_THRESHOLD))
+          nogil.reset(new util::gil_release());
+        digest = hash_bytes(view.buf, view.len, digest);
+      }
+      PyBuffer_Release(&view);
+      return false;
+    });
+    pickle = dumps(value, PICKLE_PROTOCOL_OUT_OF_BAND,
+                   py::arg("buffer_callback") = buffer_callback);
+#else
+    pickle = dumps(value, PICKLE_PROTOCOL);
+#endif
+  } catch (py::error_already_set &) {
+    return false;
+  }
+
+  fp.identity = py::object();
+  fp.digest = hash_bytes(PyBytes_AS_STRING(pickle.ptr()),
+                         PyBytes_GET_SIZE(pickle.ptr()), digest);
+  return true;
+}
+
+void globals_delta::snapshot(const py::dict &globals) {
+  fingerprints.clear();
+
+  // pickling may run arbitrary code, so a copy is iterated
+  py::dict items = py::reinterpret_steal<py::dict>(PyDict_Copy(globals.ptr()));
+  for (auto item : items) {
+    if (!py::isinstance<py::str>(item.first))
+      continue;
+    std::string name = item.first.cast<std::string>();
+    fingerprint fp;
+    if (is_tracked(name, item.second) && get_fingerprint(item.second, fp))
+      fingerprints[name] = std::move(fp);
+  }
+}
+
+py::dict globals_delta::extract(const py::dict &globals) {
+  py::dict delta;
+
+  // pickling may run arbitrary code, so a copy is iterated
+  py::dict items = py::reinterpret_steal<py::dict>(PyDict_Copy(globals.ptr()));
+  for (auto item : items) {
+    if (!py::isinstance<py::str>(item.first))
+      continue;
+    std::string name = item.first.cast<std::string>();
+    fingerprint fp;
+    if (!is_tracked(name, item.second) || !get_fingerprint(item.second, fp))
+      continue;
+
+    auto it = fingerprints.find(name);
+    if (it != fingerprints.end()) {
+      const fingerprint &old = it->second;
+      bool same = fp.identity ? (old.identity && fp.identity.is(old.identity))
+                              : (!old.identity && fp.digest == old.digest);
+      if (same)
+        continue;
+    }
+    delta[item.first] = py::make_tuple(fp.digest, item.second);
+  }
+
+  return delta;
+}
+
+void globals_delta::merge(py::dict globals, const py::dict &delta) {
+  for (auto item : delta) {
+    py::tuple entry = py::reinterpret_borrow<py::tuple>(item.second);
+    py::object value = entry[1];
+    globals[item.first] = value;
+
+    // the value is a new object here, but its pickle is what was hashed
+    fingerprint fp;
+    if (is_compared_by_identity(value)) {
+      fp.identity = value;
+      fp.digest = 0;
+    } else {
+      fp.digest = entry[0].cast<uint64_t>();
+    }
+    fingerprints[item.first.cast<std::string>()] = std::move(fp);
+  }
+}
+
+} // namespace snakefish
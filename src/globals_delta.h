@@ -0,0 +1,152 @@
+/**
+ * \file globals_delta.h
+ */
+
+#ifndef SNAKEFISH_GLOBALS_DELTA_H
+#define SNAKEFISH_GLOBALS_DELTA_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+namespace snakefish {
+
+/**
+ * \brief A built-in extract/merge pair that only transfers the globals that
+ * changed.
+ *
+ * When created, a `globals_delta` records a fingerprint of each global of the
+ * caller. Since threads and generators are forked, a child starts with the
+ * same globals, so `extract()` run by the child only has to return the ones
+ * whose fingerprint changed, and `merge()` run by the parent assigns them.
+ *
+ * A fingerprint is the object itself for `None`, `bool`, `int`, `float`,
+ * `complex`, `str`, `bytes`, functions and classes (which are compared by
+ * identity), and a hash of the pickled object otherwise (so in-place changes
+ * to e.g. lists, dicts and numpy arrays are detected). Names starting with
+ * `__`, modules, and objects that can't be pickled are ignored. Globals
+ * deleted by the child are not deleted from the parent.
+ *
+ * `merge()` also records the fingerprints of the merged globals, so that
+ * children forked later don't send them back unless they change them again.
+ *
+ * Note that the fingerprints are only meaningful in the process that made the
+ * snapshot and in its forked children.
+ */
+class globals_delta {
+public:
+  /**
+   * \brief Track all globals of the caller.
+   */
+  globals_delta() : globals_delta(py::none()) {}
+
+  /**
+   * \brief Default destructor.
+   */
+  ~globals_delta() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  globals_delta(const globals_delta &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  globals_delta &operator=(const globals_delta &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  globals_delta(globals_delta &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  globals_delta &operator=(globals_delta &&t) = delete;
+
+  /**
+   * \brief Track the globals of the caller named in `names` (an iterable of
+   * `str`), or all of them if `names` is `None`, and take a snapshot of them.
+   *
+   * \throws py::error_already_set If `names` isn't an iterable of `str`.
+   */
+  explicit globals_delta(const py::object &names);
+
+  /**
+   * \brief Record the fingerprints of the tracked entries of `globals`,
+   * forgetting all previous ones.
+   */
+  void snapshot(const py::dict &globals);
+
+  /**
+   * \brief Get the tracked entries of `globals` that changed since the
+   * snapshot. This is meant to be used as the `extract` function of a
+   * `thread` or a `generator`.
+   *
+   * \returns A dict mapping each changed name to `(digest, value)`.
+   */
+  py::dict extract(const py::dict &globals);
+
+  /**
+   * \brief Assign the entries returned by `extract()` to `globals`, and
+   * record their fingerprints. This is meant to be used as the `merge`
+   * function of a `thread` or a `generator`.
+   */
+  void merge(py::dict globals, const py::dict &delta);
+
+  /**
+   * \brief Get the number of globals in the snapshot.
+   */
+  size_t get_n_tracked() { return fingerprints.size(); }
+
+protected:
+  /**
+   * \brief What an entry looked like when the snapshot was taken.
+   */
+  struct fingerprint {
+    py::object identity; // the object itself, if it's compared by identity
+    uint64_t digest;     // otherwise, a hash of its pickle
+  };
+
+  /**
+   * \brief Should the global `name` be considered at all?
+   */
+  bool is_tracked(const std::string &name, const py::handle &value);
+
+  /**
+   * \brief Get the fingerprint of `value`.
+   *
+   * \returns `false` if `value` can't be pickled.
+   */
+  bool get_fingerprint(const py::handle &value, fingerprint &fp);
+
+  /**
+   * \brief Are the names restricted to `names`?
+   */
+  bool restricted;
+
+  /**
+   * \brief The names to track, if `restricted`.
+   */
+  std::unordered_set<std::string> names;
+
+  /**
+   * \brief The fingerprints of the snapshot.
+   */
+  std::unordered_map<std::string, fingerprint> fingerprints;
+
+private:
+  /**
+   * \brief Python function `pickle.dumps()`.
+   */
+  py::object dumps;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_GLOBALS_DELTA_H
@@ -1,7 +1,13 @@
-#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
 
+#include "affinity.h"
 #include "misc.h"
+#include "shm_pool.h"
 #include "thread.h"
+#include "util.h"
 
 namespace snakefish {
 
@@ -38,15 +44,210 @@ get_thread_func(const py::function &f, const std::vector<py::handle> &args,
   }
 }
 
+/**
+ * \brief Where the processes of a `map()` run.
+ */
+struct placement_policy {
+  bool pin;              // should the processes be pinned at all?
+  std::vector<int> cpus; // CPUs to use, or empty for the default order
+  int numa_node;
+
+  /**
+   * \brief Get the placement of process `i`. See `get_worker_placement()`.
+   */
+  placement get(uint i) const {
+    return pin ? get_worker_placement(i, cpus, numa_node) : placement();
+  }
+};
+
+/**
+ * \brief Convert the `affinity` and `numa_node` arguments of `map()`.
+ *
+ * \throws std::runtime_error If `numa_node` has no CPU available or some CPU
+ * is invalid.
+ */
+static placement_policy get_placement_policy(const py::object &affinity,
+                                             const int numa_node) {
+  placement_policy policy;
+  policy.numa_node = numa_node;
+  if (!affinity.is_none()) {
+    policy.cpus = affinity.cast<std::vector<int>>();
+  }
+  policy.pin = affinity.is_none() || !policy.cpus.empty() || numa_node >= 0;
+
+  // fail early, before anything is forked
+  policy.get(0);
+  return policy;
+}
+
+/**
+ * \brief Start `t` at the placement of process `i`.
+ */
+static void start_placed(thread &t, const placement_policy &policy,
+                         const uint i) {
+  t.set_placement(policy.get(i));
+  t.start();
+}
+
+/**
+ * \brief With dynamic scheduling, how long (in seconds) a chunk should take.
+ */
+static const double TARGET_CHUNK_TIME = 0.001;
+
+static size_t get_chunk_size(const size_t remaining, const uint concurrency,
+                             const uint min_chunksize, const double item_time) {
+  // start with a single item to measure how long an item takes
+  size_t size = 1;
+  if (item_time > 0) {
+    size = static_cast<size_t>(TARGET_CHUNK_TIME / item_time);
+  }
+
+  // never take more than a fraction of what's left, so that the last chunks
+  // are small enough to keep all workers busy until the end
+  size = std::min(size, remaining / (2 * concurrency));
+  size = std::max(size, static_cast<size_t>(std::max(min_chunksize, 1u)));
+  return std::min(size, remaining);
+}
+
+/**
+ * \brief Claim the next chunk of `[0, n)` from the shared counter `next`.
+ *
+ * \returns `false` if there's nothing left.
+ */
+static bool claim_chunk(std::atomic_size_t *next, const size_t n,
+                        const uint concurrency, const uint min_chunksize,
+                        const double item_time, size_t &start, size_t &size) {
+  start = next->load();
+  do {
+    if (start >= n) {
+      return false;
+    }
+    size = get_chunk_size(n - start, concurrency, min_chunksize, item_time);
+  } while (!next->compare_exchange_weak(start, start + size));
+  return true;
+}
+
+static py::list dynamic_thread_func(const py::function &f,
+                                    const py::list &args,
+                                    std::atomic_size_t *next_arg,
+                                    uint concurrency, uint min_chunksize,
+                                    bool star) {
+  py::list output; // (index of first arg, results) for each chunk
+  size_t n_args = args.size();
+  double item_time = 0; // moving average of seconds per item
+
+  size_t start, size;
+  while (claim_chunk(next_arg, n_args, concurrency, min_chunksize, item_time,
+                     start, size)) {
+    // run it and measure how long it took
+    auto t0 = std::chrono::steady_clock::now();
+    py::list results;
+    for (size_t i = start; i < start + size; i++) {
+      if (star) {
+        results.append(f(*args[i]));
+      } else {
+        results.append(f(args[i]));
+      }
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - t0;
+
+    double chunk_item_time = elapsed.count() / size;
+    item_time = (item_time > 0) ? (item_time + chunk_item_time) / 2
+                                : chunk_item_time;
+    output.append(py::make_tuple(start, results));
+  }
+  return output;
+}
+
+static std::vector<py::object>
+_map_dynamic(const py::function &f, const py::list &arg_list,
+             py::function *extract, py::function *merge, uint concurrency,
+             uint chunksize, bool star, const placement_policy &policy) {
+  // the args are inherited through fork(), so only the index of the next
+  // unclaimed arg needs to be shared
+  auto *next_arg = static_cast<std::atomic_size_t *>(
+      get_shared_slot(sizeof(std::atomic_size_t)));
+  next_arg->store(0);
+
+  py::cpp_function thread_func = [f, arg_list, next_arg, concurrency,
+                                  chunksize, star]() {
+    return dynamic_thread_func(f, arg_list, next_arg, concurrency, chunksize,
+                               star);
+  };
+
+  // spawn threads
+  std::vector<thread> threads;
+  threads.reserve(concurrency);
+  for (uint i = 0; i < std::min(static_cast<size_t>(concurrency),
+                                arg_list.size());
+       i++) {
+    if ((extract != nullptr) && (merge != nullptr)) {
+      // with merging
+      thread t(thread_func, *extract, *merge);
+      start_placed(t, policy, i);
+      threads.push_back(std::move(t));
+    } else {
+      // without merging
+      thread t(thread_func);
+      start_placed(t, policy, i);
+      threads.push_back(std::move(t));
+    }
+  }
+
+  // join threads and put results in place
+  for (thread &t : threads) {
+    t.join();
+  }
+
+  std::vector<py::object> results(arg_list.size());
+  try {
+    for (thread &t : threads) {
+      for (auto chunk : py::list(t.get_result())) {
+        py::tuple c = py::reinterpret_borrow<py::tuple>(chunk);
+        auto start = c[0].cast<size_t>();
+        py::list chunk_results = c[1];
+        for (size_t i = 0; i < chunk_results.size(); i++) {
+          results[start + i] = chunk_results[i];
+        }
+      }
+    }
+  } catch (...) {
+    for (thread &t : threads) {
+      t.dispose();
+    }
+    free_shared_slot(next_arg, sizeof(std::atomic_size_t));
+    throw;
+  }
+
+  for (thread &t : threads) {
+    t.dispose();
+  }
+  try {
+    free_shared_slot(next_arg, sizeof(std::atomic_size_t));
+  } catch (...) {
+    abort();
+  }
+
+  return results;
+}
+
 static std::vector<py::object>
 _map(const py::function &f, const py::iterable &args, py::function *extract,
-     py::function *merge, uint concurrency, uint chunksize, bool star) {
+     py::function *merge, uint concurrency, uint chunksize, bool star,
+     bool dynamic, const placement_policy &policy) {
 
   py::list arg_list = py::list(args); // assemble args
 
   // use default concurrency (i.e. # of physical cores)?
   if (concurrency == 0) {
-    concurrency = std::thread::hardware_concurrency();
+    concurrency = get_physical_cores();
+  }
+
+  // let the threads pull chunks as they go?
+  if (dynamic) {
+    return _map_dynamic(f, arg_list, extract, merge, concurrency, chunksize,
+                        star, policy);
   }
 
   // use default chunk size?
@@ -90,12 +291,12 @@ _map(const py::function &f, const py::iterable &args, py::function *extract,
       if ((extract != nullptr) && (merge != nullptr)) {
         // with merging
         thread t(get_thread_func(f, thread_args, star), *extract, *merge);
-        t.start();
+        start_placed(t, policy, j);
         threads.push_back(std::move(t));
       } else {
         // without merging
         thread t(get_thread_func(f, thread_args, star));
-        t.start();
+        start_placed(t, policy, j);
         threads.push_back(std::move(t));
       }
 
@@ -103,10 +304,13 @@ _map(const py::function &f, const py::iterable &args, py::function *extract,
       thread_args.clear();
     }
 
-    // join threads and concatenate results
+    // join threads first, so that their channel buffers can be recycled
     for (thread &t : threads) {
       t.join();
+    }
 
+    // concatenate results
+    for (thread &t : threads) {
       auto thread_results = py::cast<std::vector<py::object>>(t.get_result());
       std::move(std::begin(thread_results), std::end(thread_results),
                 std::back_inserter(results));
@@ -121,28 +325,303 @@ _map(const py::function &f, const py::iterable &args, py::function *extract,
   return results;
 }
 
+static py::object range_thread_func(const py::function &f, const size_t n,
+                                    std::atomic_size_t *next_index,
+                                    uint concurrency, uint min_chunksize) {
+  double item_time = 0; // moving average of seconds per index
+
+  size_t start, size;
+  while (claim_chunk(next_index, n, concurrency, min_chunksize, item_time,
+                     start, size)) {
+    auto t0 = std::chrono::steady_clock::now();
+    f(start, start + size);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - t0;
+
+    double chunk_item_time = elapsed.count() / size;
+    item_time = (item_time > 0) ? (item_time + chunk_item_time) / 2
+                                : chunk_item_time;
+  }
+  return py::none();
+}
+
+/**
+ * \brief Fold a chunk of `args`, and combine the partial results of the
+ * workers in a binomial tree.
+ *
+ * Worker `i` folds `args[begin:end]`. Then, at each step `s` (1, 2, 4, ...),
+ * workers whose index has bit `s` set send their partial result to worker
+ * `i - s` through `links[i - 1]` and stop, while the others combine their
+ * partial result with the one of worker `i + s`. Each partial result covers
+ * a contiguous range of `args`, so `combine` only has to be associative.
+ * Worker 0 returns the final result.
+ */
+static py::object reduce_thread_func(const py::object &f,
+                                     const py::function &combine,
+                                     const py::list &args, size_t begin,
+                                     size_t end, uint i, uint n_workers,
+                                     std::vector<channel> &links) {
+  // a worker that fails still takes part, so that nobody waits forever
+  py::object acc;
+  bool ok = true;
+  std::exception_ptr error;
+  try {
+    acc = f.is_none() ? py::object(args[begin]) : f(args[begin]);
+    for (size_t k = begin + 1; k < end; k++) {
+      acc = combine(acc, f.is_none() ? py::object(args[k]) : f(args[k]));
+    }
+  } catch (py::error_already_set &) {
+    ok = false;
+    error = std::current_exception();
+  }
+
+  for (uint step = 1; step < n_workers; step <<= 1) {
+    if (i & step) {
+      links[i - 1].send_pyobj(ok ? py::make_tuple(true, acc)
+                                 : py::make_tuple(false, py::none()),
+                              true);
+      acc = py::none();
+      break;
+    }
+    if (i + step >= n_workers) {
+      continue;
+    }
+
+    py::tuple partial = links[i + step - 1].receive_pyobj(true);
+    if (!ok || !partial[0].cast<bool>()) {
+      ok = false; // the worker that failed reports the exception
+      continue;
+    }
+    try {
+      acc = combine(acc, partial[1]);
+    } catch (py::error_already_set &) {
+      ok = false;
+      error = std::current_exception();
+    }
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return ok ? acc : py::none();
+}
+
+static py::object _map_reduce(const py::object &f, const py::function &combine,
+                              const py::iterable &args,
+                              const py::object *initial, uint concurrency) {
+  py::list arg_list = py::list(args); // assemble args
+  size_t n_args = arg_list.size();
+  if (n_args == 0) {
+    if (initial == nullptr) {
+      throw std::runtime_error("reduction of empty args with no initial value");
+    }
+    return *initial;
+  }
+
+  // use default concurrency (i.e. # of physical cores)?
+  if (concurrency == 0) {
+    concurrency = get_physical_cores();
+  }
+  auto n_workers = static_cast<uint>(
+      std::min(static_cast<size_t>(std::max(concurrency, 1u)), n_args));
+
+  // worker i sends its partial result through links[i - 1]
+  std::vector<channel> links;
+  links.reserve(n_workers - 1);
+  for (uint i = 1; i < n_workers; i++) {
+    links.emplace_back(DEFAULT_CHANNEL_SIZE, true);
+    links.back().set_compact(true);
+  }
+  std::vector<channel> *links_ptr = &links;
+  placement_policy policy = get_placement_policy(py::none(), -1);
+
+  // spawn threads, each with a contiguous chunk
+  std::vector<thread> threads;
+  threads.reserve(n_workers);
+  try {
+    for (uint i = 0; i < n_workers; i++) {
+      size_t begin = n_args * i / n_workers;
+      size_t end = n_args * (i + 1) / n_workers;
+      py::cpp_function thread_func = [f, combine, arg_list, begin, end, i,
+                                      n_workers, links_ptr]() {
+        return reduce_thread_func(f, combine, arg_list, begin, end, i,
+                                  n_workers, *links_ptr);
+      };
+      thread t(thread_func);
+      start_placed(t, policy, i);
+      threads.push_back(std::move(t));
+    }
+  } catch (...) {
+    // report the missing workers as failed, so that the others finish
+    for (size_t i = std::max(threads.size(), static_cast<size_t>(1));
+         i < n_workers; i++) {
+      links[i - 1].send_pyobj(py::make_tuple(false, py::none()), true);
+    }
+    for (thread &t : threads) {
+      t.join();
+      t.dispose();
+    }
+    for (channel &c : links) {
+      c.dispose();
+    }
+    throw;
+  }
+
+  // only worker 0 returns the total, but every exception is rethrown
+  for (thread &t : threads) {
+    t.join();
+  }
+  py::object total;
+  try {
+    for (thread &t : threads) {
+      py::object result = t.get_result();
+      if (!total) {
+        total = result;
+      }
+    }
+  } catch (...) {
+    for (thread &t : threads) {
+      t.dispose();
+    }
+    for (channel &c : links) {
+      c.dispose();
+    }
+    throw;
+  }
+
+  for (thread &t : threads) {
+    t.dispose();
+  }
+  for (channel &c : links) {
+    c.dispose();
+  }
+
+  return (initial != nullptr) ? combine(*initial, total) : total;
+}
+
 std::vector<py::object> map(const py::function &f, const py::iterable &args,
-                            uint concurrency, uint chunksize) {
-  return _map(f, args, nullptr, nullptr, concurrency, chunksize, false);
+                            uint concurrency, uint chunksize, bool dynamic,
+                            const py::object &affinity, int numa_node) {
+  return _map(f, args, nullptr, nullptr, concurrency, chunksize, false,
+              dynamic, get_placement_policy(affinity, numa_node));
 }
 
 std::vector<py::object> map_merge(const py::function &f,
                                   const py::iterable &args,
                                   py::function extract, py::function merge,
-                                  uint concurrency, uint chunksize) {
-  return _map(f, args, &extract, &merge, concurrency, chunksize, false);
+                                  uint concurrency, uint chunksize,
+                                  bool dynamic, const py::object &affinity,
+                                  int numa_node) {
+  return _map(f, args, &extract, &merge, concurrency, chunksize, false,
+              dynamic, get_placement_policy(affinity, numa_node));
 }
 
 std::vector<py::object> starmap(const py::function &f, const py::iterable &args,
-                                uint concurrency, uint chunksize) {
-  return _map(f, args, nullptr, nullptr, concurrency, chunksize, true);
+                                uint concurrency, uint chunksize, bool dynamic,
+                                const py::object &affinity, int numa_node) {
+  return _map(f, args, nullptr, nullptr, concurrency, chunksize, true,
+              dynamic, get_placement_policy(affinity, numa_node));
 }
 
 std::vector<py::object> starmap_merge(const py::function &f,
                                       const py::iterable &args,
                                       py::function extract, py::function merge,
-                                      uint concurrency, uint chunksize) {
-  return _map(f, args, &extract, &merge, concurrency, chunksize, true);
+                                      uint concurrency, uint chunksize,
+                                      bool dynamic, const py::object &affinity,
+                                      int numa_node) {
+  return _map(f, args, &extract, &merge, concurrency, chunksize, true,
+              dynamic, get_placement_policy(affinity, numa_node));
+}
+
+void parallel_for(const py::function &f, size_t n, uint chunksize,
+                  uint concurrency, const py::object &affinity,
+                  int numa_node) {
+  if (n == 0) {
+    return;
+  }
+  placement_policy policy = get_placement_policy(affinity, numa_node);
+
+  // use default concurrency (i.e. # of physical cores)?
+  if (concurrency == 0) {
+    concurrency = get_physical_cores();
+  }
+
+  // the data lives in memory inherited through fork(), so only the index of
+  // the next unclaimed range needs to be shared
+  auto *next_index = static_cast<std::atomic_size_t *>(
+      get_shared_slot(sizeof(std::atomic_size_t)));
+  next_index->store(0);
+
+  py::cpp_function thread_func = [f, n, next_index, concurrency,
+                                  chunksize]() {
+    return range_thread_func(f, n, next_index, concurrency, chunksize);
+  };
+
+  // spawn threads
+  std::vector<thread> threads;
+  threads.reserve(concurrency);
+  try {
+    for (uint i = 0; i < std::min(static_cast<size_t>(concurrency), n); i++) {
+      thread t(thread_func);
+      start_placed(t, policy, i);
+      threads.push_back(std::move(t));
+    }
+  } catch (...) {
+    for (thread &t : threads) {
+      t.join();
+      t.dispose();
+    }
+    free_shared_slot(next_index, sizeof(std::atomic_size_t));
+    throw;
+  }
+
+  // join threads, and rethrow the first exception (if any)
+  for (thread &t : threads) {
+    t.join();
+  }
+  try {
+    for (thread &t : threads) {
+      t.get_result();
+    }
+  } catch (...) {
+    for (thread &t : threads) {
+      t.dispose();
+    }
+    free_shared_slot(next_index, sizeof(std::atomic_size_t));
+    throw;
+  }
+
+  for (thread &t : threads) {
+    t.dispose();
+  }
+  try {
+    free_shared_slot(next_index, sizeof(std::atomic_size_t));
+  } catch (...) {
+    abort();
+  }
+}
+
+py::object map_reduce(const py::function &f, const py::function &combine,
+                      const py::iterable &args, uint concurrency) {
+  return _map_reduce(f, combine, args, nullptr, concurrency);
+}
+
+py::object map_reduce_initial(const py::function &f,
+                              const py::function &combine,
+                              const py::iterable &args,
+                              const py::object &initial, uint concurrency) {
+  return _map_reduce(f, combine, args, &initial, concurrency);
+}
+
+py::object reduce(const py::function &combine, const py::iterable &args,
+                  uint concurrency) {
+  return _map_reduce(py::none(), combine, args, nullptr, concurrency);
+}
+
+py::object reduce_initial(const py::function &combine,
+                          const py::iterable &args, const py::object &initial,
+                          uint concurrency) {
+  return _map_reduce(py::none(), combine, args, &initial, concurrency);
 }
 
 } // namespace snakefish
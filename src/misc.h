@@ -50,15 +50,32 @@ inline uint64_t get_timestamp_serialized() {
  * \param args The arguments as a Python iterable.
  *
  * \param concurrency The level of concurrency. If not supplied, this is set
- * to the number of cores in the system.
+ * to the number of physical cores available.
  *
  * \param chunksize The size of each process' job. If not supplied, `args` are
  * handed out evenly to each process.
  *
+ * \param dynamic If `true`, use dynamic scheduling: each process claims chunks
+ * of `args` from a shared counter as it goes, with chunk sizes adjusted to how
+ * long each item takes, so that skewed workloads stay balanced. In this case,
+ * `chunksize` is the minimum chunk size.
+ *
+ * \param affinity The CPUs the processes run on, one CPU each, handed out in
+ * a round-robin fashion. If `None`, they're spread over physical cores first
+ * (see `get_spread_cpus()`). If empty, they can run on any CPU. The channel
+ * used by each process to send its results is placed on the NUMA node of its
+ * CPU.
+ *
+ * \param numa_node If not -1, only the CPUs (and memory) of this NUMA node
+ * are used.
+ *
  * \return The return values as a `vector` (or a `list` in Python).
  */
 std::vector<py::object> map(const py::function &f, const py::iterable &args,
-                            uint concurrency = 0, uint chunksize = 0);
+                            uint concurrency = 0, uint chunksize = 0,
+                            bool dynamic = false,
+                            const py::object &affinity = py::none(),
+                            int numa_node = -1);
 
 /**
  * \brief `map(f, args)` executed in parallel, with global variable merging.
@@ -72,17 +89,34 @@ std::vector<py::object> map(const py::function &f, const py::iterable &args,
  * \param merge See documentation for `thread`.
  *
  * \param concurrency The level of concurrency. If not supplied, this is set
- * to the number of cores in the system.
+ * to the number of physical cores available.
  *
  * \param chunksize The size of each process' job. If not supplied, `args` are
  * handed out evenly to each process.
  *
+ * \param dynamic If `true`, use dynamic scheduling: each process claims chunks
+ * of `args` from a shared counter as it goes, with chunk sizes adjusted to how
+ * long each item takes, so that skewed workloads stay balanced. In this case,
+ * `chunksize` is the minimum chunk size.
+ *
+ * \param affinity The CPUs the processes run on, one CPU each, handed out in
+ * a round-robin fashion. If `None`, they're spread over physical cores first
+ * (see `get_spread_cpus()`). If empty, they can run on any CPU. The channel
+ * used by each process to send its results is placed on the NUMA node of its
+ * CPU.
+ *
+ * \param numa_node If not -1, only the CPUs (and memory) of this NUMA node
+ * are used.
+ *
  * \return The return values as a `vector` (or a `list` in Python).
  */
 std::vector<py::object> map_merge(const py::function &f,
                                   const py::iterable &args,
                                   py::function extract, py::function merge,
-                                  uint concurrency = 0, uint chunksize = 0);
+                                  uint concurrency = 0, uint chunksize = 0,
+                                  bool dynamic = false,
+                                  const py::object &affinity = py::none(),
+                                  int numa_node = -1);
 
 /**
  * \brief `starmap(f, args)` executed in parallel, with no global variable
@@ -94,15 +128,32 @@ std::vector<py::object> map_merge(const py::function &f,
  * \param args The arguments as a Python iterable.
  *
  * \param concurrency The level of concurrency. If not supplied, this is set
- * to the number of cores in the system.
+ * to the number of physical cores available.
  *
  * \param chunksize The size of each process' job. If not supplied, `args` are
  * handed out evenly to each process.
  *
+ * \param dynamic If `true`, use dynamic scheduling: each process claims chunks
+ * of `args` from a shared counter as it goes, with chunk sizes adjusted to how
+ * long each item takes, so that skewed workloads stay balanced. In this case,
+ * `chunksize` is the minimum chunk size.
+ *
+ * \param affinity The CPUs the processes run on, one CPU each, handed out in
+ * a round-robin fashion. If `None`, they're spread over physical cores first
+ * (see `get_spread_cpus()`). If empty, they can run on any CPU. The channel
+ * used by each process to send its results is placed on the NUMA node of its
+ * CPU.
+ *
+ * \param numa_node If not -1, only the CPUs (and memory) of this NUMA node
+ * are used.
+ *
  * \return The return values as a `vector` (or a `list` in Python).
  */
 std::vector<py::object> starmap(const py::function &f, const py::iterable &args,
-                                uint concurrency = 0, uint chunksize = 0);
+                                uint concurrency = 0, uint chunksize = 0,
+                                bool dynamic = false,
+                                const py::object &affinity = py::none(),
+                                int numa_node = -1);
 
 /**
  * \brief `starmap(f, args)` executed in parallel, with global variable merging.
@@ -117,17 +168,117 @@ std::vector<py::object> starmap(const py::function &f, const py::iterable &args,
  * \param merge See documentation for `thread`.
  *
  * \param concurrency The level of concurrency. If not supplied, this is set
- * to the number of cores in the system.
+ * to the number of physical cores available.
  *
  * \param chunksize The size of each process' job. If not supplied, `args` are
  * handed out evenly to each process.
  *
+ * \param dynamic If `true`, use dynamic scheduling: each process claims chunks
+ * of `args` from a shared counter as it goes, with chunk sizes adjusted to how
+ * long each item takes, so that skewed workloads stay balanced. In this case,
+ * `chunksize` is the minimum chunk size.
+ *
+ * \param affinity The CPUs the processes run on, one CPU each, handed out in
+ * a round-robin fashion. If `None`, they're spread over physical cores first
+ * (see `get_spread_cpus()`). If empty, they can run on any CPU. The channel
+ * used by each process to send its results is placed on the NUMA node of its
+ * CPU.
+ *
+ * \param numa_node If not -1, only the CPUs (and memory) of this NUMA node
+ * are used.
+ *
  * \return The return values as a `vector` (or a `list` in Python).
  */
 std::vector<py::object> starmap_merge(const py::function &f,
                                       const py::iterable &args,
                                       py::function extract, py::function merge,
-                                      uint concurrency = 0, uint chunksize = 0);
+                                      uint concurrency = 0, uint chunksize = 0,
+                                      bool dynamic = false,
+                                      const py::object &affinity = py::none(),
+                                      int numa_node = -1);
+
+/**
+ * \brief Run `f(start, end)` in parallel over ranges covering `[0, n)`.
+ *
+ * Each process claims ranges of indices from a shared counter as it goes,
+ * with range sizes adjusted to how long each index takes, like `map()` with
+ * dynamic scheduling. Only the ranges are shared: `f` is expected to read its
+ * input from and write its output to memory inherited from the parent, such
+ * as a `shared_array`, so that nothing has to be copied back. Return values of
+ * `f` are ignored.
+ *
+ * \param f The Python function that should be applied to each range.
+ *
+ * \param n The number of indices.
+ *
+ * \param chunksize The minimum size of each range. If not supplied, it's 1.
+ *
+ * \param concurrency The level of concurrency. If not supplied, this is set
+ * to the number of physical cores available.
+ *
+ * \param affinity See `map()`.
+ *
+ * \param numa_node See `map()`.
+ *
+ * \throws py::error_already_set If `f` raised an exception in some process.
+ * The other processes still run to completion.
+ */
+void parallel_for(const py::function &f, size_t n, uint chunksize,
+                  uint concurrency, const py::object &affinity,
+                  int numa_node);
+
+/**
+ * \brief `functools.reduce(combine, map(f, args))` executed in parallel.
+ *
+ * `args` are split into one contiguous chunk per process. Each process folds
+ * its chunk with `combine`, and the partial results are then combined in a
+ * tree across processes, in log2(`concurrency`) steps, so only the final
+ * result is sent back to the caller. Partial results are combined in the
+ * order of `args`, so `combine` must be associative, but not necessarily
+ * commutative.
+ *
+ * \param f The Python function that should be applied to each argument.
+ *
+ * \param combine The Python function that combines two (partial) results.
+ *
+ * \param args The arguments as a Python iterable.
+ *
+ * \param concurrency The level of concurrency. If not supplied, this is set
+ * to the number of physical cores available.
+ *
+ * \return The combined result.
+ *
+ * \throws std::runtime_error If `args` is empty.
+ */
+py::object map_reduce(const py::function &f, const py::function &combine,
+                      const py::iterable &args, uint concurrency = 0);
+
+/**
+ * \brief `functools.reduce(combine, map(f, args), initial)` executed in
+ * parallel. See `map_reduce()`.
+ *
+ * \param initial Combined with the result of `args` as the first argument of
+ * `combine`, or returned if `args` is empty.
+ */
+py::object map_reduce_initial(const py::function &f,
+                              const py::function &combine,
+                              const py::iterable &args,
+                              const py::object &initial, uint concurrency = 0);
+
+/**
+ * \brief `functools.reduce(combine, args)` executed in parallel. See
+ * `map_reduce()`.
+ */
+py::object reduce(const py::function &combine, const py::iterable &args,
+                  uint concurrency = 0);
+
+/**
+ * \brief `functools.reduce(combine, args, initial)` executed in parallel. See
+ * `map_reduce_initial()`.
+ */
+py::object reduce_initial(const py::function &combine,
+                          const py::iterable &args, const py::object &initial,
+                          uint concurrency = 0);
 
 } // namespace snakefish
 
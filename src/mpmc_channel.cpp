@@ -0,0 +1,210 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include "mpmc_channel.h"
+#include "util.h"
+
+namespace snakefish {
+
+mpmc_channel::mpmc_channel(const size_t n_slots, const size_t slot_size)
+    : n_free(n_slots), n_unread(), n_slots(n_slots), slot_size(slot_size),
+      spin_time(DEFAULT_SPIN_TIME) {
+  if (n_slots == 0 || slot_size == 0) {
+    throw std::runtime_error("n_slots and slot_size must be positive");
+  }
+
+  // imports pickle functions
+  dumps = py::module::import("pickle").attr("dumps");
+  loads = py::module::import("pickle").attr("loads");
+
+  // keep every slot header at the start of a cache line
+  slot_stride = (sizeof(slot_header) + slot_size + 63) / 64 * 64;
+
+  // create shared memory
+  pos = static_cast<positions *>(
+      util::get_shared_mem(sizeof(positions), true));
+  slots = util::get_shared_mem(n_slots * slot_stride, false);
+
+  // initialize metadata
+  // slot i is ready for position i to be written
+  pos->enqueue_pos.store(0);
+  pos->dequeue_pos.store(0);
+  for (size_t i = 0; i < n_slots; i++) {
+    slot_header *slot = get_slot(i);
+    slot->seq.store(i);
+    slot->len = 0;
+  }
+
+  // ensure that shared atomic variables are lock free
+  if (!pos->enqueue_pos.is_lock_free()) {
+    fprintf(stderr, "std::atomic_size_t is not lock free!\n");
+    abort();
+  }
+}
+
+/**
+ * \brief Decrement `sem`, possibly waiting for it.
+ *
+ * \returns `true` on success. `false` if `block` is `false` and the call
+ * would block, or if `timeout` expired.
+ */
+static bool acquire(semaphore_t &sem, const bool block, const double timeout,
+                    const uint64_t spin_time) {
+  if (sem.trywait())
+    return true;
+  if (!block)
+    return false;
+
+  util::gil_release nogil;
+  if (timeout < 0) {
+    sem.wait(spin_time);
+    return true;
+  }
+  return sem.timedwait(timeout);
+}
+
+/**
+ * \brief Spin until `seq` reaches `expected`.
+ *
+ * The semaphores guarantee that the slot is about to be ready, so this only
+ * waits for another process to finish copying.
+ */
+static void wait_for_seq(const std::atomic_size_t &seq, const size_t expected) {
+  unsigned spins = 0;
+  while (seq.load(std::memory_order_acquire) != expected) {
+    if (++spins < 1024) {
+      util::cpu_relax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+size_t mpmc_channel::claim_write(const bool block, const double timeout) {
+  if (!acquire(n_free, block, timeout, spin_time)) {
+    throw std::overflow_error("channel buffer is full");
+  }
+
+  size_t p = pos->enqueue_pos.fetch_add(1, std::memory_order_relaxed);
+  wait_for_seq(get_slot(p)->seq, p);
+  return p;
+}
+
+size_t mpmc_channel::claim_read(const bool block, const double timeout) {
+  if (!acquire(n_unread, block, timeout, spin_time)) {
+    throw std::out_of_range(block ? "receive timed out"
+                                  : "out-of-bounds read detected");
+  }
+
+  size_t p = pos->dequeue_pos.fetch_add(1, std::memory_order_relaxed);
+  wait_for_seq(get_slot(p)->seq, p + 1);
+  return p;
+}
+
+void mpmc_channel::release_read(const size_t p) {
+  // the slot can be written again one lap later
+  get_slot(p)->seq.store(p + n_slots, std::memory_order_release);
+  n_free.post();
+}
+
+void mpmc_channel::send_bytes(const void *bytes, const size_t len,
+                              const bool block, const double timeout) {
+  if (len > slot_size) {
+    throw std::overflow_error("message is larger than the slot size");
+  }
+
+  size_t p = claim_write(block, timeout);
+  slot_header *slot = get_slot(p);
+  slot->len = len;
+  {
+    std::unique_ptr<util::gil_release> nogil;
+    if (len >= GIL_RELEASE_THRESHOLD)
+      nogil.reset(new util::gil_release());
+    memcpy(reinterpret_cast<char *>(slot + 1), bytes, len);
+  }
+
+  // publish the message
+  slot->seq.store(p + 1, std::memory_order_release);
+  n_unread.post();
+}
+
+void mpmc_channel::send_pyobj(const py::object &obj, const bool block,
+                              const double timeout) {
+  // serialize obj to binary and get output
+  py::bytes bytes = dumps(obj, PICKLE_PROTOCOL);
+
+  // send
+  send_bytes(PyBytes_AS_STRING(bytes.ptr()), PyBytes_GET_SIZE(bytes.ptr()),
+             block, timeout);
+}
+
+buffer mpmc_channel::receive_bytes(const bool block, const double timeout) {
+  size_t p = claim_read(block, timeout);
+  slot_header *slot = get_slot(p);
+
+  try {
+    buffer buf = buffer(slot->len, buffer_type::MALLOC);
+    {
+      std::unique_ptr<util::gil_release> nogil;
+      if (slot->len >= GIL_RELEASE_THRESHOLD)
+        nogil.reset(new util::gil_release());
+      memcpy(buf.get_ptr(), slot + 1, slot->len);
+    }
+    release_read(p);
+    return buf;
+  } catch (const std::bad_alloc &e) {
+    // the message is lost, but the slot must not be
+    release_read(p);
+    throw e;
+  }
+}
+
+py::object mpmc_channel::receive_pyobj(const bool block, const double timeout) {
+  size_t p = claim_read(block, timeout);
+  slot_header *slot = get_slot(p);
+
+  // unpickle straight from the slot, and free it no matter what
+  try {
+    py::object obj;
+    {
+      py::object mem_view = py::reinterpret_steal<py::object>(
+          PyMemoryView_FromMemory(reinterpret_cast<char *>(slot + 1),
+                                  slot->len, PyBUF_READ));
+      obj = loads(mem_view);
+    }
+    release_read(p);
+    return obj;
+  } catch (...) {
+    release_read(p);
+    throw;
+  }
+}
+
+void mpmc_channel::dispose() {
+  if (munmap(pos, sizeof(positions))) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (munmap(slots, n_slots * slot_stride)) {
+    perror("munmap() failed");
+    abort();
+  }
+  try {
+    n_free.destroy();
+  } catch (...) {
+    abort();
+  }
+  try {
+    n_unread.destroy();
+  } catch (...) {
+    abort();
+  }
+}
+
+} // namespace snakefish
@@ -0,0 +1,281 @@
+/**
+ * \file mpmc_channel.h
+ */
+
+#ifndef SNAKEFISH_MPMC_CHANNEL_H
+#define SNAKEFISH_MPMC_CHANNEL_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "buffer.h"
+#include "channel.h"
+#include "semaphore_t.h"
+
+namespace snakefish {
+
+/**
+ * \brief The default number of slots of an `mpmc_channel`.
+ */
+const size_t DEFAULT_MPMC_SLOTS = 1024;
+
+/**
+ * \brief The default slot size (i.e. maximum message size in bytes) of an
+ * `mpmc_channel`.
+ */
+const size_t DEFAULT_MPMC_SLOT_SIZE = 64 * 1024;
+
+/**
+ * \brief An IPC channel that any number of senders and receivers can share.
+ *
+ * Unlike `channel`, messages are kept in a ring of fixed-size slots, and each
+ * slot has a sequence number. A sender claims the next position by
+ * incrementing `enqueue_pos` and a receiver by incrementing `dequeue_pos`, so
+ * there is no global lock. The sequence number of a slot tells whether the
+ * slot at a given position has been written (and can be read) or has been
+ * read (and can be written again). Semaphores counting the free and the
+ * written slots make sure that a position is only claimed when it's about to
+ * be available, so waiting for the sequence number is a short spin.
+ *
+ * Messages are received in the order their positions were claimed. A message
+ * can't be larger than a slot.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a channel is no
+ * longer needed to release resources.
+ *
+ * Characteristics of the functions:
+ * - `send_bytes()`: may or may not block^^; can throw
+ * - `send_pyobj()`: may or may not block^^; can throw
+ * - `receive_bytes()`: may or may not block^; can throw
+ * - `receive_pyobj()`: may or may not block^; can throw
+ *
+ * ^, ^^: See `channel`
+ */
+class mpmc_channel {
+public:
+  /**
+   * \brief Create a channel with `DEFAULT_MPMC_SLOTS` slots of
+   * `DEFAULT_MPMC_SLOT_SIZE` bytes.
+   */
+  mpmc_channel() : mpmc_channel(DEFAULT_MPMC_SLOTS, DEFAULT_MPMC_SLOT_SIZE) {}
+
+  /**
+   * \brief Default destructor.
+   */
+  ~mpmc_channel() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  mpmc_channel(const mpmc_channel &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  mpmc_channel &operator=(const mpmc_channel &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  mpmc_channel(mpmc_channel &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  mpmc_channel &operator=(mpmc_channel &&t) = delete;
+
+  /**
+   * \brief Create a channel with `n_slots` slots of `slot_size` bytes.
+   *
+   * Note that the slots will be allocated using `mmap()` with flag
+   * `MAP_NORESERVE`, so memory is only used by slots that have been written.
+   *
+   * \throws std::runtime_error If `n_slots` or `slot_size` is 0.
+   * \throws std::bad_alloc If `mmap()` failed.
+   */
+  mpmc_channel(size_t n_slots, size_t slot_size);
+
+  /**
+   * \brief Send some bytes.
+   *
+   * \param bytes Pointer to the start of the bytes.
+   * \param len Number of bytes to send.
+   * \param block Should this function wait for a free slot?
+   * \param timeout If `block` is `true`, the maximum number of seconds to wait.
+   * `NO_TIMEOUT` means no limit.
+   *
+   * \throws std::overflow_error If there's no free slot (this only applies
+   * when `block` is `false`), if `timeout` expired, or if `len` is larger than
+   * the slot size.
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_bytes(const void *bytes, size_t len, bool block = false,
+                  double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Send a Python object.
+   *
+   * This function will serialize `obj` using `pickle` and send the binary
+   * output. See `send_bytes()`.
+   */
+  void send_pyobj(const py::object &obj, bool block = false,
+                  double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Receive some bytes.
+   *
+   * \param block Should this function block?
+   * \param timeout If `block` is `true`, the maximum number of seconds to wait.
+   * `NO_TIMEOUT` means no limit.
+   *
+   * \returns The received bytes wrapped in a `buffer`.
+   *
+   * \throws std::out_of_range If there's no message (this only applies when
+   * `block` is `false`), or if `timeout` expired.
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  buffer receive_bytes(bool block, double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Receive a Python object.
+   *
+   * The object is unpickled straight from its slot, which is freed right
+   * after. See `receive_bytes()`.
+   */
+  py::object receive_pyobj(bool block, double timeout = NO_TIMEOUT);
+
+  /**
+   * \brief Check whether there's an unread message, without receiving it.
+   *
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  bool is_ready() { return n_unread.peek(); }
+
+  /**
+   * \brief Get the number of slots of this channel.
+   */
+  size_t get_n_slots() { return n_slots; }
+
+  /**
+   * \brief Get the slot size (i.e. maximum message size in bytes) of this
+   * channel.
+   */
+  size_t get_slot_size() { return slot_size; }
+
+  /**
+   * \brief Set the spin time of this channel. See `channel::set_spin_time()`.
+   */
+  void set_spin_time(uint64_t spin_time) { this->spin_time = spin_time; }
+
+  /**
+   * \brief Get the spin time (in microseconds) of this channel.
+   */
+  uint64_t get_spin_time() { return spin_time; }
+
+  /**
+   * \brief Release resources held by this channel.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief Positions claimed so far, shared by all processes.
+   *
+   * The two counters are kept on separate cache lines, so senders and
+   * receivers don't contend for the same line.
+   */
+  struct positions {
+    alignas(64) std::atomic_size_t enqueue_pos;
+    alignas(64) std::atomic_size_t dequeue_pos;
+  };
+
+  /**
+   * \brief The header at the start of each slot.
+   */
+  struct slot_header {
+    std::atomic_size_t seq; // position this slot is ready for
+    size_t len;             // length of the message in this slot
+  };
+
+  /**
+   * \brief Get the header of the slot holding position `pos`.
+   */
+  slot_header *get_slot(size_t pos) {
+    return reinterpret_cast<slot_header *>(static_cast<char *>(slots) +
+                                           (pos % n_slots) * slot_stride);
+  }
+
+  /**
+   * \brief Claim a free slot, and return its position.
+   */
+  size_t claim_write(bool block, double timeout);
+
+  /**
+   * \brief Claim a written slot, and return its position.
+   */
+  size_t claim_read(bool block, double timeout);
+
+  /**
+   * \brief Free the slot at position `pos` after reading it.
+   */
+  void release_read(size_t pos);
+
+  /**
+   * \brief The counters of claimed positions.
+   */
+  positions *pos;
+
+  /**
+   * \brief The slots.
+   */
+  void *slots;
+
+  /**
+   * \brief A semaphore representing the number of free slots.
+   */
+  semaphore_t n_free;
+
+  /**
+   * \brief A semaphore representing the number of unread messages.
+   */
+  semaphore_t n_unread;
+
+  /**
+   * \brief Number of slots.
+   */
+  size_t n_slots;
+
+  /**
+   * \brief Maximum message size.
+   */
+  size_t slot_size;
+
+  /**
+   * \brief Distance between two slots, which keeps slots cache-line aligned.
+   */
+  size_t slot_stride;
+
+  /**
+   * \brief How long (in microseconds) to spin before blocking.
+   */
+  uint64_t spin_time;
+
+private:
+  /**
+   * \brief Python function `pickle.dumps()`.
+   */
+  py::object dumps;
+
+  /**
+   * \brief Python function `pickle.loads()`.
+   */
+  py::object loads;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_MPMC_CHANNEL_H
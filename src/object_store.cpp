@@ -0,0 +1,286 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "object_store.h"
+#include "util.h"
+
+namespace snakefish {
+
+static const uint64_t COUNT_MASK = 0xffffffff;
+
+static inline size_t round_up(const size_t n, const size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+object_store::object_store(const size_t size, const uint32_t max_objects)
+    : lock(1), capacity(size / sizeof(block_header) * sizeof(block_header)),
+      max_objects(max_objects) {
+  if (capacity == 0 || max_objects == 0) {
+    throw std::runtime_error("size and max_objects must be positive");
+  }
+
+  // create shared memory
+  arena = util::get_shared_mem(capacity, false);
+  entries = static_cast<store_entry *>(
+      util::get_shared_mem(max_objects * sizeof(store_entry), true));
+  used = static_cast<std::atomic_size_t *>(
+      util::get_shared_mem(sizeof(std::atomic_size_t), true));
+
+  // initialize metadata
+  // the arena starts as one free block
+  auto *first = static_cast<block_header *>(arena);
+  first->size = capacity;
+  first->free = true;
+  for (uint32_t i = 0; i < max_objects; i++) {
+    entries[i].state.store(0);
+    entries[i].used = false;
+  }
+  used->store(0);
+
+  // ensure that shared atomic variables are lock free
+  if (!entries[0].state.is_lock_free()) {
+    fprintf(stderr, "std::atomic_uint64_t is not lock free!\n");
+    abort();
+  }
+}
+
+uint64_t object_store::put_bytes(const void *bytes, const size_t len) {
+  auto n = static_cast<ssize_t>(len);
+  return put_buffer(bytes, len, 1, "B", 1, &n);
+}
+
+/**
+ * \brief A `Py_buffer`, released when this goes out of scope.
+ */
+struct scoped_buffer {
+  ~scoped_buffer() { PyBuffer_Release(&view); }
+
+  Py_buffer view;
+};
+
+uint64_t object_store::put(const py::object &obj) {
+  scoped_buffer buf;
+  if (PyObject_GetBuffer(obj.ptr(), &buf.view,
+                         PyBUF_C_CONTIGUOUS | PyBUF_FORMAT)) {
+    throw py::error_already_set();
+  }
+
+  const char *format = (buf.view.format != nullptr) ? buf.view.format : "B";
+  if (buf.view.ndim > STORE_MAX_NDIM) {
+    throw std::runtime_error("the buffer has too many dimensions");
+  }
+  if (strlen(format) >= sizeof(store_entry::format)) {
+    throw std::runtime_error("the buffer format is too long");
+  }
+
+  return put_buffer(buf.view.buf, buf.view.len, buf.view.itemsize, format,
+                    buf.view.ndim, buf.view.shape);
+}
+
+uint64_t object_store::put_buffer(const void *bytes, const size_t len,
+                                  const size_t itemsize, const char *format,
+                                  const int ndim, const ssize_t *shape) {
+  // claim an entry and some space
+  lock.wait();
+  uint32_t i = 0;
+  while (i < max_objects && entries[i].used)
+    i++;
+  if (i == max_objects) {
+    lock.post();
+    throw std::overflow_error("object store is full");
+  }
+
+  size_t offset = allocate(len);
+  if (offset == capacity) {
+    lock.post();
+    throw std::overflow_error("object store is full");
+  }
+
+  store_entry &entry = entries[i];
+  entry.used = true;
+  lock.post();
+
+  // fill it in
+  entry.offset = offset;
+  entry.len = len;
+  entry.itemsize = itemsize;
+  entry.ndim = ndim;
+  for (int d = 0; d < ndim; d++)
+    entry.shape[d] = shape[d];
+  strcpy(entry.format, format);
+  {
+    std::unique_ptr<util::gil_release> nogil;
+    if (len >= GIL_RELEASE_THRESHOLD)
+      nogil.reset(new util::gil_release());
+    memcpy(static_cast<char *>(arena) + offset, bytes, len);
+  }
+
+  // publish the object, with one reference
+  uint64_t gen = entry.state.load(std::memory_order_relaxed) >> 32;
+  entry.state.store((gen << 32) | 1, std::memory_order_release);
+  return (gen << 32) | i;
+}
+
+object_view object_store::get(const uint64_t handle) {
+  retain(handle);
+  store_entry *entry = get_entry(handle);
+  return object_view(this, handle, entry,
+                     static_cast<char *>(arena) + entry->offset);
+}
+
+void object_store::retain(const uint64_t handle) {
+  store_entry *entry = get_entry(handle);
+  uint64_t state = entry->state.load(std::memory_order_acquire);
+  do {
+    // a freed object can't be brought back
+    if ((state >> 32) != (handle >> 32) || (state & COUNT_MASK) == 0) {
+      throw std::out_of_range("invalid or released handle");
+    }
+  } while (!entry->state.compare_exchange_weak(state, state + 1,
+                                               std::memory_order_acquire));
+}
+
+void object_store::release(const uint64_t handle) {
+  store_entry *entry = get_entry(handle);
+  uint64_t state = entry->state.load(std::memory_order_relaxed);
+  do {
+    if ((state >> 32) != (handle >> 32) || (state & COUNT_MASK) == 0) {
+      throw std::out_of_range("invalid or released handle");
+    }
+  } while (!entry->state.compare_exchange_weak(state, state - 1,
+                                               std::memory_order_acq_rel));
+  if ((state & COUNT_MASK) > 1)
+    return;
+
+  // that was the last reference
+  // bumping the generation invalidates all handles to the object
+  lock.wait();
+  free_block(entry->offset);
+  entry->state.store(((handle >> 32) + 1) << 32);
+  entry->used = false;
+  lock.post();
+}
+
+store_entry *object_store::get_entry(const uint64_t handle) {
+  if ((handle & COUNT_MASK) >= max_objects) {
+    throw std::out_of_range("invalid or released handle");
+  }
+  return &entries[handle & COUNT_MASK];
+}
+
+size_t object_store::allocate(const size_t len) {
+  size_t need = sizeof(block_header) + round_up(len, sizeof(block_header));
+  char *base = static_cast<char *>(arena);
+
+  // first fit, merging free blocks along the way
+  size_t offset = 0;
+  while (offset < capacity) {
+    auto *block = reinterpret_cast<block_header *>(base + offset);
+    if (block->free) {
+      while (offset + block->size < capacity) {
+        auto *next =
+            reinterpret_cast<block_header *>(base + offset + block->size);
+        if (!next->free)
+          break;
+        block->size += next->size;
+      }
+
+      if (block->size >= need) {
+        // split off the rest if it's large enough to be useful
+        if (block->size - need >= 2 * sizeof(block_header)) {
+          auto *rest = reinterpret_cast<block_header *>(base + offset + need);
+          rest->size = block->size - need;
+          rest->free = true;
+          block->size = need;
+        }
+        block->free = false;
+        used->fetch_add(block->size);
+        return offset + sizeof(block_header);
+      }
+    }
+    offset += block->size;
+  }
+
+  return capacity;
+}
+
+void object_store::free_block(const size_t offset) {
+  char *base = static_cast<char *>(arena);
+  auto *block =
+      reinterpret_cast<block_header *>(base + offset - sizeof(block_header));
+  block->free = true;
+  used->fetch_sub(block->size);
+
+#ifdef MADV_REMOVE
+  // give the pages of the payload back to the OS
+  // the headers are kept, since they are still needed
+  auto page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  auto start = reinterpret_cast<uintptr_t>(base + offset);
+  auto stop = reinterpret_cast<uintptr_t>(block) + block->size;
+  start = (start + page - 1) / page * page;
+  stop = stop / page * page;
+  if (start < stop) {
+    // this is only an optimization, so failures are ignored
+    madvise(reinterpret_cast<void *>(start), stop - start, MADV_REMOVE);
+  }
+#endif
+}
+
+void object_store::dispose() {
+  if (munmap(arena, capacity)) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (munmap(entries, max_objects * sizeof(store_entry))) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (munmap(used, sizeof(std::atomic_size_t))) {
+    perror("munmap() failed");
+    abort();
+  }
+  try {
+    lock.destroy();
+  } catch (...) {
+    abort();
+  }
+}
+
+void object_view::release() {
+  if (store != nullptr) {
+    store->release(handle);
+    store = nullptr;
+  }
+  entry = nullptr;
+  ptr = nullptr;
+}
+
+py::buffer_info object_view::get_buffer_info() {
+  if (entry == nullptr) {
+    return py::buffer_info(nullptr, 1, py::format_descriptor<uint8_t>::format(),
+                           1, {0}, {1}, true);
+  }
+
+  // C-contiguous strides
+  std::vector<ssize_t> shape(entry->shape, entry->shape + entry->ndim);
+  std::vector<ssize_t> strides(entry->ndim);
+  auto stride = static_cast<ssize_t>(entry->itemsize);
+  for (int d = entry->ndim - 1; d >= 0; d--) {
+    strides[d] = stride;
+    stride *= shape[d];
+  }
+  return py::buffer_info(ptr, static_cast<ssize_t>(entry->itemsize),
+                         std::string(entry->format), entry->ndim, shape,
+                         strides, true);
+}
+
+} // namespace snakefish
@@ -0,0 +1,339 @@
+/**
+ * \file object_store.h
+ */
+
+#ifndef SNAKEFISH_OBJECT_STORE_H
+#define SNAKEFISH_OBJECT_STORE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "semaphore_t.h"
+
+namespace snakefish {
+
+/**
+ * \brief The default arena size of an `object_store`.
+ *
+ * Note that the arena will be allocated using `mmap()` with flag
+ * `MAP_NORESERVE`, so the actual memory consumption is much lower in general.
+ */
+const size_t DEFAULT_STORE_SIZE = 2l * 1024l * 1024l * 1024l; // 2 GiB
+
+/**
+ * \brief The default maximum number of objects in an `object_store`.
+ */
+const uint32_t DEFAULT_STORE_OBJECTS = 4096;
+
+/**
+ * \brief The maximum number of dimensions of a stored buffer.
+ */
+const int STORE_MAX_NDIM = 8;
+
+/**
+ * \brief An object in an `object_store`, shared by all processes.
+ */
+struct store_entry {
+  // generation in the high 32 bits, reference count in the low 32 bits
+  // the generation changes every time the entry is reused, so that stale
+  // handles are detected
+  std::atomic_uint64_t state;
+  bool used; // has this entry been handed out?
+  size_t offset; // offset of the payload in the arena
+  size_t len;    // length of the payload
+  size_t itemsize;
+  int ndim;
+  ssize_t shape[STORE_MAX_NDIM];
+  char format[16];
+};
+
+class object_store;
+
+/**
+ * \brief A read-only view of an object in an `object_store`.
+ *
+ * The view points straight into the store's arena, and holds a reference to
+ * the object. The object can't be freed until the view is released or
+ * destroyed.
+ */
+class object_view {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  object_view() = delete;
+
+  /**
+   * \brief No copy constructor.
+   */
+  object_view(const object_view &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  object_view &operator=(const object_view &t) = delete;
+
+  /**
+   * \brief Move constructor. The moved-from view will be empty.
+   */
+  object_view(object_view &&t) noexcept
+      : store(t.store), handle(t.handle), entry(t.entry), ptr(t.ptr) {
+    t.store = nullptr;
+    t.entry = nullptr;
+    t.ptr = nullptr;
+  }
+
+  /**
+   * \brief No move assignment operator.
+   */
+  object_view &operator=(object_view &&t) = delete;
+
+  /**
+   * \brief Create a view. The caller must have taken a reference for it.
+   */
+  object_view(object_store *store, uint64_t handle, store_entry *entry,
+              void *ptr)
+      : store(store), handle(handle), entry(entry), ptr(ptr) {}
+
+  /**
+   * \brief Destructor. This releases the view.
+   */
+  ~object_view() { release(); }
+
+  /**
+   * \brief Get a pointer to the start of the object.
+   */
+  void *get_ptr() { return ptr; }
+
+  /**
+   * \brief Get the length (in bytes) of the object.
+   */
+  size_t get_len() { return (entry != nullptr) ? entry->len : 0; }
+
+  /**
+   * \brief Release this view. After this, the view is empty and the memory
+   * it pointed to must not be accessed.
+   */
+  void release();
+
+  /**
+   * \brief Describe this view for Python's buffer protocol. The view is
+   * exposed as a read-only, C-contiguous array with the format and shape of
+   * the buffer that was stored.
+   */
+  py::buffer_info get_buffer_info();
+
+private:
+  object_store *store;
+  uint64_t handle;
+  store_entry *entry;
+  void *ptr;
+};
+
+/**
+ * \brief A shared-memory store for large, immutable payloads.
+ *
+ * A process can `put()` a payload (e.g. `bytes` or a numpy array) into the
+ * store once, and pass the returned handle (a small integer) to other
+ * processes, e.g. through a `channel`. They can then `get()` zero-copy views
+ * of the payload, without any pickling or copying.
+ *
+ * Payloads live in an arena created with the store, so the store must be
+ * created before forking for other processes to see it. The arena is managed
+ * by a first-fit allocator, under a lock, and freed pages are given back to
+ * the OS. Each object is reference counted: `put()` returns a handle holding
+ * one reference, `retain()` and `get()` add one, and `release()` (or
+ * releasing the view returned by `get()`) removes one. The object is freed
+ * when its count drops to 0. References held by a process that dies are
+ * never released.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a store is no
+ * longer needed to release resources. All views must be released first.
+ */
+class object_store {
+public:
+  /**
+   * \brief Create a store with `DEFAULT_STORE_SIZE` bytes and
+   * `DEFAULT_STORE_OBJECTS` objects.
+   */
+  object_store() : object_store(DEFAULT_STORE_SIZE, DEFAULT_STORE_OBJECTS) {}
+
+  /**
+   * \brief Default destructor.
+   */
+  ~object_store() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  object_store(const object_store &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  object_store &operator=(const object_store &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  object_store(object_store &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  object_store &operator=(object_store &&t) = delete;
+
+  /**
+   * \brief Create a store with an arena of `size` bytes, holding at most
+   * `max_objects` objects.
+   *
+   * \throws std::runtime_error If `size` or `max_objects` is 0.
+   * \throws std::bad_alloc If `mmap()` failed.
+   */
+  object_store(size_t size, uint32_t max_objects);
+
+  /**
+   * \brief Copy some bytes into the store.
+   *
+   * \param bytes Pointer to the start of the bytes.
+   * \param len Number of bytes.
+   *
+   * \returns A handle holding one reference to the object.
+   *
+   * \throws std::overflow_error If the store doesn't have enough space or
+   * objects left.
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  uint64_t put_bytes(const void *bytes, size_t len);
+
+  /**
+   * \brief Copy a Python object supporting the buffer protocol (e.g. `bytes`
+   * or a numpy array) into the store. Its format and shape are kept.
+   *
+   * \returns See `put_bytes()`.
+   *
+   * \throws std::overflow_error See `put_bytes()`.
+   * \throws std::runtime_error If `obj` has more than `STORE_MAX_NDIM`
+   * dimensions or an unusually long format.
+   * \throws py::error_already_set If `obj` can't export a C-contiguous
+   * buffer.
+   */
+  uint64_t put(const py::object &obj);
+
+  /**
+   * \brief Get a zero-copy view of an object, holding a reference to it.
+   *
+   * \throws std::out_of_range If `handle` is invalid or the object has been
+   * freed.
+   */
+  object_view get(uint64_t handle);
+
+  /**
+   * \brief Add a reference to an object.
+   *
+   * \throws std::out_of_range If `handle` is invalid or the object has been
+   * freed.
+   */
+  void retain(uint64_t handle);
+
+  /**
+   * \brief Remove a reference from an object, and free the object if it was
+   * the last one.
+   *
+   * \throws std::out_of_range If `handle` is invalid or the object has been
+   * freed.
+   */
+  void release(uint64_t handle);
+
+  /**
+   * \brief Get the size (in bytes) of the arena.
+   */
+  size_t get_capacity() { return capacity; }
+
+  /**
+   * \brief Get the number of bytes in use, including allocator overhead.
+   */
+  size_t get_used() { return used->load(); }
+
+  /**
+   * \brief Release resources held by this store.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief The header before each block of the arena.
+   *
+   * Headers take a whole cache line, so payloads stay 64-byte aligned.
+   */
+  struct alignas(64) block_header {
+    size_t size; // size of the block, including the header
+    bool free;
+  };
+
+  /**
+   * \brief Copy a payload into the store. See `put_bytes()` and `put()`.
+   */
+  uint64_t put_buffer(const void *bytes, size_t len, size_t itemsize,
+                      const char *format, int ndim, const ssize_t *shape);
+
+  /**
+   * \brief Allocate a block with room for `len` bytes. The caller must hold
+   * `lock`.
+   *
+   * \returns The offset of the payload, or `capacity` if there's no room.
+   */
+  size_t allocate(size_t len);
+
+  /**
+   * \brief Free the block whose payload starts at `offset`. The caller must
+   * hold `lock`.
+   */
+  void free_block(size_t offset);
+
+  /**
+   * \brief Get the entry of `handle`.
+   *
+   * \throws std::out_of_range If `handle` is invalid.
+   */
+  store_entry *get_entry(uint64_t handle);
+
+  /**
+   * \brief The arena holding the payloads.
+   */
+  void *arena;
+
+  /**
+   * \brief The entries of the objects.
+   */
+  store_entry *entries;
+
+  /**
+   * \brief "Mutex" for the allocator and the entries.
+   */
+  semaphore_t lock;
+
+  /**
+   * \brief Number of bytes in use.
+   */
+  std::atomic_size_t *used;
+
+  /**
+   * \brief Size of the arena.
+   */
+  size_t capacity;
+
+  /**
+   * \brief Number of entries.
+   */
+  uint32_t max_objects;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_OBJECT_STORE_H
@@ -0,0 +1,516 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include "forkserver.h"
+#include "pool.h"
+#include "shm_pool.h"
+#include "util.h"
+
+namespace snakefish {
+
+pool::pool(uint concurrency)
+    : is_parent(true), closed(false), busy(false), concurrency(concurrency),
+      next_worker(0), n_results() {
+  // use default concurrency (i.e. # of cores)?
+  if (this->concurrency == 0) {
+    this->concurrency = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  // create channels
+  child_pids.reserve(this->concurrency);
+  task_channels.reserve(this->concurrency);
+  result_channels.reserve(this->concurrency);
+  for (uint i = 0; i < this->concurrency; i++) {
+    task_channels.emplace_back(DEFAULT_CHANNEL_SIZE, true);
+    result_channels.emplace_back(DEFAULT_CHANNEL_SIZE, true);
+  }
+
+  // spawn workers
+  for (uint i = 0; i < this->concurrency; i++) {
+    pid_t pid = spawn_from_forkserver(i);
+    if (pid == 0)
+      pid = fork_child();
+    if (pid > 0) {
+      child_pids.push_back(pid);
+    } else if (pid == 0) {
+      is_parent = false;
+      run(i);
+    } else {
+      perror("fork() failed");
+      dispose(); // stop the workers spawned so far
+      throw std::runtime_error("fork() failed");
+    }
+  }
+}
+
+std::vector<py::object> pool::map(const py::object &f,
+                                  const py::iterable &args,
+                                  const uint chunksize) {
+  return _map(f, args, chunksize, false);
+}
+
+std::vector<py::object> pool::starmap(const py::object &f,
+                                      const py::iterable &args,
+                                      const uint chunksize) {
+  return _map(f, args, chunksize, true);
+}
+
+py::object pool::apply(const py::object &f, const py::tuple &args) {
+  check_available();
+
+  uint i = next_worker;
+  py::list task_args;
+  task_args.append(args);
+  send_task(i, f, task_args, true);
+  next_worker = (next_worker + 1) % concurrency;
+
+  std::vector<py::object> results;
+  py::object error;
+  if (!receive_result(i, results, error)) {
+    rethrow(error);
+  }
+  return results[0];
+}
+
+std::unique_ptr<imap_iterator> pool::imap(const py::object &f,
+                                          const py::iterable &args,
+                                          const uint chunksize,
+                                          const uint max_in_flight) {
+  return std::unique_ptr<imap_iterator>(
+      new imap_iterator(*this, f, args, chunksize, max_in_flight, true));
+}
+
+std::unique_ptr<imap_iterator>
+pool::imap_unordered(const py::object &f, const py::iterable &args,
+                     const uint chunksize, const uint max_in_flight) {
+  return std::unique_ptr<imap_iterator>(
+      new imap_iterator(*this, f, args, chunksize, max_in_flight, false));
+}
+
+void pool::close() {
+  if (!is_parent) {
+    fprintf(stderr, "close() called from child!\n");
+    abort();
+  }
+  if (closed) {
+    return;
+  }
+  closed = true;
+
+  // None tells a worker to stop
+  for (size_t i = 0; i < child_pids.size(); i++) {
+    task_channels[i].send_pyobj(py::none());
+  }
+
+  for (pid_t pid : child_pids) {
+    int status = 0;
+    int result;
+    {
+      util::gil_release nogil;
+      result = waitpid(pid, &status, 0);
+    }
+    if (result == -1) {
+      perror("waitpid() failed");
+      throw std::runtime_error("waitpid() failed");
+    }
+    note_reaped();
+  }
+}
+
+void pool::dispose() {
+  close();
+  for (channel &c : task_channels) {
+    c.dispose();
+  }
+  for (channel &c : result_channels) {
+    c.dispose();
+  }
+  try {
+    n_results.destroy();
+  } catch (...) {
+    abort();
+  }
+}
+
+void pool::check_available() {
+  if (closed) {
+    throw std::runtime_error("this pool has been closed");
+  }
+  if (busy) {
+    throw std::runtime_error("this pool is busy with an unfinished imap()");
+  }
+}
+
+std::vector<py::object> pool::_map(const py::object &f,
+                                   const py::iterable &args, uint chunksize,
+                                   const bool star) {
+  check_available();
+
+  py::list arg_list = py::list(args); // assemble args
+  size_t n_args = arg_list.size();
+  if (n_args == 0) {
+    return std::vector<py::object>();
+  }
+
+  // use default chunk size?
+  if (chunksize == 0) {
+    chunksize = (n_args + concurrency - 1) / concurrency;
+  }
+
+  // hand out tasks round-robin
+  std::vector<uint> workers; // worker of each task, in order
+  std::vector<py::object> results;
+  py::object error;
+  results.reserve(n_args);
+  workers.reserve((n_args + chunksize - 1) / chunksize);
+
+  try {
+    for (size_t i = 0; i < n_args; i += chunksize) {
+      py::list task_args;
+      for (size_t j = i; j < std::min(n_args, i + chunksize); j++) {
+        task_args.append(arg_list[j]);
+      }
+
+      send_task(next_worker, f, task_args, star);
+      workers.push_back(next_worker);
+      next_worker = (next_worker + 1) % concurrency;
+    }
+  } catch (...) {
+    // keep the channels in sync before bailing out
+    for (uint i : workers) {
+      receive_result(i, results, error);
+    }
+    throw;
+  }
+
+  // collect results
+  // each worker serves its tasks in order, so this preserves the order of args
+  for (uint i : workers) {
+    receive_result(i, results, error);
+  }
+  if (error) {
+    rethrow(error);
+  }
+
+  return results;
+}
+
+void pool::send_task(const uint i, const py::object &f, const py::list &args,
+                     const bool star) {
+  task_channels[i].send_pyobj(py::make_tuple(f, args, star));
+}
+
+bool pool::receive_result(const uint i, std::vector<py::object> &results,
+                          py::object &error) {
+  py::tuple result = result_channels[i].receive_pyobj(true);
+  n_results.wait();
+  return unpack_result(result, results, error);
+}
+
+bool pool::receive_any_result(const std::vector<uint> &candidates,
+                              uint &worker, std::vector<py::object> &results,
+                              py::object &error) {
+  // some worker is known to have sent a result
+  {
+    util::gil_release nogil;
+    n_results.wait();
+  }
+
+  while (true) {
+    for (uint i = 0; i < concurrency; i++) {
+      if (candidates[i] == 0) {
+        continue;
+      }
+
+      try {
+        py::tuple result = result_channels[i].receive_pyobj(false);
+        worker = i;
+        return unpack_result(result, results, error);
+      } catch (const std::out_of_range &e) {
+        continue;
+      }
+    }
+  }
+}
+
+bool pool::unpack_result(const py::tuple &result,
+                         std::vector<py::object> &results,
+                         py::object &error) {
+  if (result[0].cast<bool>()) {
+    for (auto r : py::list(result[1])) {
+      results.push_back(py::reinterpret_borrow<py::object>(r));
+    }
+    return true;
+  } else {
+    if (!error) {
+      error = result[1];
+    }
+    return false;
+  }
+}
+
+void pool::rethrow(const py::object &error) {
+  py::tuple exc = error;
+  py::print(py::str("").attr("join")(exc[2]));
+  PyErr_SetObject(py::object(exc[1]).ptr(), py::object(exc[0]).ptr());
+  throw py::error_already_set();
+}
+
+/**
+ * \brief What a worker spawned by the forkserver gets from its parent.
+ */
+struct pool_spawn_header {
+  channel_layout tasks;
+  channel_layout results;
+  bool has_event_fds; // are the channels' eventfds passed along?
+  sem_t *n_results;
+};
+
+pid_t pool::spawn_from_forkserver(const uint i) {
+  channel &tasks = task_channels[i];
+  channel &results = result_channels[i];
+  if (!is_forkserver_running() || !tasks.is_premapped() ||
+      !results.is_premapped() || !is_premapped(n_results.get_handle())) {
+    return 0;
+  }
+
+  pool_spawn_header h;
+  h.tasks = tasks.get_layout();
+  h.results = results.get_layout();
+  h.has_event_fds = tasks.get_event_fd() != -1 && results.get_event_fd() != -1;
+  h.n_results = n_results.get_handle();
+  std::vector<int> fds;
+  if (h.has_event_fds) {
+    fds.push_back(tasks.get_event_fd());
+    fds.push_back(results.get_event_fd());
+  }
+
+  // tasks are pickled anyway, so there's no payload
+  return forkserver_spawn(spawn_kind::POOL_WORKER, &h, sizeof(h), py::bytes(),
+                          fds);
+}
+
+void pool::run_spawned(const char *header, const py::object &payload,
+                       const std::vector<int> &fds) {
+  (void)payload;
+  pool_spawn_header h;
+  memcpy(&h, header, sizeof(h));
+
+  channel tasks(h.tasks, h.has_event_fds ? fds[0] : -1);
+  channel results(h.results, h.has_event_fds ? fds[1] : -1);
+  semaphore_t n_results = semaphore_t::attach(h.n_results);
+  serve(tasks, results, n_results);
+}
+
+void pool::run(const uint i) {
+  serve(task_channels[i], result_channels[i], n_results);
+}
+
+/**
+ * \brief Describe the exception being handled as (value, type, traceback).
+ */
+static py::tuple describe_error(py::error_already_set &e) {
+  py::object traceback;
+  if (e.trace()) {
+    traceback = py::module::import("traceback")
+                    .attr("format_exception")(e.type(), e.value(), e.trace());
+  } else {
+    traceback = py::module::import("traceback")
+                    .attr("format_exception_only")(e.type(), e.value());
+  }
+  return py::make_tuple(e.value(), e.type(), traceback);
+}
+
+/**
+ * \brief Describe a C++ exception as (value, type, traceback), where value is
+ * an `OverflowError` (e.g. for a result too large for the channel) or a
+ * `RuntimeError`.
+ */
+static py::tuple describe_error(const std::exception &e) {
+  const char *type = (dynamic_cast<const std::overflow_error *>(&e) != nullptr)
+                         ? "OverflowError"
+                         : "RuntimeError";
+  py::object value = py::module::import("builtins").attr(type)(e.what());
+  py::object traceback =
+      py::module::import("traceback")
+          .attr("format_exception_only")(value.attr("__class__"), value);
+  return py::make_tuple(value, value.attr("__class__"), traceback);
+}
+
+void pool::serve(channel &tasks, channel &results, semaphore_t &n_results) {
+  while (true) {
+    bool failed = true;
+    py::tuple error;
+    try {
+      py::object task = tasks.receive_pyobj(true);
+      if (task.is_none()) {
+        break;
+      }
+
+      // task = (f, args, star)
+      py::tuple t = task;
+      py::object f = t[0];
+      bool star = t[2].cast<bool>();
+      py::list output;
+      for (auto arg : py::list(t[1])) {
+        output.append(star ? f(*arg) : f(arg));
+      }
+
+      // block, so that a large result waits for the parent to catch up
+      results.send_pyobj(py::make_tuple(true, output), true);
+      failed = false;
+    } catch (py::error_already_set &e) {
+      error = describe_error(e);
+    } catch (const std::exception &e) {
+      error = describe_error(e);
+    }
+
+    // send exception to parent as (value, type, traceback), so that it
+    // raises instead of waiting forever for the result
+    if (failed) {
+      try {
+        results.send_pyobj(py::make_tuple(false, error), true);
+      } catch (py::error_already_set &) {
+        // the exception itself can't be pickled
+        py::object value = py::module::import("builtins")
+                               .attr("RuntimeError")(py::repr(error[0]));
+        results.send_pyobj(
+            py::make_tuple(false, py::make_tuple(value, value.attr("__class__"),
+                                                 error[2])),
+            true);
+      }
+    }
+    n_results.post();
+  }
+
+  std::exit(0);
+}
+
+imap_iterator::imap_iterator(pool &p, py::object f, const py::iterable &args,
+                             const uint chunksize, const uint max_in_flight,
+                             const bool ordered)
+    : p(p), f(std::move(f)), chunksize(std::max(chunksize, 1u)),
+      max_in_flight(max_in_flight), ordered(ordered), exhausted(false),
+      finished(false), n_in_flight(0), in_flight(p.concurrency, 0) {
+  p.check_available();
+
+  // use default max_in_flight?
+  if (this->max_in_flight == 0) {
+    this->max_in_flight = 2 * p.concurrency;
+  }
+
+  this->args = py::iter(args);
+  p.busy = true;
+}
+
+imap_iterator::~imap_iterator() {
+  try {
+    close();
+  } catch (...) {
+    fprintf(stderr, "failed to close imap_iterator!\n");
+  }
+}
+
+py::object imap_iterator::next() {
+  if (finished) {
+    throw py::stop_iteration();
+  }
+  if (p.closed) {
+    throw std::runtime_error("this pool has been closed");
+  }
+
+  while (ready.empty()) {
+    submit();
+    if (n_in_flight == 0) {
+      // done, release the pool
+      finished = true;
+      p.busy = false;
+      throw py::stop_iteration();
+    }
+
+    // collect a result
+    uint worker;
+    bool succeeded;
+    std::vector<py::object> results;
+    py::object error;
+    if (ordered) {
+      worker = task_workers.front();
+      task_workers.pop_front();
+      succeeded = p.receive_result(worker, results, error);
+    } else {
+      succeeded = p.receive_any_result(in_flight, worker, results, error);
+    }
+    in_flight[worker]--;
+    n_in_flight--;
+
+    // keep the workers busy before handing the result out
+    submit();
+    if (!succeeded) {
+      pool::rethrow(error);
+    }
+    ready.insert(ready.end(), results.begin(), results.end());
+  }
+
+  py::object result = ready.front();
+  ready.pop_front();
+  return result;
+}
+
+void imap_iterator::close() {
+  if (finished) {
+    return;
+  }
+  finished = true;
+
+  // the results of a closed pool don't need to be collected
+  if (!p.closed) {
+    std::vector<py::object> results;
+    py::object error;
+    for (uint i = 0; i < p.concurrency; i++) {
+      for (; in_flight[i] > 0; in_flight[i]--) {
+        p.receive_result(i, results, error);
+      }
+    }
+  }
+
+  n_in_flight = 0;
+  task_workers.clear();
+  ready.clear();
+  p.busy = false;
+}
+
+void imap_iterator::submit() {
+  while (!exhausted && n_in_flight < max_in_flight) {
+    // assemble args
+    py::list task_args;
+    while (task_args.size() < chunksize) {
+      PyObject *arg = PyIter_Next(args.ptr());
+      if (arg == nullptr) {
+        if (PyErr_Occurred()) {
+          throw py::error_already_set();
+        }
+        exhausted = true;
+        break;
+      }
+      task_args.append(py::reinterpret_steal<py::object>(arg));
+    }
+    if (task_args.size() == 0) {
+      break;
+    }
+
+    // hand the task to the least busy worker
+    uint worker = static_cast<uint>(
+        std::min_element(in_flight.begin(), in_flight.end()) -
+        in_flight.begin());
+    p.send_task(worker, f, task_args, false);
+    in_flight[worker]++;
+    n_in_flight++;
+    if (ordered) {
+      task_workers.push_back(worker);
+    }
+  }
+}
+
+} // namespace snakefish
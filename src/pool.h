@@ -0,0 +1,368 @@
+/**
+ * \file pool.h
+ */
+
+#ifndef SNAKEFISH_POOL_H
+#define SNAKEFISH_POOL_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "channel.h"
+#include "semaphore_t.h"
+
+namespace snakefish {
+
+class imap_iterator;
+
+/**
+ * \brief A pool of worker processes that can serve any number of jobs.
+ *
+ * Unlike `map()` and `starmap()`, which fork a new process for every chunk of
+ * arguments, a pool forks its workers once (when it's created) and keeps them
+ * around until it's closed. Each worker has a task channel and a result
+ * channel, both in SPSC mode.
+ *
+ * Since the workers are already running when a job is submitted, functions
+ * and arguments are sent to them using `pickle`. As such, they must be
+ * [picklable]
+ * (https://docs.python.org/3/library/pickle.html#what-can-be-pickled-and-unpickled).
+ * Note that functions are pickled by name, so they must have been defined
+ * before the pool was created. Global variables are not merged.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a pool is no
+ * longer needed to release resources.
+ */
+class pool {
+public:
+  /**
+   * \brief Create a pool with one worker per core.
+   *
+   * \throws std::runtime_error If `fork()` failed.
+   */
+  pool() : pool(0) {}
+
+  /**
+   * \brief Default destructor.
+   */
+  ~pool() = default;
+
+  /**
+   * \brief No copy constructor.
+   */
+  pool(const pool &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  pool &operator=(const pool &t) = delete;
+
+  /**
+   * \brief No move constructor.
+   */
+  pool(pool &&t) = delete;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  pool &operator=(pool &&t) = delete;
+
+  /**
+   * \brief Create a pool with `concurrency` workers.
+   *
+   * \param concurrency The number of workers. If 0, this is set to the number
+   * of cores in the system.
+   *
+   * \throws std::runtime_error If `fork()` failed.
+   */
+  explicit pool(uint concurrency);
+
+  /**
+   * \brief `map(f, args)` executed by the workers.
+   *
+   * \param f The Python function that should be applied to each argument.
+   *
+   * \param args The arguments as a Python iterable.
+   *
+   * \param chunksize The size of each task. If 0, `args` are handed out
+   * evenly to each worker.
+   *
+   * \return The return values as a `vector` (or a `list` in Python).
+   *
+   * \throws std::runtime_error If this pool has been closed or is busy.
+   * \throws e `map()` will rethrow the first exception thrown by `f`.
+   */
+  std::vector<py::object> map(const py::object &f, const py::iterable &args,
+                              uint chunksize = 0);
+
+  /**
+   * \brief `starmap(f, args)` executed by the workers.
+   *
+   * \param f The Python function that should be applied to each argument
+   * (after unpacking).
+   *
+   * \param args The arguments as a Python iterable.
+   *
+   * \param chunksize The size of each task. If 0, `args` are handed out
+   * evenly to each worker.
+   *
+   * \return The return values as a `vector` (or a `list` in Python).
+   *
+   * \throws std::runtime_error If this pool has been closed or is busy.
+   * \throws e `starmap()` will rethrow the first exception thrown by `f`.
+   */
+  std::vector<py::object> starmap(const py::object &f,
+                                  const py::iterable &args,
+                                  uint chunksize = 0);
+
+  /**
+   * \brief `f(*args)` executed by one of the workers.
+   *
+   * \throws std::runtime_error If this pool has been closed or is busy.
+   * \throws e `apply()` will rethrow any exception thrown by `f`.
+   */
+  py::object apply(const py::object &f, const py::tuple &args);
+
+  /**
+   * \brief Lazy `map(f, args)` executed by the workers.
+   *
+   * `args` is consumed incrementally, and at most `max_in_flight` tasks are
+   * submitted at any time, so only a bounded number of arguments and results
+   * are held in memory. Results are yielded in order as they become available.
+   *
+   * While the returned iterator is unfinished, the pool can't be used for
+   * anything else. It's finished when it's exhausted or closed.
+   *
+   * \param f The Python function that should be applied to each argument.
+   *
+   * \param args The arguments as a Python iterable.
+   *
+   * \param chunksize The size of each task.
+   *
+   * \param max_in_flight The maximum number of tasks submitted but not yet
+   * collected. If 0, this is set to twice the number of workers.
+   *
+   * \throws std::runtime_error If this pool has been closed or is busy.
+   */
+  std::unique_ptr<imap_iterator> imap(const py::object &f,
+                                      const py::iterable &args,
+                                      uint chunksize = 1,
+                                      uint max_in_flight = 0);
+
+  /**
+   * \brief Like `imap()`, but results are yielded as soon as they are
+   * available, in arbitrary order.
+   */
+  std::unique_ptr<imap_iterator> imap_unordered(const py::object &f,
+                                                const py::iterable &args,
+                                                uint chunksize = 1,
+                                                uint max_in_flight = 0);
+
+  /**
+   * \brief Get the number of workers in this pool.
+   */
+  uint get_concurrency() { return concurrency; }
+
+  /**
+   * \brief Stop the workers and wait for them to terminate.
+   *
+   * Calling this more than once has no effect.
+   *
+   * \throws std::runtime_error If `waitpid()` failed.
+   */
+  void close();
+
+  /**
+   * \brief Release resources held by this pool. This will `close()` the pool
+   * first if needed.
+   */
+  void dispose();
+
+  /**
+   * \brief Run a worker spawned by the forkserver. See `forkserver_spawn()`.
+   * This never returns.
+   */
+  [[noreturn]] static void run_spawned(const char *header,
+                                       const py::object &payload,
+                                       const std::vector<int> &fds);
+
+private:
+  friend class imap_iterator;
+
+  /**
+   * \brief Ensure that this pool can take a new job.
+   *
+   * \throws std::runtime_error If this pool has been closed or is busy.
+   */
+  void check_available();
+
+  /**
+   * \brief Split `args` into tasks, run them, and collect the results in
+   * order.
+   */
+  std::vector<py::object> _map(const py::object &f, const py::iterable &args,
+                               uint chunksize, bool star);
+
+  /**
+   * \brief Send a task to worker `i`.
+   */
+  void send_task(uint i, const py::object &f, const py::list &args, bool star);
+
+  /**
+   * \brief Receive the result of the oldest task sent to worker `i`.
+   *
+   * \returns `true` if the task succeeded. The results are appended to
+   * `results`. Otherwise, `false` is returned, and the exception is
+   * stored in `error` unless some exception has already been stored.
+   */
+  bool receive_result(uint i, std::vector<py::object> &results,
+                      py::object &error);
+
+  /**
+   * \brief Receive the result of a task from any worker that has one.
+   *
+   * \param candidates The number of tasks each worker has in flight.
+   * \param worker Set to the worker the result came from.
+   *
+   * \returns See `receive_result()`.
+   */
+  bool receive_any_result(const std::vector<uint> &candidates, uint &worker,
+                          std::vector<py::object> &results,
+                          py::object &error);
+
+  /**
+   * \brief Parse a result sent by a worker. See `receive_result()`.
+   */
+  static bool unpack_result(const py::tuple &result,
+                            std::vector<py::object> &results,
+                            py::object &error);
+
+  /**
+   * \brief Rethrow an exception received from a worker.
+   */
+  [[noreturn]] static void rethrow(const py::object &error);
+
+  /**
+   * \brief Try to have the forkserver spawn worker `i`.
+   *
+   * \returns The pid of the worker, or 0 if it must be forked from this
+   * process instead.
+   */
+  pid_t spawn_from_forkserver(uint i);
+
+  /**
+   * \brief Serve tasks from the parent until told to stop.
+   */
+  [[noreturn]] void run(uint i);
+
+  /**
+   * \brief Serve tasks from `tasks` until told to stop, sending the results
+   * to `results` and posting `n_results` for each.
+   */
+  [[noreturn]] static void serve(channel &tasks, channel &results,
+                                 semaphore_t &n_results);
+
+  bool is_parent;
+  bool closed;
+  bool busy; // is an imap_iterator unfinished?
+  uint concurrency;
+  uint next_worker; // worker to receive the next task
+  std::vector<pid_t> child_pids;
+  std::vector<channel> task_channels;   // channels used to send tasks
+  std::vector<channel> result_channels; // channels used to send results
+  semaphore_t n_results; // number of results sent but not yet received
+};
+
+/**
+ * \brief The iterator returned by `pool::imap()` and
+ * `pool::imap_unordered()`.
+ *
+ * The iterator keeps the pool busy until it's exhausted or closed. If it's
+ * destroyed before that, it will be closed.
+ */
+class imap_iterator {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  imap_iterator() = delete;
+
+  /**
+   * \brief Destructor. This closes the iterator.
+   */
+  ~imap_iterator();
+
+  /**
+   * \brief No copy constructor.
+   */
+  imap_iterator(const imap_iterator &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  imap_iterator &operator=(const imap_iterator &t) = delete;
+
+  /**
+   * \brief No move constructor.
+   */
+  imap_iterator(imap_iterator &&t) = delete;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  imap_iterator &operator=(imap_iterator &&t) = delete;
+
+  /**
+   * \brief Create an iterator. See `pool::imap()`.
+   */
+  imap_iterator(pool &p, py::object f, const py::iterable &args,
+                uint chunksize, uint max_in_flight, bool ordered);
+
+  /**
+   * \brief Get the next result.
+   *
+   * \throws py::stop_iteration If there are no more results.
+   * \throws std::runtime_error If the pool has been closed.
+   * \throws e `next()` will rethrow any exception thrown by `f` or by
+   * iterating over `args`.
+   */
+  py::object next();
+
+  /**
+   * \brief Stop submitting tasks, and discard the results of the tasks in
+   * flight. After this, the pool can take new jobs again.
+   *
+   * Calling this more than once has no effect.
+   */
+  void close();
+
+private:
+  /**
+   * \brief Submit tasks until `max_in_flight` is reached or `args` runs out.
+   */
+  void submit();
+
+  pool &p;
+  py::object f;
+  py::iterator args;
+  uint chunksize;
+  uint max_in_flight;
+  bool ordered;
+  bool exhausted; // has args run out?
+  bool finished;  // has the pool been released?
+  size_t n_in_flight;
+  std::vector<uint> in_flight; // number of tasks in flight for each worker
+  std::deque<uint> task_workers; // worker of each task in flight, if ordered
+  std::deque<py::object> ready;  // results not yet yielded
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_POOL_H
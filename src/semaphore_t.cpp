@@ -1,9 +1,14 @@
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <thread>
 #include <stdexcept>
 
 #include <unistd.h>
 
 #include "semaphore_t.h"
+#include "shm_pool.h"
 #include "util.h"
 
 namespace snakefish {
@@ -23,7 +28,7 @@ semaphore_t::semaphore_t(unsigned int val) : name("/snakefish-") {
 }
 #else
 semaphore_t::semaphore_t(unsigned int val) {
-  sem = static_cast<sem_t *>(util::get_shared_mem(sizeof(sem_t), true));
+  sem = static_cast<sem_t *>(get_shared_slot(sizeof(sem_t)));
 
   if (sem_init(sem, 1, val)) {
     perror("sem_init() failed");
@@ -46,6 +51,81 @@ void semaphore_t::wait() {
   }
 }
 
+void semaphore_t::wait(const uint64_t spin_time) {
+  // spinning only makes sense if the poster can run at the same time
+  static const bool multicore = std::thread::hardware_concurrency() > 1;
+
+  if (spin_time > 0 && multicore) {
+    // only check the clock once in a while to keep the loop tight
+    const unsigned spins_per_check = 64;
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(spin_time);
+    do {
+      for (unsigned i = 0; i < spins_per_check; i++) {
+        if (trywait())
+          return;
+        util::cpu_relax();
+      }
+    } while (std::chrono::steady_clock::now() < deadline);
+  }
+
+  wait();
+}
+
+#ifdef __APPLE__
+bool semaphore_t::timedwait(const double timeout) {
+  if (!(timeout < util::max_timeout)) {
+    wait();
+    return true;
+  }
+
+  // macOS doesn't implement sem_timedwait(), so poll with a growing interval
+  auto deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(std::max(timeout, 0.0)));
+  auto interval = std::chrono::microseconds(10);
+  while (!trywait()) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline)
+      return false;
+    std::this_thread::sleep_for(std::min(
+        std::chrono::duration<double>(interval),
+        std::chrono::duration<double>(deadline - now)));
+    interval = std::min(interval * 2, std::chrono::microseconds(1000));
+  }
+  return true;
+}
+#else
+bool semaphore_t::timedwait(const double timeout) {
+  // a timeout this long (or inf/nan) would overflow the nanoseconds below
+  if (!(timeout < util::max_timeout)) {
+    wait();
+    return true;
+  }
+
+  // sem_timedwait() takes an absolute CLOCK_REALTIME time
+  struct timespec ts;
+  if (clock_gettime(CLOCK_REALTIME, &ts)) {
+    perror("clock_gettime() failed");
+    throw std::runtime_error("clock_gettime() failed");
+  }
+  auto ns = static_cast<long long>(std::max(timeout, 0.0) * 1e9);
+  ts.tv_sec += ns / 1000000000 + (ts.tv_nsec + ns % 1000000000) / 1000000000;
+  ts.tv_nsec = (ts.tv_nsec + ns % 1000000000) % 1000000000;
+
+  while (sem_timedwait(sem, &ts)) {
+    if (errno == ETIMEDOUT) {
+      return false;
+    } else if (errno != EINTR) {
+      perror("sem_timedwait() failed");
+      throw std::runtime_error("sem_timedwait() failed");
+    }
+  }
+  return true;
+}
+#endif
+
 bool semaphore_t::trywait() {
   if (sem_trywait(sem)) {
     if (errno == EAGAIN) {
@@ -58,6 +138,25 @@ bool semaphore_t::trywait() {
   return true;
 }
 
+#ifdef __APPLE__
+bool semaphore_t::peek() {
+  if (trywait()) {
+    post();
+    return true;
+  }
+  return false;
+}
+#else
+bool semaphore_t::peek() {
+  int val = 0;
+  if (sem_getvalue(sem, &val)) {
+    perror("sem_getvalue() failed");
+    throw std::runtime_error("sem_getvalue() failed");
+  }
+  return val > 0;
+}
+#endif
+
 #if __APPLE__
 void semaphore_t::destroy() {
   if (sem_close(sem)) {
@@ -75,10 +174,7 @@ void semaphore_t::destroy() {
     perror("sem_destroy() failed");
     throw std::runtime_error("sem_destroy() failed");
   }
-  if (munmap(sem, sizeof(sem_t))) {
-    perror("munmap() failed");
-    throw std::runtime_error("munmap() failed");
-  }
+  free_shared_slot(sem, sizeof(sem_t));
 }
 #endif
 
@@ -5,6 +5,7 @@
 #ifndef SNAKEFISH_SEMAPHORE_T_H
 #define SNAKEFISH_SEMAPHORE_T_H
 
+#include <cstdint>
 #include <string>
 
 #include <semaphore.h>
@@ -82,6 +83,31 @@ public:
    */
   void wait();
 
+  /**
+   * Decrement the semaphore, spinning for up to `spin_time` microseconds
+   * before going to sleep.
+   *
+   * Spinning avoids the wakeup latency of `sem_wait()` when the semaphore is
+   * expected to be incremented soon, at the cost of some CPU time. If
+   * `spin_time` is 0 or the system only has one CPU, this is the same as
+   * `wait()`.
+   *
+   * @throws std::runtime_error If `sem_trywait()` or `sem_wait()` failed.
+   */
+  void wait(uint64_t spin_time);
+
+  /**
+   * Decrement the semaphore, giving up after `timeout` seconds. A timeout of
+   * `util::max_timeout` or more (including `inf` and `nan`) is the same as
+   * `wait()`.
+   *
+   * @return `true` on success. `false` if the timeout expired first.
+   *
+   * @throws std::runtime_error If `sem_timedwait()` (or `sem_trywait()` on
+   * macOS) failed.
+   */
+  bool timedwait(double timeout);
+
   /**
    * Non-blocking version of `wait()`.
    *
@@ -91,6 +117,35 @@ public:
    */
   bool trywait();
 
+  /**
+   * Check whether `wait()` would currently succeed without blocking, without
+   * decrementing the semaphore.
+   *
+   * On macOS, where `sem_getvalue()` isn't implemented, this briefly
+   * decrements the semaphore and increments it again.
+   *
+   * @throws std::runtime_error If `sem_getvalue()` (or `sem_trywait()` and
+   * `sem_post()` on macOS) failed.
+   */
+  bool peek();
+
+  /**
+   * Get the underlying semaphore, e.g. to describe it to another process
+   * with `attach()`.
+   */
+  sem_t *get_handle() { return sem; }
+
+  /**
+   * Wrap a semaphore created by another `semaphore_t` and inherited through
+   * shared memory. The result must not be destroyed unless the original won't
+   * be.
+   */
+  static semaphore_t attach(sem_t *sem) {
+    semaphore_t s{attach_tag()};
+    s.sem = sem;
+    return s;
+  }
+
   /**
    * Destroy this semaphore and release resources.
    *
@@ -100,6 +155,16 @@ public:
   void destroy();
 
 private:
+  /**
+   * \brief Tag for the constructor used by `attach()`.
+   */
+  struct attach_tag {};
+
+  /**
+   * \brief Create a wrapper without a semaphore. See `attach()`.
+   */
+  explicit semaphore_t(attach_tag) : sem(nullptr) {}
+
   sem_t *sem;
 #ifdef __APPLE__
   std::string name;
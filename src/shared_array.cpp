@@ -0,0 +1,68 @@
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <utility>
+
+#include <sys/mman.h>
+
+#include "shared_array.h"
+#include "util.h"
+
+namespace snakefish {
+
+shared_array::shared_array(shared_array &&t) noexcept
+    : ptr(t.ptr), len(t.len), itemsize(t.itemsize), shape(std::move(t.shape)),
+      format(std::move(t.format)), disposed(t.disposed) {
+  t.ptr = nullptr;
+  t.disposed = true;
+}
+
+shared_array::shared_array(const std::vector<ssize_t> &shape,
+                           const size_t itemsize, const std::string &format)
+    : ptr(nullptr), len(itemsize), itemsize(itemsize), shape(shape),
+      format(format), disposed(false) {
+  if (itemsize == 0) {
+    throw std::runtime_error("itemsize must be positive");
+  }
+  for (ssize_t d : shape) {
+    if (d < 0) {
+      throw std::runtime_error("negative dimension");
+    }
+    len *= static_cast<size_t>(d);
+  }
+
+  // the pages of an anonymous mapping are zero-filled
+  ptr = util::get_shared_mem(len, true);
+}
+
+py::buffer_info shared_array::get_buffer_info() {
+  if (disposed) {
+    throw std::runtime_error("array has been disposed");
+  }
+
+  // C-contiguous strides
+  std::vector<ssize_t> strides(shape.size());
+  auto stride = static_cast<ssize_t>(itemsize);
+  for (size_t d = shape.size(); d-- > 0;) {
+    strides[d] = stride;
+    stride *= shape[d];
+  }
+  return py::buffer_info(ptr, static_cast<ssize_t>(itemsize), format,
+                         static_cast<ssize_t>(shape.size()), shape, strides,
+                         false);
+}
+
+void shared_array::dispose() {
+  if (disposed) {
+    return;
+  }
+  disposed = true;
+
+  if (ptr != nullptr && munmap(ptr, len)) {
+    perror("munmap() failed");
+    abort();
+  }
+  ptr = nullptr;
+}
+
+} // namespace snakefish
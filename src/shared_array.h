@@ -0,0 +1,127 @@
+/**
+ * \file shared_array.h
+ *
+ * \brief A writable array in shared memory.
+ */
+
+#ifndef SNAKEFISH_SHARED_ARRAY_H
+#define SNAKEFISH_SHARED_ARRAY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+namespace snakefish {
+
+/**
+ * \brief A writable, C-contiguous array in shared memory.
+ *
+ * The memory is mapped with `MAP_SHARED`, so processes forked after the array
+ * is created see the same memory as their parent: whatever a child writes is
+ * visible to the parent (and to the other children) without any copying. This
+ * is meant to be used with `parallel_for()`, where the workers share the input
+ * and output arrays and only receive the range of indices to work on.
+ *
+ * Accesses aren't synchronized, so processes should write to disjoint parts of
+ * the array.
+ */
+class shared_array {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  shared_array() = delete;
+
+  /**
+   * \brief No copy constructor.
+   */
+  shared_array(const shared_array &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  shared_array &operator=(const shared_array &t) = delete;
+
+  /**
+   * \brief Move constructor.
+   */
+  shared_array(shared_array &&t) noexcept;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  shared_array &operator=(shared_array &&t) = delete;
+
+  /**
+   * \brief Create a zero-initialized array.
+   *
+   * \param shape The shape of the array.
+   * \param itemsize The size (in bytes) of each element.
+   * \param format The `struct` format string of each element, e.g. `"d"`.
+   *
+   * \throws std::runtime_error If `shape` has a negative dimension or
+   * `itemsize` is 0.
+   * \throws std::bad_alloc If `mmap()` failed.
+   */
+  shared_array(const std::vector<ssize_t> &shape, size_t itemsize,
+               const std::string &format);
+
+  /**
+   * \brief Destructor. This doesn't free the memory. See `dispose()`.
+   */
+  ~shared_array() = default;
+
+  /**
+   * \brief Get a pointer to the start of the array.
+   */
+  void *get_ptr() { return ptr; }
+
+  /**
+   * \brief Get the length (in bytes) of the array.
+   */
+  size_t get_len() { return len; }
+
+  /**
+   * \brief Get the shape of the array.
+   */
+  std::vector<ssize_t> get_shape() { return shape; }
+
+  /**
+   * \brief Get the `struct` format string of each element.
+   */
+  std::string get_format() { return format; }
+
+  /**
+   * \brief Describe this array for Python's buffer protocol. The array is
+   * exposed as a writable, C-contiguous array.
+   *
+   * \throws std::runtime_error If the array has been disposed.
+   */
+  py::buffer_info get_buffer_info();
+
+  /**
+   * \brief Free the memory of this array. After this, the memory must not be
+   * accessed, so all views of the array must be released first.
+   *
+   * This should only be called by the process that created the array. It's
+   * a no-op if the array has already been disposed.
+   */
+  void dispose();
+
+private:
+  void *ptr;
+  size_t len;
+  size_t itemsize;
+  std::vector<ssize_t> shape;
+  std::string format;
+  bool disposed;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_SHARED_ARRAY_H
@@ -0,0 +1,436 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shm_pool.h"
+#include "util.h"
+
+namespace snakefish {
+
+/**
+ * \brief The forks of this process, which tell whether a buffer may still be
+ * used by a child.
+ */
+struct fork_state {
+  std::atomic_uint64_t generation{0}; // forks so far
+  std::atomic_uint64_t untracked{0};  // generation of the last other fork
+  std::atomic_long live{0};           // counted children not reaped yet
+};
+
+static fork_state forks;
+
+/**
+ * \brief Is the calling thread inside `fork_child()` or `fork_helper()`?
+ */
+static thread_local bool tracked_fork = false;
+
+static void on_fork_parent() {
+  uint64_t generation = forks.generation.fetch_add(1) + 1;
+  if (!tracked_fork)
+    forks.untracked.store(generation); // e.g. os.fork()
+}
+
+static void on_fork_child() { forks.live.store(0); }
+
+static const bool fork_handlers_registered =
+    pthread_atfork(nullptr, on_fork_parent, on_fork_child) == 0;
+
+/**
+ * \brief Check whether a process forked since `generation` could still be
+ * using a buffer created then.
+ */
+static bool is_shared_since(const uint64_t generation) {
+  if (forks.generation.load() == generation)
+    return false;
+  return !fork_handlers_registered || forks.untracked.load() > generation ||
+         forks.live.load() > 0;
+}
+
+static pid_t tracked(const bool counted) {
+  tracked_fork = true;
+  pid_t pid = fork();
+  tracked_fork = false;
+  if (pid > 0 && counted)
+    forks.live.fetch_add(1);
+  return pid;
+}
+
+pid_t fork_child() { return tracked(true); }
+
+pid_t fork_helper() { return tracked(false); }
+
+void note_spawned() { forks.live.fetch_add(1); }
+
+void note_reaped() { forks.live.fetch_sub(1); }
+
+/**
+ * \brief The control block at the start of the slab.
+ */
+struct slab_header {
+  // the low 32 bits are 1 + the index of the first free slot (0 means
+  // empty), and the high 32 bits are bumped on every change to avoid ABA
+  alignas(64) std::atomic_uint64_t free_head;
+  alignas(64) std::atomic_uint32_t next_fresh; // slots never handed out
+};
+
+/**
+ * \brief A shared slab of `SHARED_SLOTS` slots.
+ *
+ * The free slots form a lock-free stack. `next`, `owner` and `generation` are
+ * kept apart from the slots, so that the stack never reads memory that's in
+ * use.
+ */
+class slab {
+public:
+  slab() {
+    size_t len =
+        sizeof(slab_header) +
+        SHARED_SLOTS *
+            (sizeof(uint64_t) + sizeof(std::atomic_uint32_t) + sizeof(pid_t));
+    len = (len + SHARED_SLOT_SIZE - 1) / SHARED_SLOT_SIZE * SHARED_SLOT_SIZE;
+
+    mem = static_cast<char *>(
+        util::get_shared_mem(len + SHARED_SLOTS * SHARED_SLOT_SIZE, true));
+    header = reinterpret_cast<slab_header *>(mem);
+    generation = reinterpret_cast<uint64_t *>(mem + sizeof(slab_header));
+    next = reinterpret_cast<std::atomic_uint32_t *>(generation + SHARED_SLOTS);
+    owner = reinterpret_cast<pid_t *>(next + SHARED_SLOTS);
+    slots = mem + len;
+
+    header->free_head.store(0);
+    header->next_fresh.store(0);
+  }
+
+  void *get() {
+    uint32_t idx = 0;
+    if (!pop(idx))
+      return nullptr;
+
+    owner[idx] = getpid();
+    generation[idx] = forks.generation.load();
+    void *p = slots + static_cast<size_t>(idx) * SHARED_SLOT_SIZE;
+    memset(p, 0, SHARED_SLOT_SIZE);
+    return p;
+  }
+
+  bool contains(const void *p) {
+    return p >= slots && p < slots + SHARED_SLOTS * SHARED_SLOT_SIZE;
+  }
+
+  void free(void *p) {
+    auto idx = static_cast<uint32_t>((static_cast<char *>(p) - slots) /
+                                     SHARED_SLOT_SIZE);
+    if (owner[idx] != getpid())
+      return;
+
+    owner[idx] = 0;
+    if (is_shared_since(generation[idx]))
+      return; // a child may still use it, so it's never handed out again
+
+    uint64_t head = header->free_head.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+      next[idx].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+      new_head = (((head >> 32) + 1) << 32) | (idx + 1);
+    } while (!header->free_head.compare_exchange_weak(
+        head, new_head, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+private:
+  bool pop(uint32_t &idx) {
+    uint64_t head = header->free_head.load(std::memory_order_acquire);
+    while (static_cast<uint32_t>(head) != 0) {
+      idx = static_cast<uint32_t>(head) - 1;
+      uint64_t new_head = (((head >> 32) + 1) << 32) |
+                          next[idx].load(std::memory_order_relaxed);
+      if (header->free_head.compare_exchange_weak(head, new_head,
+                                                  std::memory_order_acquire))
+        return true;
+    }
+
+    // check first, so that the counter can't wrap around
+    if (header->next_fresh.load(std::memory_order_relaxed) >= SHARED_SLOTS)
+      return false;
+    idx = header->next_fresh.fetch_add(1, std::memory_order_relaxed);
+    return idx < SHARED_SLOTS;
+  }
+
+  char *mem;
+  slab_header *header;
+  uint64_t *generation; // see `fork_state`
+  std::atomic_uint32_t *next;
+  pid_t *owner;
+  char *slots;
+};
+
+/**
+ * \brief Get the slab of this process tree, creating it on first use.
+ *
+ * A child inherits the slab of its parent through `fork()`.
+ */
+static slab &get_slab() {
+  static slab s;
+  return s;
+}
+
+/**
+ * \brief A buffer owned by this process.
+ */
+struct owned_ring {
+  bool huge_pages;     // asked for huge pages?
+  bool huge;           // got them from MAP_HUGETLB?
+  uint64_t generation; // see `fork_state`
+};
+
+/**
+ * \brief Buffers owned by this process, and the free ones among them.
+ */
+struct ring_cache {
+  std::mutex mutex;
+  pid_t pid = 0;
+  std::unordered_map<void *, owned_ring> owned;
+  std::vector<std::tuple<void *, size_t, bool>> free;
+
+  /**
+   * \brief Forget buffers inherited from the parent, which still owns them.
+   * The caller must hold `mutex`.
+   */
+  void check_pid() {
+    pid_t self = getpid();
+    if (pid != self) {
+      pid = self;
+      owned.clear();
+      free.clear();
+    }
+  }
+};
+
+static ring_cache &get_ring_cache() {
+  static ring_cache c;
+  return c;
+}
+
+/**
+ * \brief The ring arena. See `reserve_ring_arena()`.
+ */
+struct ring_arena {
+  std::mutex mutex;
+  char *base = nullptr;
+  size_t len = 0;
+  std::atomic_size_t *used = nullptr; // shared, in the slab
+
+  bool contains(const void *p) {
+    return base != nullptr && p >= base && p < base + len;
+  }
+};
+
+/**
+ * \brief Buffers in the arena are aligned to this, so that they can use
+ * transparent huge pages.
+ */
+static const size_t ARENA_ALIGN = 2 * 1024 * 1024;
+
+static ring_arena &get_arena() {
+  static ring_arena a;
+  return a;
+}
+
+void reserve_ring_arena(const size_t len) {
+  ring_arena &a = get_arena();
+  std::lock_guard<std::mutex> guard(a.mutex);
+  if (a.base != nullptr)
+    return;
+
+  get_slab();
+  auto *used =
+      static_cast<std::atomic_size_t *>(get_shared_slot(sizeof(size_t)));
+  a.len = len / ARENA_ALIGN * ARENA_ALIGN;
+  a.base = static_cast<char *>(util::get_shared_mem(a.len, false));
+  a.used = used;
+
+  // drop the cached buffers, so that new channels come from the arena
+  ring_cache &c = get_ring_cache();
+  std::lock_guard<std::mutex> cache_guard(c.mutex);
+  c.check_pid();
+  for (auto &ring : c.free) {
+    c.owned.erase(std::get<0>(ring));
+    if (munmap(std::get<0>(ring), std::get<1>(ring))) {
+      perror("munmap() failed");
+      throw std::runtime_error("munmap() failed");
+    }
+  }
+  c.free.clear();
+}
+
+bool is_premapped(const void *p) {
+  return get_slab().contains(p) || get_arena().contains(p);
+}
+
+/**
+ * \brief Carve a buffer out of the arena.
+ *
+ * \returns The buffer, or `nullptr` if there's no arena or no room left.
+ */
+static void *get_arena_mem(const size_t len) {
+  ring_arena &a = get_arena();
+  if (a.base == nullptr)
+    return nullptr;
+
+  // check first, so that the counter can't wrap around
+  size_t n = (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (a.used->load(std::memory_order_relaxed) + n > a.len)
+    return nullptr;
+  size_t offset = a.used->fetch_add(n, std::memory_order_relaxed);
+  if (offset + n > a.len)
+    return nullptr;
+  return a.base + offset;
+}
+
+void *get_shared_slot(const size_t len) {
+  if (len <= SHARED_SLOT_SIZE) {
+    void *p = get_slab().get();
+    if (p != nullptr)
+      return p;
+  }
+  return util::get_shared_mem(len, true);
+}
+
+void free_shared_slot(void *p, const size_t len) {
+  if (p == nullptr)
+    return;
+
+  slab &s = get_slab();
+  if (s.contains(p)) {
+    s.free(p);
+  } else if (munmap(p, len)) {
+    perror("munmap() failed");
+    throw std::runtime_error("munmap() failed");
+  }
+}
+
+size_t get_huge_page_size() {
+  static const size_t size = []() {
+    // e.g. "Hugepagesize:       2048 kB"
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    size_t kb = 0;
+    while (meminfo >> key) {
+      if (key == "Hugepagesize:" && meminfo >> kb)
+        return kb * 1024;
+    }
+    return static_cast<size_t>(2 * 1024 * 1024);
+  }();
+  return size;
+}
+
+/**
+ * \brief Map a buffer backed by huge pages if possible.
+ *
+ * \param huge Set to whether `MAP_HUGETLB` succeeded.
+ */
+static void *get_huge_mem(const size_t len, bool &huge) {
+  huge = false;
+#ifdef MAP_HUGETLB
+  // reserved up front, so that running out of huge pages fails here instead
+  // of raising SIGBUS later
+  void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) {
+    huge = true;
+    return mem;
+  }
+#endif
+
+  void *p = util::get_shared_mem(len, false);
+#ifdef MADV_HUGEPAGE
+  // this is only an optimization, so failures are ignored
+  madvise(p, len, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+void *get_shared_ring(const size_t len, const bool huge_pages) {
+  ring_cache &c = get_ring_cache();
+  {
+    std::lock_guard<std::mutex> guard(c.mutex);
+    c.check_pid();
+    for (auto it = c.free.begin(); it != c.free.end(); it++) {
+      if (std::get<1>(*it) == len && std::get<2>(*it) == huge_pages) {
+        void *p = std::get<0>(*it);
+        c.free.erase(it);
+        return p;
+      }
+    }
+  }
+
+  if (len == 0)
+    return nullptr;
+
+  bool huge = false;
+  void *p = huge_pages ? get_huge_mem(len, huge) : get_arena_mem(len);
+  if (p == nullptr)
+    p = util::get_shared_mem(len, false);
+  std::lock_guard<std::mutex> guard(c.mutex);
+  c.owned[p] = {huge_pages, huge, forks.generation.load()};
+  return p;
+}
+
+void free_shared_ring(void *p, const size_t len) {
+  if (p == nullptr)
+    return;
+
+  ring_cache &c = get_ring_cache();
+  {
+    std::lock_guard<std::mutex> guard(c.mutex);
+    c.check_pid();
+    auto it = c.owned.find(p);
+    bool in_arena = get_arena().contains(p);
+    if (it != c.owned.end() && is_shared_since(it->second.generation)) {
+      // a child may still write to it, so it can't be reused or emptied
+      c.owned.erase(it);
+      if (in_arena)
+        return; // unmapping it would leave a hole in the arena
+      it = c.owned.end();
+    } else if (it != c.owned.end() &&
+               (c.free.size() < MAX_CACHED_RINGS || in_arena)) {
+#ifdef MADV_REMOVE
+      // keep the head warm, since a new channel starts writing there
+      // huge pages are reserved anyway, so they're kept whole
+      size_t resident =
+          (c.free.size() < MAX_CACHED_RINGS) ? CACHED_RING_RESIDENT : 0;
+      if (!it->second.huge && len > resident) {
+        // this is only an optimization, so failures are ignored
+        madvise(static_cast<char *>(p) + resident, len - resident,
+                MADV_REMOVE);
+      }
+#endif
+      c.free.emplace_back(p, len, it->second.huge_pages);
+      return;
+    }
+    if (in_arena) {
+      // inherited from the parent, which still owns it
+      return;
+    }
+    if (it != c.owned.end())
+      c.owned.erase(it);
+  }
+
+  if (munmap(p, len)) {
+    perror("munmap() failed");
+    throw std::runtime_error("munmap() failed");
+  }
+}
+
+} // namespace snakefish
@@ -0,0 +1,152 @@
+/**
+ * \file shm_pool.h
+ *
+ * \brief Pooled shared memory for metadata and channel buffers.
+ */
+
+#ifndef SNAKEFISH_SHM_POOL_H
+#define SNAKEFISH_SHM_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+
+namespace snakefish {
+
+/**
+ * \brief The size of a slot handed out by `get_shared_slot()`.
+ */
+const size_t SHARED_SLOT_SIZE = 64;
+
+/**
+ * \brief The number of slots in the slab behind `get_shared_slot()`.
+ */
+const uint32_t SHARED_SLOTS = 64 * 1024;
+
+/**
+ * \brief The maximum number of free buffers kept by `free_shared_ring()`.
+ */
+const size_t MAX_CACHED_RINGS = 16;
+
+/**
+ * \brief The number of bytes at the start of a cached buffer that are kept
+ * resident. The rest is given back to the OS.
+ */
+const size_t CACHED_RING_RESIDENT = 1024 * 1024; // 1 MiB
+
+/**
+ * \brief Get a zero-filled, cache-line-aligned block of shared memory for
+ * small metadata (atomics, `sem_t`s, flags).
+ *
+ * Blocks up to `SHARED_SLOT_SIZE` bytes come from a slab that is mapped
+ * once per process tree, and is shared with every process forked after the
+ * first call. Claiming and freeing a slot only takes a few atomic operations.
+ * Larger blocks, or blocks requested after the slab runs out, fall back to
+ * `util::get_shared_mem()`.
+ *
+ * \throws std::bad_alloc If `mmap()` failed.
+ */
+void *get_shared_slot(size_t len);
+
+/**
+ * \brief Free a block returned by `get_shared_slot()`.
+ *
+ * A slot is only returned to the slab by the process that claimed it. In any
+ * other process (e.g. a child that inherited the block), this is a no-op, so
+ * the slot can't be handed out again while its owner still uses it. Likewise,
+ * a slot is never handed out again if a process forked since it was claimed
+ * may still be running (see `free_shared_ring()`).
+ *
+ * \throws std::runtime_error If `munmap()` failed.
+ */
+void free_shared_slot(void *p, size_t len);
+
+/**
+ * \brief Map an arena of `len` bytes (with `MAP_NORESERVE`) that
+ * `get_shared_ring()` carves buffers out of from now on, and create the slab
+ * if it doesn't exist yet.
+ *
+ * Every process forked after this call sees the slab, the arena and all
+ * buffers later allocated from them at the same addresses as this process.
+ * This is used by the forkserver. It's a no-op if an arena already exists.
+ *
+ * \throws std::bad_alloc If `mmap()` failed.
+ */
+void reserve_ring_arena(size_t len);
+
+/**
+ * \brief Check whether `p` lives in the slab or the ring arena. See
+ * `reserve_ring_arena()`.
+ */
+bool is_premapped(const void *p);
+
+/**
+ * \brief Get the size of a huge page, as used by `MAP_HUGETLB`.
+ */
+size_t get_huge_page_size();
+
+/**
+ * \brief Get a `len`-byte shared buffer, reusing one freed by
+ * `free_shared_ring()` in this process if possible.
+ *
+ * Note that a recycled buffer isn't zero-filled.
+ *
+ * \param len Number of bytes. With `huge_pages`, this must be a multiple of
+ * `get_huge_page_size()`.
+ * \param huge_pages If `true`, try to back the buffer with huge pages
+ * reserved up front (`MAP_HUGETLB`). If not enough of them are available,
+ * fall back to a normal buffer with transparent huge pages requested
+ * (`MADV_HUGEPAGE`). Otherwise, the buffer is allocated with
+ * `MAP_NORESERVE`.
+ *
+ * \throws std::bad_alloc If `mmap()` failed.
+ */
+void *get_shared_ring(size_t len, bool huge_pages = false);
+
+/**
+ * \brief Free a buffer returned by `get_shared_ring()`.
+ *
+ * In the process that allocated it, the buffer is kept for reuse (up to
+ * `MAX_CACHED_RINGS` buffers), with all but its first `CACHED_RING_RESIDENT`
+ * bytes given back to the OS (unless it's made of huge pages). Otherwise, it's
+ * unmapped. Buffers carved out of the ring arena are always kept, since
+ * unmapping them would leave a hole in the arena.
+ *
+ * A buffer is only kept if no child could still be using it, i.e. if this
+ * process hasn't forked since the buffer was allocated, or if every child
+ * started since then by `fork_child()` (or reported by `note_spawned()`) has
+ * been reaped and no other `fork()` happened since. Otherwise, it's unmapped
+ * (or, in the ring arena, left alone), so that a child that still writes to
+ * its copy can't corrupt the next channel.
+ *
+ * \throws std::runtime_error If `munmap()` failed.
+ */
+void free_shared_ring(void *p, size_t len);
+
+/**
+ * \brief `fork()` a child that may use the buffers of this process. It's
+ * counted as live until `note_reaped()` is called. See `free_shared_ring()`.
+ */
+pid_t fork_child();
+
+/**
+ * \brief `fork()` a child that never touches the buffers of this process (e.g.
+ * the forkserver), and so isn't counted.
+ */
+pid_t fork_helper();
+
+/**
+ * \brief Count a child started some other way (i.e. by the forkserver) as
+ * live, like `fork_child()` does.
+ */
+void note_spawned();
+
+/**
+ * \brief Report that a child counted as live has been reaped.
+ */
+void note_reaped();
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_SHM_POOL_H
@@ -1,48 +1,399 @@
 #include "snakefish.h"
 
+/**
+ * \brief Convert an optional timeout (in seconds) from Python.
+ */
+static double get_timeout(const py::object &timeout) {
+  return timeout.is_none() ? snakefish::NO_TIMEOUT : timeout.cast<double>();
+}
+
+/**
+ * \brief Convert optional `affinity` and `numa_node` arguments from Python.
+ */
+static snakefish::placement get_placement(const py::object &affinity,
+                                          const int numa_node) {
+  std::vector<int> cpus;
+  if (!affinity.is_none())
+    cpus = affinity.cast<std::vector<int>>();
+  return snakefish::resolve_placement(cpus, numa_node);
+}
+
+/**
+ * \brief Create a thread or a generator placed according to `affinity` and
+ * `numa_node`.
+ */
+template <class T, class... Args>
+static T *make_placed(const py::object &affinity, const int numa_node,
+                      Args &&... args) {
+  snakefish::placement p = get_placement(affinity, numa_node);
+  auto *t = new T(std::forward<Args>(args)...);
+  t->set_placement(p);
+  return t;
+}
+
 PYBIND11_MODULE(snakefish, m) {
   py::class_<snakefish::thread>(m, "Thread")
-      .def(py::init<py::function>())
-      .def(py::init<py::function, py::function, py::function>())
+      .def(py::init([](py::function f, const py::object &affinity,
+                       int numa_node) {
+             return make_placed<snakefish::thread>(affinity, numa_node,
+                                                   std::move(f));
+           }),
+           py::arg("f"), py::arg("affinity") = py::none(),
+           py::arg("numa_node") = -1)
+      .def(py::init([](py::function f, py::function extract,
+                       py::function merge, const py::object &affinity,
+                       int numa_node) {
+             return make_placed<snakefish::thread>(
+                 affinity, numa_node, std::move(f), std::move(extract),
+                 std::move(merge));
+           }),
+           py::arg("f"), py::arg("extract"), py::arg("merge"),
+           py::arg("affinity") = py::none(), py::arg("numa_node") = -1)
       .def("start", &snakefish::thread::start)
-      .def("join", &snakefish::thread::join)
+      .def(
+          "join",
+          [](snakefish::thread &t, const py::object &timeout) {
+            if (timeout.is_none()) {
+              t.join();
+              return true;
+            }
+            return t.join(timeout.cast<double>());
+          },
+          py::arg("timeout") = py::none())
       .def("try_join", &snakefish::thread::try_join)
+      .def("join_async",
+           [](py::object self) {
+             return snakefish::join_async(self.cast<snakefish::thread &>(),
+                                          self);
+           })
       .def("is_alive", &snakefish::thread::is_alive)
       .def("get_exit_status", &snakefish::thread::get_exit_status)
       .def("get_result", &snakefish::thread::get_result)
+      .def("enable_stats", &snakefish::thread::enable_stats)
+      .def("stats", &snakefish::thread::stats)
       .def("dispose", &snakefish::thread::dispose);
 
   py::class_<snakefish::generator>(m, "Generator")
-      .def(py::init<py::function>())
-      .def(py::init<py::function, py::function, py::function>())
+      .def(py::init([](const py::function &f, uint prefetch,
+                       const py::object &affinity, int numa_node) {
+             return make_placed<snakefish::generator>(affinity, numa_node, f,
+                                                      prefetch);
+           }),
+           py::arg("f"), py::arg("prefetch") = 0,
+           py::arg("affinity") = py::none(), py::arg("numa_node") = -1)
+      .def(py::init([](const py::function &f, py::function extract,
+                       py::function merge, uint prefetch,
+                       const py::object &affinity, int numa_node) {
+             return make_placed<snakefish::generator>(
+                 affinity, numa_node, f, std::move(extract), std::move(merge),
+                 prefetch);
+           }),
+           py::arg("f"), py::arg("extract"), py::arg("merge"),
+           py::arg("prefetch") = 0, py::arg("affinity") = py::none(),
+           py::arg("numa_node") = -1)
       .def("start", &snakefish::generator::start)
-      .def("next", &snakefish::generator::next)
-      .def("join", &snakefish::generator::join)
+      .def(
+          "next",
+          [](snakefish::generator &g, bool block, const py::object &timeout) {
+            return g.next(block, get_timeout(timeout));
+          },
+          py::arg("block"), py::arg("timeout") = py::none())
+      .def(
+          "join",
+          [](snakefish::generator &g, const py::object &timeout) {
+            if (timeout.is_none()) {
+              g.join();
+              return true;
+            }
+            return g.join(timeout.cast<double>());
+          },
+          py::arg("timeout") = py::none())
       .def("try_join", &snakefish::generator::try_join)
+      .def("next_async",
+           [](py::object self) {
+             return snakefish::next_async(self.cast<snakefish::generator &>(),
+                                          self);
+           })
+      .def("__aiter__", [](py::object self) { return self; })
+      .def("__anext__",
+           [](py::object self) {
+             return snakefish::next_async(self.cast<snakefish::generator &>(),
+                                          self);
+           })
       .def("get_exit_status", &snakefish::generator::get_exit_status)
+      .def("set_spin_time", &snakefish::generator::set_spin_time)
+      .def("enable_stats", &snakefish::generator::enable_stats)
+      .def("stats", &snakefish::generator::stats)
       .def("dispose", &snakefish::generator::dispose);
 
+  py::class_<snakefish::message_view>(m, "MessageView", py::buffer_protocol())
+      .def_buffer(&snakefish::message_view::get_buffer_info)
+      .def("release", &snakefish::message_view::release)
+      .def("is_zero_copy", &snakefish::message_view::is_zero_copy);
+
   py::class_<snakefish::channel>(m, "Channel")
       .def(py::init<>())
       .def(py::init<size_t>())
-      .def("send_pyobj", &snakefish::channel::send_pyobj)
-      .def("receive_pyobj", &snakefish::channel::receive_pyobj)
+      .def(py::init<size_t, bool>(), py::arg("size"), py::arg("spsc"))
+      .def(py::init<size_t, bool, bool>(), py::arg("size"), py::arg("spsc"),
+           py::arg("out_of_band"))
+      .def(py::init<size_t, bool, bool, bool>(), py::arg("size"),
+           py::arg("spsc"), py::arg("out_of_band"), py::arg("huge_pages"))
+      .def_static("create", &snakefish::channel::create_named, py::arg("name"),
+                  py::arg("size") = snakefish::DEFAULT_CHANNEL_SIZE,
+                  py::arg("spsc") = false, py::arg("out_of_band") = false)
+      .def_static("open", &snakefish::channel::open_named, py::arg("name"))
+      .def_static("unlink", &snakefish::channel::unlink_named,
+                  py::arg("name"))
+      .def(
+          "send_pyobj",
+          [](snakefish::channel &c, const py::object &obj, bool block,
+             const py::object &timeout, bool stream) {
+            c.send_pyobj(obj, block, get_timeout(timeout), stream);
+          },
+          py::arg("obj"), py::arg("block") = false,
+          py::arg("timeout") = py::none(), py::arg("stream") = false)
+      .def(
+          "writer",
+          [](snakefish::channel &c, size_t size_hint, bool block,
+             const py::object &timeout) {
+            return new snakefish::channel_writer(c, size_hint, block,
+                                                 get_timeout(timeout));
+          },
+          py::arg("size_hint") = 0, py::arg("block") = false,
+          py::arg("timeout") = py::none(), py::keep_alive<0, 1>())
+      .def(
+          "receive_pyobj",
+          [](snakefish::channel &c, bool block, const py::object &timeout) {
+            return c.receive_pyobj(block, get_timeout(timeout));
+          },
+          py::arg("block"), py::arg("timeout") = py::none())
+      .def("receive_async",
+           [](py::object self) {
+             return snakefish::receive_async(
+                 self.cast<snakefish::channel &>(), self);
+           })
+      .def(
+          "send_pyobj_many",
+          [](snakefish::channel &c, const std::vector<py::object> &objs,
+             bool block, const py::object &timeout) {
+            c.send_pyobj_many(objs, block, get_timeout(timeout));
+          },
+          py::arg("objs"), py::arg("block") = false,
+          py::arg("timeout") = py::none())
+      .def(
+          "receive_pyobj_many",
+          [](snakefish::channel &c, size_t max_count, bool block,
+             const py::object &timeout) {
+            return c.receive_pyobj_many(max_count, block,
+                                        get_timeout(timeout));
+          },
+          py::arg("max_count"), py::arg("block"),
+          py::arg("timeout") = py::none())
+      .def(
+          "receive_view",
+          [](snakefish::channel &c, bool block, const py::object &timeout) {
+            // the memoryview keeps the message_view alive until it's released
+            py::object view = py::cast(
+                new snakefish::message_view(
+                    c.receive_view(block, get_timeout(timeout))),
+                py::return_value_policy::take_ownership);
+            return py::memoryview(view);
+          },
+          py::arg("block"), py::arg("timeout") = py::none())
+      .def("set_spin_time", &snakefish::channel::set_spin_time)
+      .def("get_spin_time", &snakefish::channel::get_spin_time)
+      .def("set_compact", &snakefish::channel::set_compact, py::arg("compact"))
+      .def("is_compact", &snakefish::channel::is_compact)
+      .def("enable_stats", &snakefish::channel::enable_stats)
+      .def("stats", &snakefish::channel::stats)
       .def("dispose", &snakefish::channel::dispose);
 
+  py::class_<snakefish::channel_writer>(m, "ChannelWriter")
+      .def("write", &snakefish::channel_writer::write, py::arg("b"))
+      .def("commit", &snakefish::channel_writer::commit)
+      .def("cancel", &snakefish::channel_writer::cancel)
+      .def("is_closed", &snakefish::channel_writer::is_closed)
+      .def("__enter__", [](py::object self) { return self; })
+      .def("__exit__",
+           [](snakefish::channel_writer &w, const py::object &exc_type,
+              const py::object &, const py::object &) {
+             if (exc_type.is_none() && !w.is_closed())
+               w.commit();
+             else
+               w.cancel();
+           });
+
+  py::class_<snakefish::mpmc_channel>(m, "MpmcChannel")
+      .def(py::init<>())
+      .def(py::init<size_t, size_t>(), py::arg("n_slots"),
+           py::arg("slot_size"))
+      .def(
+          "send_pyobj",
+          [](snakefish::mpmc_channel &c, const py::object &obj, bool block,
+             const py::object &timeout) {
+            c.send_pyobj(obj, block, get_timeout(timeout));
+          },
+          py::arg("obj"), py::arg("block") = false,
+          py::arg("timeout") = py::none())
+      .def(
+          "receive_pyobj",
+          [](snakefish::mpmc_channel &c, bool block,
+             const py::object &timeout) {
+            return c.receive_pyobj(block, get_timeout(timeout));
+          },
+          py::arg("block"), py::arg("timeout") = py::none())
+      .def("get_n_slots", &snakefish::mpmc_channel::get_n_slots)
+      .def("get_slot_size", &snakefish::mpmc_channel::get_slot_size)
+      .def("set_spin_time", &snakefish::mpmc_channel::set_spin_time)
+      .def("get_spin_time", &snakefish::mpmc_channel::get_spin_time)
+      .def("dispose", &snakefish::mpmc_channel::dispose);
+
+  py::class_<snakefish::object_view>(m, "ObjectView", py::buffer_protocol())
+      .def_buffer(&snakefish::object_view::get_buffer_info)
+      .def("release", &snakefish::object_view::release);
+
+  py::class_<snakefish::object_store>(m, "ObjectStore")
+      .def(py::init<>())
+      .def(py::init<size_t, uint32_t>(), py::arg("size"),
+           py::arg("max_objects"))
+      .def("put", &snakefish::object_store::put, py::arg("obj"))
+      .def(
+          "get",
+          [](snakefish::object_store &s, uint64_t handle) {
+            // the memoryview keeps the object_view alive until it's released
+            py::object view =
+                py::cast(new snakefish::object_view(s.get(handle)),
+                         py::return_value_policy::take_ownership);
+            return py::memoryview(view);
+          },
+          py::arg("handle"))
+      .def("retain", &snakefish::object_store::retain, py::arg("handle"))
+      .def("release", &snakefish::object_store::release, py::arg("handle"))
+      .def("get_capacity", &snakefish::object_store::get_capacity)
+      .def("get_used", &snakefish::object_store::get_used)
+      .def("dispose", &snakefish::object_store::dispose);
+
+  py::class_<snakefish::shared_array>(m, "SharedArray", py::buffer_protocol())
+      .def(py::init([](const py::object &shape, const std::string &format) {
+             std::vector<ssize_t> dims;
+             if (py::isinstance<py::int_>(shape)) {
+               dims.push_back(shape.cast<ssize_t>());
+             } else {
+               dims = shape.cast<std::vector<ssize_t>>();
+             }
+             auto itemsize = py::module::import("struct")
+                                 .attr("calcsize")(format)
+                                 .cast<size_t>();
+             return snakefish::shared_array(dims, itemsize, format);
+           }),
+           py::arg("shape"), py::arg("format") = "d")
+      .def_buffer(&snakefish::shared_array::get_buffer_info)
+      .def("get_shape", &snakefish::shared_array::get_shape)
+      .def("get_format", &snakefish::shared_array::get_format)
+      .def("get_len", &snakefish::shared_array::get_len)
+      .def("dispose", &snakefish::shared_array::dispose);
+
+  py::class_<snakefish::imap_iterator>(m, "ImapIterator")
+      .def("__iter__",
+           [](snakefish::imap_iterator &it) -> snakefish::imap_iterator & {
+             return it;
+           },
+           py::return_value_policy::reference_internal)
+      .def("__next__", &snakefish::imap_iterator::next)
+      .def("close", &snakefish::imap_iterator::close);
+
+  py::class_<snakefish::pool>(m, "Pool")
+      .def(py::init<>())
+      .def(py::init<uint>(), py::arg("concurrency"))
+      .def("map", &snakefish::pool::map, py::arg("f"), py::arg("args"),
+           py::arg("chunksize") = 0)
+      .def("starmap", &snakefish::pool::starmap, py::arg("f"), py::arg("args"),
+           py::arg("chunksize") = 0)
+      .def("apply", &snakefish::pool::apply, py::arg("f"),
+           py::arg("args") = py::tuple())
+      .def("imap", &snakefish::pool::imap, py::keep_alive<0, 1>(),
+           py::arg("f"), py::arg("args"), py::arg("chunksize") = 1,
+           py::arg("max_in_flight") = 0)
+      .def("imap_unordered", &snakefish::pool::imap_unordered,
+           py::keep_alive<0, 1>(), py::arg("f"), py::arg("args"),
+           py::arg("chunksize") = 1, py::arg("max_in_flight") = 0)
+      .def("get_concurrency", &snakefish::pool::get_concurrency)
+      .def("close", &snakefish::pool::close)
+      .def("dispose", &snakefish::pool::dispose);
+
+  py::class_<snakefish::globals_delta>(m, "GlobalsDelta")
+      .def(py::init<>())
+      .def(py::init<const py::object &>(), py::arg("names"))
+      .def("snapshot", &snakefish::globals_delta::snapshot, py::arg("globals"))
+      .def("extract", &snakefish::globals_delta::extract, py::arg("globals"))
+      .def("merge", &snakefish::globals_delta::merge, py::arg("globals"),
+           py::arg("delta"))
+      .def("get_n_tracked", &snakefish::globals_delta::get_n_tracked);
+
   m.def("get_timestamp", &snakefish::get_timestamp);
   m.def("get_timestamp_serialized", &snakefish::get_timestamp_serialized);
 
   m.def("map", &snakefish::map, py::arg("f"), py::arg("args"),
-        py::arg("concurrency") = 0, py::arg("chunksize") = 0);
+        py::arg("concurrency") = 0, py::arg("chunksize") = 0,
+        py::arg("dynamic") = false, py::arg("affinity") = py::none(),
+        py::arg("numa_node") = -1);
   m.def("map", &snakefish::map_merge, py::arg("f"), py::arg("args"),
         py::arg("extract"), py::arg("merge"), py::arg("concurrency") = 0,
-        py::arg("chunksize") = 0);
+        py::arg("chunksize") = 0, py::arg("dynamic") = false,
+        py::arg("affinity") = py::none(), py::arg("numa_node") = -1);
 
   m.def("starmap", &snakefish::starmap, py::arg("f"), py::arg("args"),
-        py::arg("concurrency") = 0, py::arg("chunksize") = 0);
+        py::arg("concurrency") = 0, py::arg("chunksize") = 0,
+        py::arg("dynamic") = false, py::arg("affinity") = py::none(),
+        py::arg("numa_node") = -1);
   m.def("starmap", &snakefish::starmap_merge, py::arg("f"), py::arg("args"),
         py::arg("extract"), py::arg("merge"), py::arg("concurrency") = 0,
-        py::arg("chunksize") = 0);
+        py::arg("chunksize") = 0, py::arg("dynamic") = false,
+        py::arg("affinity") = py::none(), py::arg("numa_node") = -1);
+
+  m.def("map_reduce", &snakefish::map_reduce, py::arg("f"),
+        py::arg("combine"), py::arg("args"), py::arg("concurrency") = 0);
+  m.def("map_reduce", &snakefish::map_reduce_initial, py::arg("f"),
+        py::arg("combine"), py::arg("args"), py::arg("initial"),
+        py::arg("concurrency") = 0);
+
+  m.def("reduce", &snakefish::reduce, py::arg("combine"), py::arg("args"),
+        py::arg("concurrency") = 0);
+  m.def("reduce", &snakefish::reduce_initial, py::arg("combine"),
+        py::arg("args"), py::arg("initial"), py::arg("concurrency") = 0);
+
+  m.def("parallel_for", &snakefish::parallel_for, py::arg("f"), py::arg("n"),
+        py::arg("chunksize") = 0, py::arg("concurrency") = 0,
+        py::arg("affinity") = py::none(), py::arg("numa_node") = -1);
+
+  m.def(
+      "wait",
+      [](const py::list &objs, const py::object &timeout) {
+        std::vector<snakefish::wait_target> targets;
+        for (auto obj : objs) {
+          if (py::isinstance<snakefish::channel>(obj))
+            targets.emplace_back(obj.cast<snakefish::channel *>());
+          else if (py::isinstance<snakefish::thread>(obj))
+            targets.emplace_back(obj.cast<snakefish::thread *>());
+          else if (py::isinstance<snakefish::generator>(obj))
+            targets.emplace_back(obj.cast<snakefish::generator *>());
+          else
+            throw py::type_error(
+                "wait() only accepts Channel, Thread, and Generator objects");
+        }
+
+        py::list ready;
+        for (size_t i : snakefish::wait(targets, get_timeout(timeout)))
+          ready.append(objs[i]);
+        return ready;
+      },
+      py::arg("objs"), py::arg("timeout") = py::none());
+
+  m.def("start_forkserver", &snakefish::start_forkserver,
+        py::arg("gc_freeze") = false);
+  m.def("stop_forkserver", &snakefish::stop_forkserver);
+  m.def("is_forkserver_running", &snakefish::is_forkserver_running);
 
   py::register_exception<std::runtime_error>(m, "RuntimeError");
 }
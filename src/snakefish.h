@@ -1,9 +1,19 @@
 #ifndef SNAKEFISH_H
 #define SNAKEFISH_H
 
+#include "affinity.h"
+#include "async.h"
 #include "channel.h"
+#include "compact.h"
+#include "forkserver.h"
 #include "generator.h"
+#include "globals_delta.h"
 #include "misc.h"
+#include "mpmc_channel.h"
+#include "object_store.h"
+#include "pool.h"
+#include "shared_array.h"
 #include "thread.h"
+#include "wait.h"
 
 #endif // SNAKEFISH_H
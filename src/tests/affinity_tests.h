@@ -0,0 +1,80 @@
+#ifndef SNAKEFISH_AFFINITY_TESTS_H
+#define SNAKEFISH_AFFINITY_TESTS_H
+
+#include <algorithm>
+#include <set>
+
+#include <gtest/gtest.h>
+
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "affinity.h"
+using namespace snakefish;
+
+TEST(AffinityTest, Topology) {
+  std::vector<int> spread = get_spread_cpus();
+  ASSERT_FALSE(spread.empty());
+  ASSERT_GE(get_physical_cores(), 1u);
+  ASSERT_LE(get_physical_cores(), spread.size());
+
+  // every CPU appears once
+  std::set<int> unique(spread.begin(), spread.end());
+  ASSERT_EQ(unique.size(), spread.size());
+
+  // the CPUs of the node of the first CPU include it
+  int node = get_cpu_node(spread[0]);
+  if (node >= 0) {
+    std::vector<int> cpus = get_node_cpus(node);
+    ASSERT_NE(std::find(cpus.begin(), cpus.end(), spread[0]), cpus.end());
+  }
+  try {
+    get_node_cpus(1 << 20);
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_EQ(std::string(e.what()),
+              "no CPU of NUMA node 1048576 is available");
+  }
+}
+
+TEST(AffinityTest, WorkerPlacement) {
+  std::vector<int> spread = get_spread_cpus();
+
+  // workers are handed out CPUs round-robin
+  for (unsigned i = 0; i < 2 * spread.size(); i++) {
+    placement p = get_worker_placement(i, {}, -1);
+    ASSERT_EQ(p.cpus.size(), 1u);
+    ASSERT_EQ(p.cpus[0], spread[i % spread.size()]);
+    ASSERT_EQ(p.numa_node, get_cpu_node(p.cpus[0]));
+  }
+  placement p = get_worker_placement(3, {spread[0]}, -1);
+  ASSERT_EQ(p.cpus, std::vector<int>{spread[0]});
+
+  try {
+    resolve_placement({-1}, -1);
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid CPU -1");
+  }
+}
+
+TEST(AffinityTest, SetAffinity) {
+  int cpu = get_spread_cpus().back();
+  pid_t pid = fork();
+  if (pid == 0) {
+    set_affinity({cpu});
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set))
+      std::exit(1);
+    std::exit((CPU_COUNT(&set) == 1 && CPU_ISSET(cpu, &set)) ? 0 : 1);
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+}
+
+#endif // SNAKEFISH_AFFINITY_TESTS_H
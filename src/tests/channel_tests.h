@@ -1,6 +1,10 @@
 #ifndef SNAKEFISH_CHANNEL_TESTS_H
 #define SNAKEFISH_CHANNEL_TESTS_H
 
+#include <chrono>
+#include <limits>
+#include <thread>
+
 #include <gtest/gtest.h>
 
 #include <pybind11/embed.h>
@@ -8,7 +12,9 @@
 namespace py = pybind11;
 
 #include "channel.h"
+#include "compact.h"
 #include "test_util.h"
+#include "wait.h"
 using namespace snakefish;
 
 static const size_t TEST_CAPACITY = 1024;
@@ -16,12 +22,16 @@ static const size_t TEST_CAPACITY = 1024;
 class channel_test : public channel {
 public:
   using channel::shared_mem;
+  using channel::control;
   using channel::lock;
   using channel::start;
   using channel::end;
   using channel::full;
   using channel::n_unread;
+  using channel::send_waiters;
+  using channel::recv_waiters;
   using channel::capacity;
+  using channel::counters;
   using channel::channel;
 };
 
@@ -314,6 +324,586 @@ TEST(ChannelTest, IpcReadWrite) {
   }
 }
 
+TEST(ChannelTest, NamedIpcReadWrite) {
+  std::string suffix = std::to_string(getpid());
+  for (const std::string &name :
+       {"snakefish-test-" + suffix, "/tmp/snakefish-test-" + suffix}) {
+    channel c = channel::create_named(name, TEST_CAPACITY, true, false);
+    ASSERT_THROW(channel::create_named(name, TEST_CAPACITY, true, false),
+                 std::runtime_error);
+
+    buffer bytes = get_random_bytes(TEST_CAPACITY / 2);
+    buffer copy = duplicate_bytes(bytes.get_ptr(), TEST_CAPACITY / 2);
+
+    pid_t result = fork();
+    if (result == 0) {
+      // child attaches by name, with a mapping of its own
+      channel sender = channel::open_named(name);
+      sender.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 2);
+      sender.dispose();
+      std::exit(0);
+    } else if (result > 0) {
+      buffer read_bytes = c.receive_bytes(true);
+      ASSERT_EQ(read_bytes.get_len(), TEST_CAPACITY / 2);
+      ASSERT_EQ(
+          memcmp(copy.get_ptr(), read_bytes.get_ptr(), TEST_CAPACITY / 2), 0);
+
+      int status = 0;
+      if (waitpid(result, &status, 0) == -1) {
+        perror("waitpid() failed");
+        abort();
+      }
+      ASSERT_EQ(WIFEXITED(status), 1);
+      ASSERT_EQ(WEXITSTATUS(status), 0);
+
+      channel::unlink_named(name);
+      ASSERT_THROW(channel::open_named(name), std::runtime_error);
+      c.dispose();
+    } else {
+      perror("fork() failed");
+      abort();
+    }
+  }
+}
+
+TEST(ChannelTest, SpscReadWrite) {
+  size_t capacity = TEST_CAPACITY + sizeof(size_t);
+  channel_test channel = channel_test(capacity, true);
+  ASSERT_NE(channel.shared_mem, nullptr);
+  ASSERT_EQ((channel.start)->load(), 0);
+  ASSERT_EQ((channel.end)->load(), 0);
+  ASSERT_EQ((channel.full)->load(), false);
+  ASSERT_EQ(channel.capacity, capacity);
+
+  // one byte is always kept unused
+  buffer bytes = get_random_bytes(TEST_CAPACITY);
+  try {
+    channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  ASSERT_EQ((channel.start)->load(), 0);
+  ASSERT_EQ((channel.end)->load(), 0);
+
+  buffer copy = duplicate_bytes(bytes.get_ptr(), TEST_CAPACITY - 1);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY - 1);
+  ASSERT_EQ((channel.start)->load(), 0);
+  ASSERT_EQ((channel.end)->load(), capacity - 1);
+  ASSERT_EQ((channel.full)->load(), false);
+
+  buffer read_bytes = channel.receive_bytes(true);
+  ASSERT_EQ(read_bytes.get_len(), TEST_CAPACITY - 1);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes.get_ptr(), TEST_CAPACITY - 1), 0);
+  ASSERT_EQ((channel.start)->load(), capacity - 1);
+  ASSERT_EQ((channel.end)->load(), capacity - 1);
+  ASSERT_EQ((channel.full)->load(), false);
+
+  // with wrapping
+  buffer bytes2 = get_random_bytes(TEST_CAPACITY / 2);
+  buffer copy2 = duplicate_bytes(bytes2.get_ptr(), TEST_CAPACITY / 2);
+  channel.send_bytes(bytes2.get_ptr(), TEST_CAPACITY / 2);
+  ASSERT_EQ((channel.end)->load(), TEST_CAPACITY / 2 + sizeof(size_t) - 1);
+
+  buffer read_bytes2 = channel.receive_bytes(true);
+  ASSERT_EQ(read_bytes2.get_len(), TEST_CAPACITY / 2);
+  ASSERT_EQ(memcmp(copy2.get_ptr(), read_bytes2.get_ptr(), TEST_CAPACITY / 2),
+            0);
+  ASSERT_EQ((channel.start)->load(), TEST_CAPACITY / 2 + sizeof(size_t) - 1);
+  ASSERT_EQ((channel.full)->load(), false);
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, ControlBlockLayout) {
+  channel_test channel = channel_test(TEST_CAPACITY, true);
+
+  // the sender's and the receiver's indices live on separate cache lines
+  auto line = [](const void *p) { return reinterpret_cast<uintptr_t>(p) / 64; };
+  ASSERT_NE(line(channel.start), line(channel.end));
+  ASSERT_NE(line(channel.start), line(channel.full));
+  ASSERT_NE(line(channel.end), line(channel.send_waiters));
+  ASSERT_NE(line(channel.send_waiters), line(channel.recv_waiters));
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(channel.shared_mem) % 4096, 0u);
+
+  // the copies of the other side's index are refreshed as needed
+  buffer bytes = get_random_bytes(TEST_CAPACITY / 2);
+  for (int i = 0; i < 8; i++) {
+    channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 2);
+    buffer read_bytes = channel.receive_bytes(false);
+    ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), TEST_CAPACITY / 2),
+              0);
+    ASSERT_EQ(channel.control->cached_end, channel.end->load());
+  }
+  channel.dispose();
+
+  // huge pages may not be available, so this may fall back to normal pages
+  channel_test huge = channel_test(TEST_CAPACITY, true, false, true);
+  huge.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 2);
+  buffer read_bytes = huge.receive_bytes(false);
+  ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), TEST_CAPACITY / 2),
+            0);
+  huge.dispose();
+}
+
+TEST(ChannelTest, SpscIpcReadWrite) {
+  const size_t n_messages = 100000;
+  channel_test channel = channel_test(TEST_CAPACITY, true);
+
+  pid_t result = fork();
+  if (result == 0) {
+    // child writes, retrying whenever the buffer is full
+    for (size_t i = 0; i < n_messages; i++) {
+      while (true) {
+        try {
+          channel.send_bytes(&i, sizeof(size_t));
+          break;
+        } catch (const std::overflow_error &e) {
+          continue;
+        }
+      }
+    }
+
+    std::exit(0);
+  } else if (result > 0) {
+    // parent reads concurrently
+    for (size_t i = 0; i < n_messages; i++) {
+      buffer read_bytes = channel.receive_bytes(true);
+      ASSERT_EQ(read_bytes.get_len(), sizeof(size_t));
+      ASSERT_EQ(*static_cast<size_t *>(read_bytes.get_ptr()), i);
+    }
+
+    // check child status
+    int status = 0;
+    if (waitpid(result, &status, 0) == -1) {
+      perror("waitpid() failed");
+      abort();
+    } else {
+      ASSERT_EQ(WIFEXITED(status), 1);
+      ASSERT_EQ(WEXITSTATUS(status), 0);
+    }
+    ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+
+    // release resources
+    channel.dispose();
+  } else {
+    perror("fork() failed");
+    abort();
+  }
+}
+
+TEST(ChannelTest, SpinIpcReadWrite) {
+  const size_t n_messages = 1000;
+  channel_test request = channel_test(TEST_CAPACITY, true);
+  channel_test response = channel_test(TEST_CAPACITY, true);
+  request.set_spin_time(1000);
+  response.set_spin_time(1000);
+  ASSERT_EQ(request.get_spin_time(), 1000);
+
+  pid_t result = fork();
+  if (result == 0) {
+    // child echoes back whatever it receives
+    for (size_t i = 0; i < n_messages; i++) {
+      buffer read_bytes = request.receive_bytes(true);
+      response.send_bytes(read_bytes.get_ptr(), read_bytes.get_len());
+    }
+
+    std::exit(0);
+  } else if (result > 0) {
+    // parent does request/response round trips
+    for (size_t i = 0; i < n_messages; i++) {
+      request.send_bytes(&i, sizeof(size_t));
+      buffer read_bytes = response.receive_bytes(true);
+      ASSERT_EQ(read_bytes.get_len(), sizeof(size_t));
+      ASSERT_EQ(*static_cast<size_t *>(read_bytes.get_ptr()), i);
+    }
+
+    // check child status
+    int status = 0;
+    if (waitpid(result, &status, 0) == -1) {
+      perror("waitpid() failed");
+      abort();
+    } else {
+      ASSERT_EQ(WIFEXITED(status), 1);
+      ASSERT_EQ(WEXITSTATUS(status), 0);
+    }
+
+    // release resources
+    request.dispose();
+    response.dispose();
+  } else {
+    perror("fork() failed");
+    abort();
+  }
+}
+
+TEST(ChannelTest, ReceiveView) {
+  size_t capacity = TEST_CAPACITY + 2 * sizeof(size_t);
+  channel_test channel = channel_test(capacity, true);
+
+  buffer bytes = get_random_bytes(TEST_CAPACITY / 4);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  size_t msg_size = TEST_CAPACITY / 4 + sizeof(size_t);
+  ASSERT_EQ((channel.end)->load(), 2 * msg_size);
+
+  // views point into the shared buffer, and space isn't freed yet
+  message_view view1 = channel.receive_view(true);
+  message_view view2 = channel.receive_view(true);
+  ASSERT_TRUE(view1.is_zero_copy());
+  ASSERT_TRUE(view2.is_zero_copy());
+  ASSERT_EQ(view1.get_len(), TEST_CAPACITY / 4);
+  ASSERT_EQ(view1.get_ptr(),
+            static_cast<char *>(channel.shared_mem) + sizeof(size_t));
+  ASSERT_EQ(memcmp(copy.get_ptr(), view1.get_ptr(), TEST_CAPACITY / 4), 0);
+  ASSERT_EQ(memcmp(copy.get_ptr(), view2.get_ptr(), TEST_CAPACITY / 4), 0);
+  ASSERT_EQ((channel.start)->load(), 0);
+
+  // space is freed in order
+  view2.release();
+  ASSERT_EQ((channel.start)->load(), 0);
+  view1.release();
+  ASSERT_EQ((channel.start)->load(), 2 * msg_size);
+  ASSERT_EQ(view1.get_ptr(), nullptr);
+  ASSERT_EQ(view1.get_len(), 0);
+
+  // copied messages received while a view is held are freed after it
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  {
+    message_view view3 = channel.receive_view(true);
+    ASSERT_TRUE(view3.is_zero_copy());
+    buffer read_bytes = channel.receive_bytes(true);
+    ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes.get_ptr(), TEST_CAPACITY / 4),
+              0);
+    ASSERT_EQ((channel.start)->load(), 2 * msg_size);
+  }
+  ASSERT_EQ((channel.start)->load(), (4 * msg_size) % capacity);
+
+  // a wrapped message is copied
+  size_t head = (channel.start)->load();
+  buffer wrapped = get_random_bytes(capacity - head);
+  channel.send_bytes(wrapped.get_ptr(), wrapped.get_len());
+  message_view view4 = channel.receive_view(true);
+  ASSERT_FALSE(view4.is_zero_copy());
+  ASSERT_EQ(view4.get_len(), wrapped.get_len());
+  ASSERT_EQ(memcmp(wrapped.get_ptr(), view4.get_ptr(), wrapped.get_len()), 0);
+  ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, ReserveCommit) {
+  for (bool spsc : {false, true}) {
+    size_t capacity = TEST_CAPACITY + sizeof(size_t) + (spsc ? 1 : 0);
+    channel_test channel = channel_test(capacity, spsc);
+    buffer bytes = get_random_bytes(TEST_CAPACITY);
+    const char *data = static_cast<const char *>(bytes.get_ptr());
+
+    // nothing is visible until the message is committed
+    channel.reserve(16);
+    ASSERT_THROW(channel.reserve(16), std::runtime_error);
+    channel.write_reserved(data, 8);
+    channel.write_reserved(data + 8, 8);
+    ASSERT_EQ((channel.end)->load(), 0);
+    ASSERT_THROW(channel.receive_bytes(false), std::out_of_range);
+    channel.commit();
+    ASSERT_EQ((channel.end)->load(), sizeof(size_t) + 16);
+    buffer read_bytes = channel.receive_bytes(true);
+    ASSERT_EQ(read_bytes.get_len(), 16);
+    ASSERT_EQ(memcmp(data, read_bytes.get_ptr(), 16), 0);
+
+    // cancelled messages leave no trace
+    channel.reserve(0);
+    channel.write_reserved(data, 32);
+    channel.cancel_reserved();
+    ASSERT_THROW(channel.commit(), std::runtime_error);
+    ASSERT_EQ((channel.end)->load(), sizeof(size_t) + 16);
+
+    // a message filling the buffer exactly wraps around and fills it
+    channel.reserve(TEST_CAPACITY);
+    channel.write_reserved(data, TEST_CAPACITY);
+    channel.commit();
+    size_t unused = spsc ? 1 : 0;
+    ASSERT_EQ((channel.start)->load(),
+              ((channel.end)->load() + unused) % capacity);
+    if (!spsc) {
+      ASSERT_EQ((channel.full)->load(), true);
+    }
+    try {
+      channel.send_bytes(bytes.get_ptr(), 1);
+      FAIL();
+    } catch (const std::overflow_error &e) {
+      ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+    }
+    buffer read_bytes2 = channel.receive_bytes(true);
+    ASSERT_EQ(read_bytes2.get_len(), TEST_CAPACITY);
+    ASSERT_EQ(memcmp(data, read_bytes2.get_ptr(), TEST_CAPACITY), 0);
+
+    // a message outgrowing the free space is moved to the heap, and sent
+    // once the receiver has made room for it
+    channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 2);
+    channel.reserve(8);
+    channel.write_reserved(data, TEST_CAPACITY / 4);
+    channel.write_reserved(data + TEST_CAPACITY / 4, TEST_CAPACITY / 2);
+    buffer read_bytes3 = channel.receive_bytes(true);
+    ASSERT_EQ(read_bytes3.get_len(), TEST_CAPACITY / 2);
+    channel.commit();
+    buffer read_bytes4 = channel.receive_bytes(true);
+    ASSERT_EQ(read_bytes4.get_len(), TEST_CAPACITY / 4 * 3);
+    ASSERT_EQ(memcmp(data, read_bytes4.get_ptr(), TEST_CAPACITY / 4 * 3), 0);
+    ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+
+    channel.dispose();
+  }
+}
+
+TEST(ChannelTest, BatchReadWrite) {
+  for (bool spsc : {false, true}) {
+    channel_test channel = channel_test(TEST_CAPACITY, spsc);
+
+    // 10 messages of increasing length, with an empty one to be skipped
+    buffer bytes = get_random_bytes(TEST_CAPACITY / 8);
+    buffer copy = duplicate_bytes(bytes.get_ptr(), TEST_CAPACITY / 8);
+    std::vector<message_t> messages;
+    size_t total = 0;
+    for (size_t i = 0; i <= 10; i++) {
+      messages.emplace_back(bytes.get_ptr(), i * 8);
+      total += (i > 0) ? sizeof(size_t) + i * 8 : 0;
+    }
+    channel.send_bytes_many(messages);
+    ASSERT_EQ((channel.end)->load(), total);
+
+    // a batch that doesn't fit is not sent at all
+    std::vector<message_t> too_large(2, message_t(bytes.get_ptr(),
+                                                  TEST_CAPACITY / 2));
+    try {
+      channel.send_bytes_many(too_large);
+      FAIL();
+    } catch (const std::overflow_error &e) {
+      ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+    }
+    ASSERT_EQ((channel.end)->load(), total);
+
+    // drain in batches of up to 4
+    std::vector<buffer> received;
+    for (size_t expected : {4, 4, 2}) {
+      std::vector<buffer> bufs = channel.receive_bytes_many(4, false);
+      ASSERT_EQ(bufs.size(), expected);
+      std::move(bufs.begin(), bufs.end(), std::back_inserter(received));
+    }
+    ASSERT_EQ((channel.start)->load(), total);
+    for (size_t i = 0; i < 10; i++) {
+      ASSERT_EQ(received[i].get_len(), (i + 1) * 8);
+      ASSERT_EQ(memcmp(copy.get_ptr(), received[i].get_ptr(), (i + 1) * 8), 0);
+    }
+
+    try {
+      channel.receive_bytes_many(4, false);
+      FAIL();
+    } catch (const std::out_of_range &e) {
+      ASSERT_EQ(std::string(e.what()), "out-of-bounds read detected");
+    }
+    ASSERT_TRUE(channel.receive_bytes_many(0, false).empty());
+
+    channel.dispose();
+  }
+}
+
+TEST(ChannelTest, BlockingWrite) {
+  for (bool spsc : {false, true}) {
+    size_t capacity = TEST_CAPACITY + sizeof(size_t) + 1;
+    channel_test channel = channel_test(capacity, spsc);
+    buffer bytes = get_random_bytes(TEST_CAPACITY);
+
+    // larger than the whole buffer, so blocking wouldn't help
+    try {
+      channel.send_bytes(bytes.get_ptr(), capacity, true);
+      FAIL();
+    } catch (const std::overflow_error &e) {
+      ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+    }
+
+    // the buffer is full, and nobody frees it up
+    channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY);
+    auto t0 = std::chrono::steady_clock::now();
+    try {
+      channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY, true, 0.05);
+      FAIL();
+    } catch (const std::overflow_error &e) {
+      ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+    }
+    ASSERT_GE(std::chrono::steady_clock::now() - t0,
+              std::chrono::milliseconds(50));
+
+    // each send waits for the receiver (in another process) to catch up
+    pid_t pid = fork();
+    if (pid == 0) {
+      for (int i = 0; i < 100; i++) {
+        buffer buf = channel.receive_bytes(true);
+        if (buf.get_len() != TEST_CAPACITY) {
+          std::exit(1);
+        }
+      }
+      std::exit(0);
+    }
+    for (int i = 0; i < 99; i++) {
+      channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY, true);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    ASSERT_EQ(channel.send_waiters->load(), 0);
+
+    channel.dispose();
+  }
+}
+
+TEST(ChannelTest, ReceiveTimeout) {
+  for (bool spsc : {false, true}) {
+    channel_test channel = channel_test(TEST_CAPACITY, spsc);
+    buffer bytes = get_random_bytes(TEST_CAPACITY / 4);
+
+    // nothing to receive
+    auto t0 = std::chrono::steady_clock::now();
+    try {
+      channel.receive_bytes(true, 0.05);
+      FAIL();
+    } catch (const std::out_of_range &e) {
+      ASSERT_EQ(std::string(e.what()), "receive timed out");
+    }
+    ASSERT_GE(std::chrono::steady_clock::now() - t0,
+              std::chrono::milliseconds(50));
+
+    // a message that arrives before the timeout
+    pid_t pid = fork();
+    if (pid == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+      std::exit(0);
+    }
+    buffer buf = channel.receive_bytes(true, 10);
+    ASSERT_EQ(buf.get_len(), TEST_CAPACITY / 4);
+    ASSERT_EQ(memcmp(buf.get_ptr(), bytes.get_ptr(), TEST_CAPACITY / 4), 0);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+
+    channel.dispose();
+  }
+}
+
+TEST(ChannelTest, HugeTimeout) {
+  // timeouts too long to represent are the same as no timeout
+  for (double timeout : {std::numeric_limits<double>::infinity(), 1e300, 1e12,
+                         std::numeric_limits<double>::quiet_NaN()}) {
+    channel_test channel = channel_test(TEST_CAPACITY, true);
+    std::vector<wait_target> targets = {wait_target(&channel)};
+    buffer bytes = get_random_bytes(TEST_CAPACITY / 4);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4, true, timeout);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4, true, timeout);
+      std::exit(0);
+    }
+    ASSERT_EQ(snakefish::wait(targets, timeout), std::vector<size_t>{0});
+    buffer buf = channel.receive_bytes(true, timeout);
+    ASSERT_EQ(buf.get_len(), TEST_CAPACITY / 4);
+    buffer buf2 = channel.receive_bytes(true, timeout);
+    ASSERT_EQ(memcmp(buf2.get_ptr(), bytes.get_ptr(), TEST_CAPACITY / 4), 0);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    channel.dispose();
+  }
+}
+
+TEST(ChannelTest, Wait) {
+  channel_test c0 = channel_test(TEST_CAPACITY);
+  channel_test c1 = channel_test(TEST_CAPACITY, true);
+  std::vector<wait_target> targets = {wait_target(&c0), wait_target(&c1)};
+  buffer bytes = get_random_bytes(TEST_CAPACITY / 4);
+
+  // nothing is ready
+  auto t0 = std::chrono::steady_clock::now();
+  ASSERT_TRUE(snakefish::wait(targets, 0.05).empty());
+  ASSERT_GE(std::chrono::steady_clock::now() - t0,
+            std::chrono::milliseconds(50));
+  ASSERT_EQ(c0.recv_waiters->load(), 0);
+
+  // a message sent while waiting
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    c1.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+    std::exit(0);
+  }
+  ASSERT_EQ(snakefish::wait(targets, NO_TIMEOUT), std::vector<size_t>{1});
+  int status = 0;
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+
+  // readiness is checked without receiving
+  c0.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  ASSERT_EQ(snakefish::wait(targets, 0), (std::vector<size_t>{0, 1}));
+  c0.receive_bytes(false);
+  c1.receive_bytes(false);
+  ASSERT_TRUE(snakefish::wait(targets, 0).empty());
+
+  c0.dispose();
+  c1.dispose();
+}
+
+TEST(ChannelTest, Stats) {
+  channel_test channel = channel_test(TEST_CAPACITY);
+  ASSERT_EQ(channel.counters, nullptr);
+  channel.enable_stats();
+  ASSERT_NE(channel.counters, nullptr);
+
+  buffer bytes = get_random_bytes(TEST_CAPACITY / 4);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  try {
+    channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 2);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+  }
+  ASSERT_EQ(channel.counters->messages_sent, 2);
+  ASSERT_EQ(channel.counters->bytes_sent, TEST_CAPACITY / 2);
+  ASSERT_EQ(channel.counters->peak_occupancy,
+            TEST_CAPACITY / 2 + 2 * sizeof(size_t));
+  ASSERT_EQ(channel.counters->overflows, 1);
+
+  channel.receive_bytes(true);
+  channel.receive_bytes(true);
+  ASSERT_EQ(channel.counters->messages_received, 2);
+  ASSERT_EQ(channel.counters->bytes_received, TEST_CAPACITY / 2);
+  ASSERT_EQ(channel.counters->blocked_receives, 0);
+  ASSERT_EQ(channel.counters->lock_acquisitions, 5);
+  ASSERT_EQ(channel.counters->lock_contentions, 0);
+
+  // a blocking receive that has to wait
+  pid_t pid = fork();
+  if (pid == 0) {
+    usleep(10000);
+    channel.send_bytes(bytes.get_ptr(), 1);
+    std::exit(0);
+  }
+  channel.receive_bytes(true);
+  waitpid(pid, nullptr, 0);
+  ASSERT_EQ(channel.counters->blocked_receives, 1);
+  ASSERT_GT(channel.counters->blocked_receive_time, 0);
+
+  channel.dispose();
+}
+
 TEST(ChannelTest, TransferSmallObj) {
   channel_test channel;
 
@@ -337,6 +927,93 @@ TEST(ChannelTest, TransferLargeObj) {
   channel.dispose();
 }
 
+TEST(ChannelTest, TransferStreamedObj) {
+  for (bool spsc : {false, true}) {
+    channel_test channel = channel_test(DEFAULT_CHANNEL_SIZE, spsc);
+
+    // large enough for several pickle frames, and for direct writes of bytes
+    py::object i1 = py::eval("([i for i in range(100000)], b'x' * 1000000)");
+    channel.send_pyobj(i1, false, NO_TIMEOUT, true);
+    py::object i2 = channel.receive_pyobj(true);
+    ASSERT_EQ(i2.equal(i1), true);
+
+    // a failed pickle leaves nothing behind
+    py::object lambda = py::eval("lambda: None");
+    ASSERT_THROW(channel.send_pyobj(lambda, false, NO_TIMEOUT, true),
+                 py::error_already_set);
+    ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+    channel.send_pyobj(i1, false, NO_TIMEOUT, true);
+    ASSERT_EQ(channel.receive_pyobj(true).equal(i1), true);
+
+    channel.dispose();
+  }
+}
+
+TEST(ChannelTest, TransferOutOfBand) {
+  channel_test channel = channel_test(DEFAULT_CHANNEL_SIZE, true, true);
+
+  // small buffers are pickled in-band
+  py::object i1 = py::eval("[i for i in range(10000)]");
+  channel.send_pyobj(i1);
+  py::object i2 = channel.receive_pyobj(true);
+  ASSERT_EQ(i2.equal(i1), true);
+  ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+
+  // large buffers are received as zero-copy views
+  py::object data = py::eval("bytes(range(256)) * 1024");
+  py::object pickle_buffer =
+      py::module::import("pickle").attr("PickleBuffer")(data);
+  channel.send_pyobj(pickle_buffer);
+  py::object view = channel.receive_pyobj(true);
+  ASSERT_EQ(py::isinstance<py::memoryview>(view), true);
+  ASSERT_EQ(py::bytes(view).equal(data), true);
+  ASSERT_NE((channel.start)->load(), (channel.end)->load());
+
+  view.attr("release")();
+  ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, TransferCompact) {
+  py::object small = py::eval("(None, True, -7, 2.5, 'snake\u00e9', b'fish')");
+  py::object big = py::eval("2 ** 64");
+  py::object other = py::eval("[1, 2, 3]");
+
+  // supported objects skip pickle, the rest fall back to it
+  for (const py::object &obj : {small, big, other}) {
+    channel_test channel;
+    channel.set_compact(true);
+    channel.send_pyobj(obj);
+
+    const char *msg = static_cast<const char *>(channel.shared_mem);
+    size_t len = 0;
+    memcpy(&len, msg, sizeof(size_t));
+    bool compact = is_compact(msg + sizeof(size_t), len);
+    ASSERT_EQ(compact, obj.is(small));
+
+    py::object received = channel.receive_pyobj(true);
+    ASSERT_EQ(received.equal(obj), true);
+    channel.dispose();
+  }
+
+  channel_test channel;
+  channel.set_compact(true);
+  std::vector<py::object> objs = {small, other, py::cast(42)};
+  channel.send_pyobj_many(objs);
+  std::vector<py::object> received = channel.receive_pyobj_many(3, true);
+  ASSERT_EQ(received.size(), 3u);
+  for (size_t i = 0; i < objs.size(); i++)
+    ASSERT_EQ(received[i].equal(objs[i]), true);
+
+  // malformed messages are rejected rather than misread
+  const char truncated[] = {static_cast<char>(COMPACT_TAG), 'i', 1, 2};
+  ASSERT_THROW(compact_decode(truncated, sizeof(truncated)),
+               std::runtime_error);
+
+  channel.dispose();
+}
+
 TEST(ChannelTest, IpcSmallObj) {
   channel_test channel;
 
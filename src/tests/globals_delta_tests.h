@@ -0,0 +1,62 @@
+#ifndef SNAKEFISH_GLOBALS_DELTA_TESTS_H
+#define SNAKEFISH_GLOBALS_DELTA_TESTS_H
+
+#include <gtest/gtest.h>
+
+#include <pybind11/embed.h>
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "globals_delta.h"
+using namespace snakefish;
+
+TEST(GlobalsDeltaTest, ExtractMerge) {
+  py::exec(R"(
+delta_test_int = 1
+delta_test_list = [1, 2]
+delta_test_str = "a"
+)");
+  py::dict globals = py::globals();
+  globals_delta d;
+  ASSERT_GE(d.get_n_tracked(), 3u);
+  ASSERT_EQ(d.extract(globals).size(), 0u);
+
+  // rebound, changed in place, and new globals are extracted
+  py::exec(R"(
+delta_test_int = 2
+delta_test_list.append(3)
+delta_test_new = {"x": 1}
+)");
+  py::dict delta = d.extract(globals);
+  ASSERT_EQ(delta.size(), 3u);
+  ASSERT_TRUE(delta.contains("delta_test_int"));
+  ASSERT_TRUE(delta.contains("delta_test_list"));
+  ASSERT_TRUE(delta.contains("delta_test_new"));
+
+  // merged globals are part of the snapshot afterwards
+  py::dict other;
+  d.merge(other, delta);
+  ASSERT_EQ(other.size(), 3u);
+  ASSERT_EQ(other["delta_test_int"].cast<int>(), 2);
+  ASSERT_EQ(d.extract(globals).size(), 0u);
+}
+
+TEST(GlobalsDeltaTest, Names) {
+  py::exec(R"(
+delta_test_x = 1
+delta_test_y = 1
+)");
+  py::dict globals = py::globals();
+  globals_delta d(py::make_tuple("delta_test_x"));
+  ASSERT_EQ(d.get_n_tracked(), 1u);
+
+  py::exec(R"(
+delta_test_x = 2
+delta_test_y = 2
+)");
+  py::dict delta = d.extract(globals);
+  ASSERT_EQ(delta.size(), 1u);
+  ASSERT_TRUE(delta.contains("delta_test_x"));
+}
+
+#endif // SNAKEFISH_GLOBALS_DELTA_TESTS_H
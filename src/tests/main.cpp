@@ -3,11 +3,24 @@
 #include <pybind11/embed.h>
 namespace py = pybind11;
 
+#include "affinity_tests.h"
 #include "channel_tests.h"
+#include "globals_delta_tests.h"
+#include "misc_tests.h"
+#include "mpmc_channel_tests.h"
+#include "object_store_tests.h"
+#include "pool_tests.h"
+#include "shared_array_tests.h"
+#include "shm_pool_tests.h"
 
 int main(int argc, char **argv) {
   py::scoped_interpreter guard{};
 
+  // normally registered when the snakefish module is imported
+  py::class_<message_view>(py::module::import("__main__"), "MessageView",
+                           py::buffer_protocol())
+      .def_buffer(&message_view::get_buffer_info);
+
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 }
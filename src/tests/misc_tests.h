@@ -0,0 +1,195 @@
+#ifndef SNAKEFISH_MISC_TESTS_H
+#define SNAKEFISH_MISC_TESTS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <pybind11/embed.h>
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "misc.h"
+#include "shared_array.h"
+using namespace snakefish;
+
+static py::object get_misc_test_func(const char *name) {
+  // functions must be defined before the threads are spawned
+  py::exec(R"(
+def misc_test_str(x):
+    if x == 42:
+        raise ValueError("42")
+    return str(x) + ","
+
+def misc_test_concat(x, y):
+    return x + y
+
+def misc_test_skewed(x):
+    import time
+    if x % 16 == 0:
+        time.sleep(0.005)
+    return x * x
+)");
+  return py::module::import("__main__").attr(name);
+}
+
+static std::string get_concat_result(int n) {
+  std::string s;
+  for (int i = 0; i < n; i++) {
+    s.append(std::to_string(i));
+    s.append(",");
+  }
+  return s;
+}
+
+TEST(MiscTest, MapReduce) {
+  py::object f = get_misc_test_func("misc_test_str");
+  py::object combine = get_misc_test_func("misc_test_concat");
+
+  // concatenation isn't commutative, so this also checks the order in which
+  // partial results are combined
+  for (uint concurrency : {1u, 2u, 3u, 5u, 8u}) {
+    for (int n : {1, 2, 7, 40}) {
+      py::object result =
+          map_reduce(f, combine, py::eval("range")(n), concurrency);
+      ASSERT_EQ(result.cast<std::string>(), get_concat_result(n));
+
+      py::list strs = py::eval("lambda n: [str(i) + ',' for i in range(n)]")(n);
+      result = snakefish::reduce(combine, strs, concurrency);
+      ASSERT_EQ(result.cast<std::string>(), get_concat_result(n));
+    }
+  }
+
+  try {
+    map_reduce(f, combine, py::eval("range(0)"), 3);
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_EQ(std::string(e.what()),
+              "reduction of empty args with no initial value");
+  }
+}
+
+TEST(MiscTest, MapReduceInitial) {
+  py::object f = get_misc_test_func("misc_test_str");
+  py::object combine = get_misc_test_func("misc_test_concat");
+  py::object initial = py::str("init,");
+
+  for (uint concurrency : {1u, 3u, 5u}) {
+    for (int n : {0, 1, 2, 7, 40}) {
+      py::object result = map_reduce_initial(f, combine, py::eval("range")(n),
+                                             initial, concurrency);
+      ASSERT_EQ(result.cast<std::string>(), "init," + get_concat_result(n));
+
+      py::list strs = py::eval("lambda n: [str(i) + ',' for i in range(n)]")(n);
+      result = reduce_initial(combine, strs, initial, concurrency);
+      ASSERT_EQ(result.cast<std::string>(), "init," + get_concat_result(n));
+    }
+  }
+}
+
+TEST(MiscTest, MapReduceException) {
+  py::object f = get_misc_test_func("misc_test_str");
+  py::object combine = get_misc_test_func("misc_test_concat");
+
+  // the failing worker is neither the first nor the last one
+  try {
+    map_reduce(f, combine, py::eval("range(100)"), 5);
+    FAIL();
+  } catch (py::error_already_set &e) {
+    ASSERT_TRUE(e.matches(PyExc_ValueError));
+  }
+
+  // nothing is left behind by the failed reduction
+  py::object result = map_reduce(f, combine, py::eval("range(10)"), 5);
+  ASSERT_EQ(result.cast<std::string>(), get_concat_result(10));
+}
+
+TEST(MiscTest, DynamicMap) {
+  py::object f = get_misc_test_func("misc_test_skewed");
+
+  // items take uneven time, so chunks finish out of order
+  for (uint concurrency : {1u, 3u, 8u}) {
+    for (int n : {0, 2, 5, 257}) {
+      for (uint chunksize : {0u, 4u}) {
+        std::vector<py::object> results = snakefish::map(
+            f, py::eval("range")(n), concurrency, chunksize, true);
+        ASSERT_EQ(results.size(), n);
+        for (int i = 0; i < n; i++) {
+          ASSERT_EQ(results[i].cast<int>(), i * i);
+        }
+      }
+    }
+  }
+
+  py::object g = get_misc_test_func("misc_test_str");
+  try {
+    snakefish::map(g, py::eval("range(100)"), 3, 0, true);
+    FAIL();
+  } catch (py::error_already_set &e) {
+    ASSERT_TRUE(e.matches(PyExc_ValueError));
+  }
+}
+
+TEST(MiscTest, ParallelFor) {
+  const ssize_t max_n = 1001;
+  shared_array a = shared_array({max_n + 1}, sizeof(int64_t), "q");
+  auto *counts = static_cast<int64_t *>(a.get_ptr());
+
+  // count how many times each index is visited, including past the end
+  py::cpp_function f = [counts](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      counts[i]++;
+    }
+  };
+
+  for (uint concurrency : {1u, 3u, 8u}) {
+    for (ssize_t n : {0, 1, 7, 1000, 1001}) {
+      for (uint chunksize : {0u, 1u, 16u, 64u}) {
+        std::fill(counts, counts + max_n + 1, 0);
+        parallel_for(f, n, chunksize, concurrency, py::none(), -1);
+        for (ssize_t i = 0; i < n; i++) {
+          ASSERT_EQ(counts[i], 1);
+        }
+        for (ssize_t i = n; i <= max_n; i++) {
+          ASSERT_EQ(counts[i], 0);
+        }
+      }
+    }
+  }
+
+  a.dispose();
+}
+
+TEST(MiscTest, ParallelForException) {
+  const ssize_t n = 1000;
+  shared_array a = shared_array({n}, sizeof(int64_t), "q");
+  auto *counts = static_cast<int64_t *>(a.get_ptr());
+
+  // the range containing index 500 fails after it's done
+  py::cpp_function f = [counts](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      counts[i]++;
+    }
+    if (start <= 500 && 500 < end) {
+      throw py::value_error("500");
+    }
+  };
+
+  try {
+    parallel_for(f, n, 4, 3, py::none(), -1);
+    FAIL();
+  } catch (py::error_already_set &e) {
+    ASSERT_TRUE(e.matches(PyExc_ValueError));
+  }
+
+  // the other workers ran to completion before the exception was rethrown
+  for (ssize_t i = 0; i < n; i++) {
+    ASSERT_EQ(counts[i], 1);
+  }
+
+  a.dispose();
+}
+
+#endif // SNAKEFISH_MISC_TESTS_H
@@ -0,0 +1,136 @@
+#ifndef SNAKEFISH_MPMC_CHANNEL_TESTS_H
+#define SNAKEFISH_MPMC_CHANNEL_TESTS_H
+
+#include <atomic>
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mpmc_channel.h"
+#include "test_util.h"
+#include "util.h"
+using namespace snakefish;
+
+TEST(MpmcChannelTest, ReadWrite) {
+  mpmc_channel channel = mpmc_channel(4, 64);
+  buffer bytes = get_random_bytes(64);
+
+  // fill every slot, wrapping around a few times
+  for (int lap = 0; lap < 3; lap++) {
+    for (size_t i = 0; i < 4; i++) {
+      channel.send_bytes(static_cast<char *>(bytes.get_ptr()) + i, 64 - i);
+    }
+    try {
+      channel.send_bytes(bytes.get_ptr(), 1);
+      FAIL();
+    } catch (const std::overflow_error &e) {
+      ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+      ASSERT_TRUE(channel.is_ready());
+      buffer buf = channel.receive_bytes(false);
+      ASSERT_EQ(buf.get_len(), 64 - i);
+      ASSERT_EQ(memcmp(buf.get_ptr(),
+                       static_cast<char *>(bytes.get_ptr()) + i, 64 - i),
+                0);
+    }
+    ASSERT_FALSE(channel.is_ready());
+  }
+
+  // larger than a slot
+  try {
+    channel.send_bytes(bytes.get_ptr(), 65, true);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "message is larger than the slot size");
+  }
+
+  // nothing to receive
+  try {
+    channel.receive_bytes(false);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "out-of-bounds read detected");
+  }
+  try {
+    channel.receive_bytes(true, 0.01);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "receive timed out");
+  }
+
+  channel.dispose();
+}
+
+TEST(MpmcChannelTest, IpcReadWrite) {
+  const uint32_t n_producers = 4;
+  const uint32_t n_consumers = 3;
+  const uint32_t n_messages = 2000; // per producer
+  const uint32_t done = UINT32_MAX;
+
+  // a few slots, so that everybody has to wait for everybody else
+  mpmc_channel channel = mpmc_channel(8, 2 * sizeof(uint32_t));
+  auto *seen = static_cast<std::atomic_uint *>(util::get_shared_mem(
+      n_producers * n_messages * sizeof(std::atomic_uint), true));
+
+  std::vector<pid_t> consumers;
+  for (uint32_t i = 0; i < n_consumers; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      while (true) {
+        buffer buf = channel.receive_bytes(true);
+        uint32_t msg[2];
+        memcpy(msg, buf.get_ptr(), sizeof(msg));
+        if (msg[0] == done)
+          std::exit(0);
+        seen[msg[0] * n_messages + msg[1]].fetch_add(1);
+      }
+    }
+    consumers.push_back(pid);
+  }
+
+  std::vector<pid_t> producers;
+  for (uint32_t i = 0; i < n_producers; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      for (uint32_t j = 0; j < n_messages; j++) {
+        uint32_t msg[2] = {i, j};
+        channel.send_bytes(msg, sizeof(msg), true);
+      }
+      std::exit(0);
+    }
+    producers.push_back(pid);
+  }
+
+  // stop the consumers once the producers are done
+  for (pid_t pid : producers) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+  for (uint32_t i = 0; i < n_consumers; i++) {
+    uint32_t msg[2] = {done, 0};
+    channel.send_bytes(msg, sizeof(msg), true);
+  }
+  for (pid_t pid : consumers) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+
+  // every message was received exactly once
+  for (uint32_t i = 0; i < n_producers * n_messages; i++) {
+    ASSERT_EQ(seen[i].load(), 1u);
+  }
+
+  munmap(seen, n_producers * n_messages * sizeof(std::atomic_uint));
+  channel.dispose();
+}
+
+#endif // SNAKEFISH_MPMC_CHANNEL_TESTS_H
@@ -0,0 +1,113 @@
+#ifndef SNAKEFISH_OBJECT_STORE_TESTS_H
+#define SNAKEFISH_OBJECT_STORE_TESTS_H
+
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "object_store.h"
+#include "test_util.h"
+using namespace snakefish;
+
+TEST(ObjectStoreTest, PutGetRelease) {
+  object_store store = object_store(64 * 1024, 2);
+  buffer bytes = get_random_bytes(1000);
+
+  uint64_t h = store.put_bytes(bytes.get_ptr(), bytes.get_len());
+  ASSERT_GT(store.get_used(), 1000u);
+  {
+    object_view view = store.get(h);
+    ASSERT_EQ(view.get_len(), 1000u);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(view.get_ptr()) % 64, 0u);
+    ASSERT_EQ(memcmp(view.get_ptr(), bytes.get_ptr(), 1000), 0);
+
+    // the view keeps the object alive
+    store.release(h);
+    ASSERT_EQ(memcmp(view.get_ptr(), bytes.get_ptr(), 1000), 0);
+  }
+
+  // the last reference is gone
+  ASSERT_EQ(store.get_used(), 0u);
+  try {
+    store.get(h);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid or released handle");
+  }
+
+  // the entry is reused, but the old handle stays invalid
+  uint64_t h2 = store.put_bytes(bytes.get_ptr(), 10);
+  ASSERT_NE(h, h2);
+  try {
+    store.retain(h);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid or released handle");
+  }
+  store.retain(h2);
+  store.release(h2);
+  store.release(h2);
+  ASSERT_EQ(store.get_used(), 0u);
+
+  store.dispose();
+}
+
+TEST(ObjectStoreTest, Full) {
+  object_store store = object_store(64 * 1024, 2);
+  buffer bytes = get_random_bytes(60 * 1024);
+
+  // out of space
+  uint64_t h1 = store.put_bytes(bytes.get_ptr(), 40 * 1024);
+  try {
+    store.put_bytes(bytes.get_ptr(), 40 * 1024);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "object store is full");
+  }
+
+  // out of entries
+  uint64_t h2 = store.put_bytes(bytes.get_ptr(), 1);
+  try {
+    store.put_bytes(bytes.get_ptr(), 1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "object store is full");
+  }
+
+  // freed blocks are merged, so the whole arena is usable again
+  store.release(h1);
+  store.release(h2);
+  uint64_t h3 = store.put_bytes(bytes.get_ptr(), bytes.get_len());
+  store.release(h3);
+
+  store.dispose();
+}
+
+TEST(ObjectStoreTest, IpcGet) {
+  object_store store = object_store(1024 * 1024, 16);
+  buffer bytes = get_random_bytes(512 * 1024);
+  uint64_t h = store.put_bytes(bytes.get_ptr(), bytes.get_len());
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // drops the parent's reference too, so the object is freed
+    object_view view = store.get(h);
+    int ok = memcmp(view.get_ptr(), bytes.get_ptr(), bytes.get_len()) == 0;
+    store.release(h);
+    view.release();
+    std::exit(ok ? 0 : 1);
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+  ASSERT_EQ(store.get_used(), 0u);
+
+  store.dispose();
+}
+
+#endif // SNAKEFISH_OBJECT_STORE_TESTS_H
@@ -0,0 +1,146 @@
+#ifndef SNAKEFISH_POOL_TESTS_H
+#define SNAKEFISH_POOL_TESTS_H
+
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include <pybind11/embed.h>
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "pool.h"
+using namespace snakefish;
+
+static py::object get_pool_test_func(const char *name) {
+  // functions must be defined before the pool is created
+  py::exec(R"(
+def pool_test_square(x):
+    return x * x
+
+def pool_test_add(x, y):
+    return x + y
+
+def pool_test_fail(x):
+    if x == 42:
+        raise ValueError("42")
+    return x
+)");
+  return py::module::import("__main__").attr(name);
+}
+
+TEST(PoolTest, Map) {
+  py::object f = get_pool_test_func("pool_test_square");
+  pool p(4);
+  ASSERT_EQ(p.get_concurrency(), 4);
+
+  // the same workers serve every job
+  for (int n : {100, 3, 0, 1000}) {
+    std::vector<py::object> results = p.map(f, py::eval("range")(n));
+    ASSERT_EQ(results.size(), n);
+    for (int i = 0; i < n; i++) {
+      ASSERT_EQ(results[i].cast<int>(), i * i);
+    }
+  }
+
+  std::vector<py::object> results = p.map(f, py::eval("range(100)"), 7);
+  ASSERT_EQ(results.size(), 100);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(results[i].cast<int>(), i * i);
+  }
+
+  p.dispose();
+}
+
+TEST(PoolTest, StarmapAndApply) {
+  py::object f = get_pool_test_func("pool_test_add");
+  pool p(2);
+
+  std::vector<py::object> results =
+      p.starmap(f, py::eval("[(i, i) for i in range(100)]"));
+  ASSERT_EQ(results.size(), 100);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(results[i].cast<int>(), 2 * i);
+  }
+
+  py::object result = p.apply(f, py::make_tuple(40, 2));
+  ASSERT_EQ(result.cast<int>(), 42);
+
+  p.dispose();
+}
+
+TEST(PoolTest, Exception) {
+  py::object f = get_pool_test_func("pool_test_fail");
+  pool p(3);
+
+  try {
+    p.map(f, py::eval("range(100)"), 5);
+    FAIL();
+  } catch (py::error_already_set &e) {
+    ASSERT_TRUE(e.matches(PyExc_ValueError));
+  }
+
+  // the pool is still usable
+  std::vector<py::object> results = p.map(f, py::eval("range(42)"));
+  ASSERT_EQ(results.size(), 42);
+
+  p.close();
+  try {
+    p.map(f, py::eval("range(42)"));
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_EQ(std::string(e.what()), "this pool has been closed");
+  }
+
+  p.dispose();
+}
+
+TEST(PoolTest, Imap) {
+  py::object f = get_pool_test_func("pool_test_square");
+  pool p(3);
+
+  // ordered, with an infinite iterable
+  {
+    std::unique_ptr<imap_iterator> it =
+        p.imap(f, py::module::import("itertools").attr("count")(), 2, 4);
+    for (int i = 0; i < 1000; i++) {
+      ASSERT_EQ(it->next().cast<int>(), i * i);
+    }
+
+    // the pool is busy until the iterator is closed
+    try {
+      p.map(f, py::eval("range(10)"));
+      FAIL();
+    } catch (const std::runtime_error &e) {
+      ASSERT_EQ(std::string(e.what()),
+                "this pool is busy with an unfinished imap()");
+    }
+    it->close();
+  }
+
+  // unordered, until exhausted
+  {
+    std::unique_ptr<imap_iterator> it =
+        p.imap_unordered(f, py::eval("range(500)"));
+    std::vector<int> results;
+    try {
+      while (true) {
+        results.push_back(it->next().cast<int>());
+      }
+    } catch (py::stop_iteration &) {
+    }
+    std::sort(results.begin(), results.end());
+    ASSERT_EQ(results.size(), 500);
+    for (int i = 0; i < 500; i++) {
+      ASSERT_EQ(results[i], i * i);
+    }
+  }
+
+  // the iterators have released the pool
+  std::vector<py::object> results = p.map(f, py::eval("range(10)"));
+  ASSERT_EQ(results.size(), 10);
+
+  p.dispose();
+}
+
+#endif // SNAKEFISH_POOL_TESTS_H
@@ -0,0 +1,77 @@
+#ifndef SNAKEFISH_SHARED_ARRAY_TESTS_H
+#define SNAKEFISH_SHARED_ARRAY_TESTS_H
+
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shared_array.h"
+using namespace snakefish;
+
+TEST(SharedArrayTest, ChildWritesVisible) {
+  const ssize_t n = 100000;
+  shared_array a = shared_array({n}, sizeof(int64_t), "q");
+  ASSERT_EQ(a.get_len(), n * sizeof(int64_t));
+  auto *data = static_cast<int64_t *>(a.get_ptr());
+
+  // zero-initialized
+  for (ssize_t i = 0; i < n; i++) {
+    ASSERT_EQ(data[i], 0);
+  }
+
+  // each child fills its own half
+  pid_t pids[2];
+  for (int c = 0; c < 2; c++) {
+    pids[c] = fork();
+    if (pids[c] < 0) {
+      FAIL();
+    } else if (pids[c] == 0) {
+      for (ssize_t i = c * n / 2; i < (c + 1) * n / 2; i++) {
+        data[i] = i * i;
+      }
+      exit(0);
+    }
+  }
+  for (pid_t pid : pids) {
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+  }
+
+  for (ssize_t i = 0; i < n; i++) {
+    ASSERT_EQ(data[i], i * i);
+  }
+
+  a.dispose();
+  a.dispose(); // no-op
+}
+
+TEST(SharedArrayTest, BufferInfo) {
+  shared_array a = shared_array({3, 4}, sizeof(double), "d");
+  ASSERT_EQ(a.get_len(), 12 * sizeof(double));
+
+  py::buffer_info info = a.get_buffer_info();
+  ASSERT_EQ(info.ptr, a.get_ptr());
+  ASSERT_FALSE(info.readonly);
+  ASSERT_EQ(info.format, "d");
+  ASSERT_EQ(info.shape, std::vector<ssize_t>({3, 4}));
+  ASSERT_EQ(info.strides, std::vector<ssize_t>({32, 8}));
+
+  a.dispose();
+  try {
+    a.get_buffer_info();
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_EQ(std::string(e.what()), "array has been disposed");
+  }
+
+  // empty arrays are fine
+  shared_array empty = shared_array({0}, 1, "B");
+  ASSERT_EQ(empty.get_len(), 0u);
+  empty.dispose();
+}
+
+#endif // SNAKEFISH_SHARED_ARRAY_TESTS_H
@@ -0,0 +1,198 @@
+#ifndef SNAKEFISH_SHM_POOL_TESTS_H
+#define SNAKEFISH_SHM_POOL_TESTS_H
+
+#include <atomic>
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "shm_pool.h"
+using namespace snakefish;
+
+TEST(ShmPoolTest, SlotReuse) {
+  void *a = get_shared_slot(sizeof(std::atomic_size_t));
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(a) % SHARED_SLOT_SIZE, 0u);
+  ASSERT_EQ(static_cast<std::atomic_size_t *>(a)->load(), 0u);
+  static_cast<std::atomic_size_t *>(a)->store(42);
+
+  // freed slots are handed out again, zero-filled
+  free_shared_slot(a, sizeof(std::atomic_size_t));
+  void *b = get_shared_slot(sizeof(std::atomic_size_t));
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(static_cast<std::atomic_size_t *>(b)->load(), 0u);
+
+  // larger blocks fall back to mmap()
+  void *c = get_shared_slot(SHARED_SLOT_SIZE + 1);
+  free_shared_slot(c, SHARED_SLOT_SIZE + 1);
+
+  free_shared_slot(b, sizeof(std::atomic_size_t));
+}
+
+TEST(ShmPoolTest, IpcOwnership) {
+  auto *flag = static_cast<std::atomic_size_t *>(
+      get_shared_slot(sizeof(std::atomic_size_t)));
+  auto *ring = static_cast<char *>(get_shared_ring(4096));
+  ring[0] = 'a';
+
+  pid_t pid = fork_child();
+  if (pid == 0) {
+    // neither is recycled by a process that doesn't own it
+    free_shared_slot(flag, sizeof(std::atomic_size_t));
+    free_shared_ring(ring, 4096);
+    void *other = get_shared_slot(sizeof(std::atomic_size_t));
+    auto *other_ring = static_cast<char *>(get_shared_ring(4096));
+    other_ring[0] = 'b';
+    std::exit((other != flag) ? 0 : 1);
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  note_reaped();
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+  ASSERT_EQ(ring[0], 'a');
+
+  // the ring is recycled by its owner, since the child is gone
+  free_shared_ring(ring, 4096);
+  ASSERT_EQ(get_shared_ring(4096), ring);
+  free_shared_ring(ring, 4096);
+  free_shared_slot(flag, sizeof(std::atomic_size_t));
+}
+
+TEST(ShmPoolTest, SlotNotRecycledUnderChild) {
+  auto *flag = static_cast<std::atomic_size_t *>(
+      get_shared_slot(sizeof(std::atomic_size_t)));
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+
+  pid_t pid = fork_child();
+  if (pid == 0) {
+    // keep writing to the inherited slot after the parent freed it
+    close(fds[1]);
+    char c;
+    if (read(fds[0], &c, 1) != 1)
+      std::exit(1);
+    flag->store(7);
+    std::exit(0);
+  }
+  close(fds[0]);
+
+  // disposed before the child is joined, so the slot must not be handed out
+  // again while the child is running
+  free_shared_slot(flag, sizeof(std::atomic_size_t));
+  auto *other = static_cast<std::atomic_size_t *>(
+      get_shared_slot(sizeof(std::atomic_size_t)));
+  ASSERT_NE(other, flag);
+  other->store(1);
+  ASSERT_EQ(write(fds[1], "x", 1), 1);
+  close(fds[1]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  note_reaped();
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+  ASSERT_EQ(other->load(), 1u);
+  ASSERT_EQ(flag->load(), 7u);
+
+  // once the child is gone, slots are recycled again
+  free_shared_slot(other, sizeof(std::atomic_size_t));
+  void *a = get_shared_slot(sizeof(std::atomic_size_t));
+  free_shared_slot(a, sizeof(std::atomic_size_t));
+  ASSERT_EQ(get_shared_slot(sizeof(std::atomic_size_t)), a);
+  free_shared_slot(a, sizeof(std::atomic_size_t));
+}
+
+TEST(ShmPoolTest, RingNotRecycledUnderChild) {
+  auto *ring = static_cast<char *>(get_shared_ring(8192));
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+
+  pid_t pid = fork_child();
+  if (pid == 0) {
+    // keep writing to the inherited ring after the parent freed it
+    close(fds[1]);
+    char c;
+    if (read(fds[0], &c, 1) != 1)
+      std::exit(1);
+    ring[0] = 'c';
+    std::exit(0);
+  }
+  close(fds[0]);
+
+  // the child is still running, so the ring must not be handed out again
+  // (a recycled ring isn't zero-filled, but a fresh one is, even if it's
+  // mapped at the same address)
+  ring[0] = 'r';
+  free_shared_ring(ring, 8192);
+  auto *other = static_cast<char *>(get_shared_ring(8192));
+  ASSERT_EQ(other[0], 0);
+  other[0] = 'o';
+  ASSERT_EQ(write(fds[1], "x", 1), 1);
+  close(fds[1]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  note_reaped();
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+  ASSERT_EQ(other[0], 'o');
+
+  // nor after a fork that isn't counted, even once it's reaped
+  pid = fork();
+  if (pid == 0) {
+    std::exit(0);
+  }
+  waitpid(pid, &status, 0);
+  free_shared_ring(other, 8192);
+  auto *third = static_cast<char *>(get_shared_ring(8192));
+  ASSERT_EQ(third[0], 0);
+  free_shared_ring(third, 8192);
+}
+
+TEST(ShmPoolTest, RingArena) {
+  // this is what the forkserver does: the arena is mapped first...
+  reserve_ring_arena(64 * 1024 * 1024);
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // ...so a channel created after this fork can still be attached here
+    close(fds[1]);
+    channel_layout layout;
+    if (read(fds[0], &layout, sizeof(layout)) != sizeof(layout))
+      std::exit(1);
+    channel c(layout, -1);
+    buffer buf = c.receive_bytes(true);
+    bool ok = buf.get_len() == 6 && memcmp(buf.get_ptr(), "hello", 6) == 0;
+    std::exit(ok ? 0 : 1);
+  }
+  close(fds[0]);
+
+  channel c = channel(4096);
+  ASSERT_TRUE(c.is_premapped());
+  channel_layout layout = c.get_layout();
+  ASSERT_EQ(write(fds[1], &layout, sizeof(layout)),
+            static_cast<ssize_t>(sizeof(layout)));
+  close(fds[1]);
+  char msg[] = "hello";
+  c.send_bytes(msg, sizeof(msg));
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+  c.dispose();
+
+  // memory mapped elsewhere isn't premapped
+  auto *other = util::get_shared_mem(4096, false);
+  ASSERT_FALSE(is_premapped(other));
+  munmap(other, 4096);
+}
+
+#endif // SNAKEFISH_SHM_POOL_TESTS_H
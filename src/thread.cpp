@@ -1,3 +1,7 @@
+#include <cstring>
+
+#include "forkserver.h"
+#include "shm_pool.h"
 #include "thread.h"
 #include "util.h"
 
@@ -5,32 +9,132 @@ namespace snakefish {
 
 thread::thread(py::function f)
     : is_parent(false), child_pid(0), started(false), joined(false),
-      child_status(0), func(std::move(f)), extract_func(), merge_func(),
-      _channel(), merging(false) {
+      child_status(0), pid_fd(-1), func(std::move(f)), extract_func(),
+      merge_func(),
+      _channel(DEFAULT_CHANNEL_SIZE, true), merging(false) {
+
+  // results are mostly small values
+  _channel.set_compact(true);
 
   // create shared memory
   alive = static_cast<std::atomic_bool *>(
-      util::get_shared_mem(sizeof(std::atomic_bool), true));
+      get_shared_slot(sizeof(std::atomic_bool)));
   alive->store(false);
 }
 
 thread::thread(py::function f, py::function extract, py::function merge)
     : is_parent(false), child_pid(0), started(false), joined(false),
-      child_status(0), func(std::move(f)), extract_func(std::move(extract)),
-      merge_func(std::move(merge)), _channel(), merging(true) {
+      child_status(0), pid_fd(-1), func(std::move(f)),
+      extract_func(std::move(extract)),
+      merge_func(std::move(merge)), _channel(DEFAULT_CHANNEL_SIZE, true),
+      merging(true) {
+
+  // results are mostly small values
+  _channel.set_compact(true);
 
   // create shared memory
   alive = static_cast<std::atomic_bool *>(
-      util::get_shared_mem(sizeof(std::atomic_bool), true));
+      get_shared_slot(sizeof(std::atomic_bool)));
   alive->store(false);
 }
 
+thread::thread(py::function f, py::function extract, const bool merging,
+               channel c, std::atomic_bool *alive)
+    : is_parent(false), child_pid(0), started(true), alive(alive),
+      joined(false), child_status(0), pid_fd(-1), func(std::move(f)),
+      extract_func(std::move(extract)), merge_func(), _channel(std::move(c)),
+      merging(merging) {}
+
+/**
+ * \brief What a thread spawned by the forkserver gets from its parent. The
+ * functions are sent separately, pickled.
+ */
+struct thread_spawn_header {
+  channel_layout layout;
+  bool has_event_fd; // is the channel's eventfd passed along?
+  std::atomic_bool *alive;
+  bool merging;
+  cpu_set_t cpus; // empty for any CPU
+};
+
+void thread::run_spawned(const char *header, const py::object &payload,
+                         const std::vector<int> &fds) {
+  thread_spawn_header h;
+  memcpy(&h, header, sizeof(h));
+  py::tuple funcs = py::reinterpret_borrow<py::tuple>(payload);
+
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &h.cpus))
+      cpus.push_back(cpu);
+  }
+  set_affinity(cpus);
+
+  thread t(py::reinterpret_borrow<py::function>(funcs[0]),
+           py::reinterpret_borrow<py::function>(funcs[1]), h.merging,
+           channel(h.layout, h.has_event_fd ? fds[0] : -1), h.alive);
+  t.run();
+}
+
+bool thread::spawn_from_forkserver() {
+  if (!is_forkserver_running() || !_channel.is_premapped() ||
+      !is_premapped(alive)) {
+    return false;
+  }
+
+  // functions that can't be pickled by reference can't be sent over
+  py::bytes payload;
+  try {
+    payload = py::module::import("pickle").attr("dumps")(
+        py::make_tuple(func, merging ? py::object(extract_func) : py::none()),
+        PICKLE_PROTOCOL);
+  } catch (py::error_already_set &) {
+    return false;
+  }
+
+  thread_spawn_header h;
+  h.layout = _channel.get_layout();
+  h.has_event_fd = _channel.get_event_fd() != -1;
+  h.alive = alive;
+  h.merging = merging;
+  CPU_ZERO(&h.cpus);
+  for (int cpu : place.cpus)
+    CPU_SET(cpu, &h.cpus);
+  std::vector<int> fds;
+  if (h.has_event_fd)
+    fds.push_back(_channel.get_event_fd());
+
+  pid_t pid =
+      forkserver_spawn(spawn_kind::THREAD, &h, sizeof(h), payload, fds);
+  if (pid == 0)
+    return false;
+
+  is_parent = true;
+  child_pid = pid;
+  started = true;
+  alive->store(true);
+  return true;
+}
+
+void thread::set_placement(const placement &p) {
+  if (started) {
+    throw std::runtime_error("this thread has already been started");
+  }
+  place = p;
+}
+
 void thread::start() {
   if (started) {
     throw std::runtime_error("this thread has already been started");
   }
+  if (place.numa_node >= 0) {
+    _channel.set_numa_node(place.numa_node);
+  }
+  if (spawn_from_forkserver()) {
+    return;
+  }
 
-  pid_t pid = fork();
+  pid_t pid = fork_child();
   if (pid > 0) {
     is_parent = true;
     child_pid = pid;
@@ -40,6 +144,7 @@ void thread::start() {
     is_parent = false;
     child_pid = 0;
     started = true;
+    set_affinity(place.cpus);
     run();
   } else {
     perror("fork() failed");
@@ -56,7 +161,11 @@ void thread::join() {
     abort();
   }
 
-  int result = waitpid(child_pid, &child_status, 0);
+  int result;
+  {
+    util::gil_release nogil;
+    result = waitpid(child_pid, &child_status, 0);
+  }
   if (result == -1) {
     perror("waitpid() failed");
     throw std::runtime_error("waitpid() failed");
@@ -65,6 +174,7 @@ void thread::join() {
     abort();
   } else {
     joined = true;
+    note_reaped();
     if (merging) {
       globals = _channel.receive_pyobj(true);
       ret_val = _channel.receive_pyobj(true);
@@ -95,6 +205,7 @@ bool thread::try_join() {
     abort();
   } else {
     joined = true;
+    note_reaped();
     if (merging) {
       globals = _channel.receive_pyobj(true);
       ret_val = _channel.receive_pyobj(true);
@@ -106,6 +217,21 @@ bool thread::try_join() {
   }
 }
 
+bool thread::join(const double timeout) {
+  if (!started) {
+    throw std::runtime_error("this thread has not been started yet");
+  }
+  if (!is_parent) {
+    fprintf(stderr, "join() called from child!\n");
+    abort();
+  }
+
+  if (!util::wait_for_exit(child_pid, timeout)) {
+    return false;
+  }
+  return try_join();
+}
+
 int thread::get_exit_status() {
   if (!started || !joined) {
     throw std::runtime_error("exit status is not yet available");
@@ -186,9 +312,31 @@ py::object thread::get_result() {
   }
 }
 
+bool thread::is_ready() {
+  if (!started) {
+    throw std::runtime_error("this thread has not been started yet");
+  }
+  return joined || util::has_exited(child_pid);
+}
+
+int thread::get_event_fd() {
+  if (!started) {
+    throw std::runtime_error("this thread has not been started yet");
+  }
+  if (pid_fd == -1 && !joined) {
+    pid_fd = util::open_pidfd(child_pid);
+  }
+  return pid_fd;
+}
+
 void thread::dispose() {
-  if (munmap(alive, sizeof(std::atomic_bool))) {
-    perror("munmap() failed");
+  try {
+    free_shared_slot(alive, sizeof(std::atomic_bool));
+  } catch (...) {
+    abort();
+  }
+  if (pid_fd != -1 && close(pid_fd)) {
+    perror("close() failed");
     abort();
   }
   _channel.dispose();
@@ -5,12 +5,15 @@
 #ifndef SNAKEFISH_THREAD_H
 #define SNAKEFISH_THREAD_H
 
+#include <vector>
+
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <pybind11/pybind11.h>
 namespace py = pybind11;
 
+#include "affinity.h"
 #include "channel.h"
 
 namespace snakefish {
@@ -83,6 +86,15 @@ public:
    */
   thread(py::function f, py::function extract, py::function merge);
 
+  /**
+   * \brief Choose where this thread runs. See `placement`. By default, it
+   * can run on any CPU. The channel used to send its result is placed on
+   * `p.numa_node`.
+   *
+   * \throws std::runtime_error If this thread has already been started.
+   */
+  void set_placement(const placement &p);
+
   /**
    * \brief Start executing this thread. In other words, start executing the
    * underlying function.
@@ -114,6 +126,16 @@ public:
    */
   bool try_join();
 
+  /**
+   * \brief Join this thread, waiting for at most `timeout` seconds.
+   *
+   * \returns `true` if joined. `false` if `timeout` expired.
+   *
+   * \throws std::runtime_error If this thread hasn't been started yet OR if
+   * `waitpid()` failed.
+   */
+  bool join(double timeout);
+
   /**
    * \brief Get the status of the thread.
    *
@@ -146,16 +168,71 @@ public:
    */
   py::object get_result();
 
+  /**
+   * \brief Start keeping statistics of the channel used by this thread to
+   * send its result. See `channel::enable_stats()`.
+   *
+   * This must be called before `start()`.
+   */
+  void enable_stats() { _channel.enable_stats(); }
+
+  /**
+   * \brief Get the statistics of the channel used by this thread to send its
+   * result. See `channel::stats()`.
+   *
+   * \throws std::runtime_error If statistics are not enabled.
+   */
+  py::dict stats() { return _channel.stats(); }
+
+  /**
+   * \brief Check whether `join()` would return without blocking.
+   *
+   * \throws std::runtime_error If this thread hasn't been started yet OR if
+   * `waitid()` failed.
+   */
+  bool is_ready();
+
+  /**
+   * \brief Get a file descriptor that becomes readable when this thread
+   * terminates, or -1 if this isn't supported.
+   *
+   * \throws std::runtime_error If this thread hasn't been started yet.
+   */
+  int get_event_fd();
+
   /**
    * \brief Release resources held by this thread.
    */
   void dispose();
 
+  /**
+   * \brief Run a thread spawned by the forkserver. See `forkserver_spawn()`.
+   * This never returns.
+   */
+  [[noreturn]] static void run_spawned(const char *header,
+                                       const py::object &payload,
+                                       const std::vector<int> &fds);
+
 private:
+  /**
+   * \brief Attach to the shared state of a thread in the parent. See
+   * `run_spawned()`.
+   */
+  thread(py::function f, py::function extract, bool merging, channel c,
+         std::atomic_bool *alive);
+
+  /**
+   * \brief Try to have the forkserver spawn the child.
+   *
+   * \returns `true` if the child was spawned. `false` if it must be forked
+   * from this process instead.
+   */
+  bool spawn_from_forkserver();
+
   /**
    * \brief Run the underlying function and return the result to the parent.
    */
-  void run();
+  [[noreturn]] void run();
 
   bool is_parent;
   pid_t child_pid;
@@ -163,6 +240,7 @@ private:
   std::atomic_bool *alive;
   bool joined;
   int child_status;
+  int pid_fd; // pidfd of the child, or -1 if not opened
   py::function func;
   py::function extract_func;
   py::function merge_func;
@@ -172,6 +250,7 @@ private:
   py::object exc_traceback;
   channel _channel;
   bool merging; // should globals be merged?
+  placement place;
 };
 
 } // namespace snakefish
@@ -5,11 +5,26 @@
 #ifndef SNAKEFISH_UTIL_H
 #define SNAKEFISH_UTIL_H
 
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
 #include <cstdio>
 #include <new>
 #include <random>
+#include <stdexcept>
+#include <thread>
+#include <x86intrin.h>
 
+#include <poll.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace snakefish {
 
@@ -25,6 +40,70 @@ static inline uint64_t get_random_uint() {
   return dist(rng);
 }
 
+/**
+ * \brief Hint to the CPU that the caller is busy-waiting.
+ *
+ * This executes [`pause`](https://www.felixcloutier.com/x86/pause), which
+ * reduces power consumption and the penalty of leaving the spin loop.
+ */
+static inline void cpu_relax() { _mm_pause(); }
+
+/**
+ * \brief The longest timeout (in seconds) that's honored. Anything longer,
+ * including `inf` and `nan`, is as good as waiting forever, and would overflow
+ * the conversion to nanoseconds or milliseconds.
+ */
+static const double max_timeout = 1e9;
+
+/**
+ * \brief Clamp `timeout` to `[0, max_timeout]`, so that it can be safely added
+ * to a time point. `nan` is treated as infinite.
+ */
+static inline double clamp_timeout(const double timeout) {
+  if (!(timeout < max_timeout))
+    return max_timeout;
+  return std::max(timeout, 0.0);
+}
+
+/**
+ * \brief Convert a duration to a `poll()` timeout, rounding up and clamping it
+ * to what fits in an `int`.
+ */
+static inline int
+to_poll_ms(const std::chrono::duration<double, std::milli> d) {
+  return static_cast<int>(std::ceil(
+      std::min(std::max(d.count(), 0.0), static_cast<double>(INT_MAX))));
+}
+
+/**
+ * \brief Release the GIL for the lifetime of this object, if the calling
+ * thread holds it.
+ *
+ * This is used around blocking waits and large copies, so that other Python
+ * threads in the same process keep running. Unlike `py::gil_scoped_release`,
+ * this is a no-op when the GIL isn't held (e.g. from C++ code without an
+ * interpreter). No Python objects may be touched while it's alive.
+ */
+class gil_release {
+public:
+  gil_release()
+      : state((Py_IsInitialized() && PyGILState_Check()) ? PyEval_SaveThread()
+                                                         : nullptr) {}
+
+  ~gil_release() {
+    if (state != nullptr)
+      PyEval_RestoreThread(state);
+  }
+
+  gil_release(const gil_release &t) = delete;
+  gil_release &operator=(const gil_release &t) = delete;
+  gil_release(gil_release &&t) = delete;
+  gil_release &operator=(gil_release &&t) = delete;
+
+private:
+  PyThreadState *state;
+};
+
 /**
  * \brief Use `malloc()` to allocate some memory.
  *
@@ -82,6 +161,93 @@ static inline void *get_shared_mem(const size_t len, const bool reserve) {
   }
 }
 
+/**
+ * \brief Check whether a child process has exited, without reaping it.
+ *
+ * \throws std::runtime_error If `waitid()` failed.
+ */
+static inline bool has_exited(const pid_t pid) {
+  while (true) {
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0) {
+      return info.si_pid == pid;
+    } else if (errno != EINTR) {
+      perror("waitid() failed");
+      throw std::runtime_error("waitid() failed");
+    }
+  }
+}
+
+/**
+ * \brief Get a file descriptor that becomes readable when a child process
+ * exits.
+ *
+ * \returns The file descriptor, which must be closed by the caller, or -1 if
+ * the system doesn't support `pidfd_open()`.
+ */
+static inline int open_pidfd(const pid_t pid) {
+#ifdef SYS_pidfd_open
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+/**
+ * \brief Wait for a child process to exit, without reaping it.
+ *
+ * If possible, this waits on a pidfd. Otherwise, this polls `waitid()` with
+ * an increasing delay.
+ *
+ * \param pid The child process.
+ * \param timeout The maximum number of seconds to wait.
+ *
+ * \returns `true` if the child has exited. `false` if `timeout` expired.
+ *
+ * \throws std::runtime_error If `waitid()` or `poll()` failed.
+ */
+static inline bool wait_for_exit(const pid_t pid, const double timeout) {
+  gil_release nogil;
+  auto deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(clamp_timeout(timeout)));
+
+  int fd = open_pidfd(pid);
+  if (fd >= 0) {
+    while (true) {
+      std::chrono::duration<double, std::milli> remaining =
+          deadline - std::chrono::steady_clock::now();
+      struct pollfd pfd = {fd, POLLIN, 0};
+      int result = poll(&pfd, 1, to_poll_ms(remaining));
+      if (result == -1 && errno == EINTR) {
+        continue;
+      }
+      close(fd);
+      if (result == -1) {
+        perror("poll() failed");
+        throw std::runtime_error("poll() failed");
+      }
+      return result > 0;
+    }
+  }
+
+  auto delay = std::chrono::microseconds(50);
+  while (!has_exited(pid)) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::min(
+        std::chrono::duration<double>(delay),
+        std::chrono::duration<double>(deadline - now)));
+    delay = std::min(delay * 2, std::chrono::microseconds(10000));
+  }
+  return true;
+}
+
 } // namespace util
 
 } // namespace snakefish
@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#include <poll.h>
+
+#include "util.h"
+#include "wait.h"
+
+namespace snakefish {
+
+static bool is_ready(const wait_target &target) {
+  if (target.c != nullptr)
+    return target.c->is_ready();
+  else if (target.t != nullptr)
+    return target.t->is_ready();
+  else
+    return target.g->is_ready();
+}
+
+static int get_event_fd(const wait_target &target) {
+  if (target.c != nullptr)
+    return target.c->get_event_fd();
+  else if (target.t != nullptr)
+    return target.t->get_event_fd();
+  else
+    return target.g->get_event_fd();
+}
+
+static void begin_wait(const wait_target &target) {
+  if (target.c != nullptr)
+    target.c->begin_wait();
+  else if (target.g != nullptr)
+    target.g->begin_wait();
+}
+
+static void end_wait(const wait_target &target) {
+  if (target.c != nullptr)
+    target.c->end_wait();
+  else if (target.g != nullptr)
+    target.g->end_wait();
+}
+
+static void clear_event(const wait_target &target) {
+  if (target.c != nullptr)
+    target.c->clear_event();
+  else if (target.g != nullptr)
+    target.g->clear_event();
+}
+
+static std::vector<size_t> _wait(const std::vector<wait_target> &targets,
+                                 const double timeout) {
+  auto deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(util::clamp_timeout(timeout)));
+
+  // if some target can't be waited on, fall back to polling
+  std::vector<struct pollfd> fds;
+  bool can_sleep = true;
+  for (const wait_target &target : targets) {
+    int fd = get_event_fd(target);
+    if (fd == -1)
+      can_sleep = false;
+    else
+      fds.push_back({fd, POLLIN, 0});
+  }
+
+  std::vector<size_t> ready;
+  auto delay = std::chrono::microseconds(50);
+  while (true) {
+    // clear the events before checking, so that anything which becomes ready
+    // afterwards wakes up poll()
+    for (const wait_target &target : targets)
+      clear_event(target);
+    for (size_t i = 0; i < targets.size(); i++) {
+      if (is_ready(targets[i]))
+        ready.push_back(i);
+    }
+    if (!ready.empty())
+      return ready;
+
+    int ms = -1;
+    if (timeout >= 0) {
+      std::chrono::duration<double, std::milli> remaining =
+          deadline - std::chrono::steady_clock::now();
+      if (remaining.count() <= 0)
+        return ready;
+      ms = util::to_poll_ms(remaining);
+    }
+    if (!can_sleep) {
+      int delay_ms = static_cast<int>(std::ceil(delay.count() / 1000.0));
+      ms = (ms < 0) ? delay_ms : std::min(ms, delay_ms);
+      delay = std::min(delay * 2, std::chrono::microseconds(10000));
+    }
+
+    int result;
+    {
+      util::gil_release nogil;
+      result = poll(fds.data(), fds.size(), ms);
+    }
+    if (result == -1 && errno != EINTR) {
+      perror("poll() failed");
+      throw std::runtime_error("poll() failed");
+    }
+  }
+}
+
+std::vector<size_t> wait(const std::vector<wait_target> &targets,
+                         const double timeout) {
+  if (targets.empty())
+    return std::vector<size_t>();
+
+  // register before checking, so that no send goes unnoticed
+  for (const wait_target &target : targets)
+    begin_wait(target);
+
+  try {
+    std::vector<size_t> ready = _wait(targets, timeout);
+    for (const wait_target &target : targets)
+      end_wait(target);
+    return ready;
+  } catch (...) {
+    for (const wait_target &target : targets)
+      end_wait(target);
+    throw;
+  }
+}
+
+} // namespace snakefish
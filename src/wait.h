@@ -0,0 +1,69 @@
+/**
+ * \file wait.h
+ *
+ * \brief Waiting on many channels, threads, and generators at once.
+ */
+
+#ifndef SNAKEFISH_WAIT_H
+#define SNAKEFISH_WAIT_H
+
+#include <vector>
+
+#include "channel.h"
+#include "generator.h"
+#include "thread.h"
+
+namespace snakefish {
+
+/**
+ * \brief Something `wait()` can wait on. Exactly one of the pointers is set.
+ */
+struct wait_target {
+  /**
+   * \brief Wait for `c` to have an unread message.
+   */
+  explicit wait_target(channel *c) : c(c), t(nullptr), g(nullptr) {}
+
+  /**
+   * \brief Wait for `t` to terminate.
+   */
+  explicit wait_target(thread *t) : c(nullptr), t(t), g(nullptr) {}
+
+  /**
+   * \brief Wait for `g` to have its next output ready.
+   */
+  explicit wait_target(generator *g) : c(nullptr), t(nullptr), g(g) {}
+
+  channel *c;
+  thread *t;
+  generator *g;
+};
+
+/**
+ * \brief Wait until at least one of `targets` is ready.
+ *
+ * A channel is ready when it has an unread message, a thread is ready when
+ * `join()` wouldn't block, and a generator is ready when `next()` wouldn't
+ * block. Readiness is checked without receiving or joining anything.
+ *
+ * On Linux, this sleeps on the channels' `eventfd`s and the threads' pidfds
+ * with `poll()`, so the cost of waiting doesn't depend on how long it takes
+ * for something to become ready. Elsewhere, the targets are polled with an
+ * increasing delay.
+ *
+ * \param targets The targets.
+ * \param timeout The maximum number of seconds to wait. Negative means no
+ * timeout.
+ *
+ * \returns The indices (in `targets`) of the targets that are ready, in
+ * order. This is empty only if `timeout` expired or `targets` is empty.
+ *
+ * \throws std::runtime_error If some thread or generator hasn't been started
+ * yet, or if some system call failed.
+ */
+std::vector<size_t> wait(const std::vector<wait_target> &targets,
+                         double timeout);
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_WAIT_H